@@ -0,0 +1,245 @@
+#include "clock.h"
+
+#include "lapic.h"
+#include "lib.h"
+#include "pit.h"
+#include "rtc.h"
+#include "x86_desc.h"
+
+/* HPET registers, at the address QEMU and most chipsets put it. It is in the 4MB page
+ * `paging_map_apic` maps uncached, so it is only looked for when there is a local APIC. */
+#define HPET_BASE 0xFED00000
+#define HPET_CAPS 0x000
+#define HPET_PERIOD 0x004 // high half of the capabilities: femtoseconds per count
+#define HPET_CONFIG 0x010
+#define HPET_COUNTER_LO 0x0F0
+#define HPET_COUNTER_HI 0x0F4
+
+/* Capabilities: revision ID (never 0) and 64-bit main counter */
+#define HPET_REV_ID 0xFF
+#define HPET_COUNT_SIZE_CAP (1 << 13)
+/* Configuration: main counter runs */
+#define HPET_ENABLE 0x1
+/* The spec's longest period, 100 ns */
+#define HPET_MAX_PERIOD 100000000
+#define FS_PER_NS 1000000
+
+/* Keeps the compiler from moving the time page accesses across the `seq` changes, x86 keeps
+ * loads in order with loads and stores with stores */
+#define barrier() asm volatile("" : : : "memory")
+
+/* Largest shift tried for a conversion, counts * mult must not overflow before it */
+#define CLOCK_MAX_SHIFT 32
+
+static inline uint32_t hpet_read(uint32_t reg) { return *(volatile uint32_t *)(HPET_BASE + reg); }
+
+static inline void hpet_write(uint32_t reg, uint32_t val) {
+    *(volatile uint32_t *)(HPET_BASE + reg) = val;
+}
+
+/*
+ * uint64_t tsc_read(void)
+ * Inputs: None
+ * Return Value: Time stamp counter of this CPU
+ * Function: Reads the TSC clocksource
+ */
+static uint64_t tsc_read(void) { return rdtsc(); }
+
+/*
+ * uint64_t hpet_read_counter(void)
+ * Inputs: None
+ * Return Value: HPET main counter
+ * Function: Reads the 64-bit main counter one half at a time, again if the low half wrapped
+ *           between the reads of the high half
+ */
+static uint64_t hpet_read_counter(void) {
+    uint32_t high, low;
+    do {
+        high = hpet_read(HPET_COUNTER_HI);
+        low = hpet_read(HPET_COUNTER_LO);
+    } while (high != hpet_read(HPET_COUNTER_HI));
+    return ((uint64_t)high << 32) | low;
+}
+
+static clocksource_t clocksources[] = {
+    [CLOCKSOURCE_TSC] = {"tsc", tsc_read, 0, 0},
+    [CLOCKSOURCE_HPET] = {"hpet", hpet_read_counter, 0, 0},
+};
+
+/* The selected clocksource */
+static clocksource_t *clock_cs = &clocksources[CLOCKSOURCE_TSC];
+
+/* The time page, padded to a whole page so nothing else shows through its user mapping. Only the
+ * PIT interrupt (and `clock_init` before it) writes it. */
+static union {
+    clock_page_t data;
+    uint8_t bytes[FOURKB_BITS];
+} clock_time_page __attribute__((aligned(FOURKB_BITS)));
+
+/*
+ * void clock_set_rate(clocksource_t *cs, uint32_t ns, uint32_t counts)
+ * Inputs: cs - clocksource to set up
+ *         ns, counts - the clocksource counts `counts` in `ns` nanoseconds (or any unit, as long as
+ *                      ns/counts is nanoseconds per count)
+ * Return Value: None
+ * Function: Picks the largest shift that keeps mult in 32 bits, for the most precision
+ */
+static void clock_set_rate(clocksource_t *cs, uint32_t ns, uint32_t counts) {
+    uint32_t shift = CLOCK_MAX_SHIFT;
+    while (shift > 0 && ((uint64_t)ns << shift) >= ((uint64_t)counts << 32)) {
+        shift--;
+    }
+    cs->shift = shift;
+    cs->mult = div64_32((uint64_t)ns << shift, counts, NULL);
+}
+
+/*
+ * uint64_t clock_counts_to_ns(const clocksource_t *cs, uint64_t counts)
+ * Inputs: cs - clocksource the counts come from
+ *         counts - number of counts
+ * Return Value: counts * mult >> shift, in nanoseconds
+ * Function: Converts with two 32x32 multiplies, so the product doesn't need 96 bits
+ */
+static uint64_t clock_counts_to_ns(const clocksource_t *cs, uint64_t counts) {
+    uint64_t high = (uint64_t)(uint32_t)(counts >> 32) * cs->mult;
+    uint64_t low = (uint64_t)(uint32_t)counts * cs->mult;
+    return (high << (32 - cs->shift)) + (low >> cs->shift);
+}
+
+/*
+ * uint64_t clock_since_base(uint64_t counts, uint64_t base)
+ * Inputs: counts - clocksource count read on this CPU
+ *         base - the time page's base count
+ * Return Value: counts - base, or 0 if counts is before the base
+ * Function: The CPU that took the base may have a TSC slightly ahead of this one's, a negative
+ *           difference would wrap to centuries. The clock stays at the base instead.
+ */
+static uint64_t clock_since_base(uint64_t counts, uint64_t base) {
+    return (int64_t)(counts - base) < 0 ? 0 : counts - base;
+}
+
+/*
+ * int32_t hpet_init(void)
+ * Inputs: None
+ * Return Value: 0 if there is a usable HPET, -1 otherwise
+ * Function: Checks the HPET capabilities, starts its main counter and sets up its conversion
+ */
+static int32_t hpet_init(void) {
+    if (!lapic_present()) {
+        return -1;
+    }
+
+    uint32_t caps = hpet_read(HPET_CAPS);
+    uint32_t period = hpet_read(HPET_PERIOD);
+    if (caps == 0xFFFFFFFF || (caps & HPET_REV_ID) == 0 || !(caps & HPET_COUNT_SIZE_CAP) ||
+        period == 0 || period > HPET_MAX_PERIOD) {
+        return -1;
+    }
+
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) | HPET_ENABLE);
+    clock_set_rate(&clocksources[CLOCKSOURCE_HPET], period, FS_PER_NS);
+    return 0;
+}
+
+/*
+ * void clock_init(uint32_t source)
+ * Inputs: source - CLOCKSOURCE_TSC or CLOCKSOURCE_HPET
+ * Return Value: None
+ * Function: Sets up the TSC from the calibration `pit_init` did, and the HPET if it is asked
+ *           for and present, then takes the wall-clock time from the RTC. Called after
+ *           `pit_init`. The TSC counts at the same rate on every CPU on the machines this runs
+ *           on (QEMU and anything with an invariant TSC).
+ */
+void clock_init(uint32_t source) {
+    uint32_t tick_ns = div64_32((uint64_t)PIT_RATE * NS_PER_SEC, PIT_FREQ, NULL);
+    clock_set_rate(&clocksources[CLOCKSOURCE_TSC], tick_ns, pit_tsc_counts);
+
+    if (source == CLOCKSOURCE_HPET && hpet_init() == 0) {
+        clock_cs = &clocksources[CLOCKSOURCE_HPET];
+    }
+
+    clock_page_t *page = &clock_time_page.data;
+    uint32_t epoch = rtc_read_epoch();
+
+    page->seq++;
+    barrier();
+    page->source = clock_cs - clocksources;
+    page->ticks = pit_ticks;
+    page->tsc_counts = pit_tsc_counts;
+    page->mult = clock_cs->mult;
+    page->shift = clock_cs->shift;
+    page->boot_epoch_ns = (uint64_t)epoch * NS_PER_SEC;
+    page->base_ns = 0;
+    page->base_counts = clock_cs->read();
+    barrier();
+    page->seq++;
+}
+
+/*
+ * void clock_tick(uint32_t ticks)
+ * Inputs: ticks - pit_ticks
+ * Return Value: None
+ * Function: Moves the time page's base to the current count, adding the time since the last base
+ *           the way a reader would so the clock never goes back across the update
+ */
+void clock_tick(uint32_t ticks) {
+    clock_page_t *page = &clock_time_page.data;
+    uint64_t counts = clock_cs->read();
+
+    page->seq++;
+    barrier();
+    page->base_ns += clock_counts_to_ns(clock_cs, clock_since_base(counts, page->base_counts));
+    page->base_counts = counts;
+    page->ticks = ticks;
+    barrier();
+    page->seq++;
+}
+
+/*
+ * uint32_t clock_page_address(void)
+ * Inputs: None
+ * Return Value: Address of the time page, the same physical and virtual in the kernel's 4MB page
+ * Function: Lets `paging_init` map the page for user space
+ */
+uint32_t clock_page_address(void) { return (uint32_t)&clock_time_page; }
+
+/*
+ * uint64_t clock_monotonic_ns(void)
+ * Inputs: None
+ * Return Value: Nanoseconds since `clock_init`
+ * Function: Reads the clocksource from the time page's base, again if the PIT interrupt moved
+ *           the base meanwhile. Works from any CPU and with interrupts on or off.
+ */
+uint64_t clock_monotonic_ns(void) {
+    const clock_page_t *page = &clock_time_page.data;
+    uint32_t seq;
+    uint64_t ns;
+
+    do {
+        seq = page->seq;
+        barrier();
+        uint64_t counts = clock_since_base(clock_cs->read(), page->base_counts);
+        ns = page->base_ns + clock_counts_to_ns(clock_cs, counts);
+        barrier();
+    } while ((seq & 1) || seq != page->seq);
+    return ns;
+}
+
+/*
+ * uint64_t clock_realtime_ns(void)
+ * Inputs: None
+ * Return Value: Nanoseconds since the Unix epoch
+ * Function: Adds the monotonic time to the wall-clock time read at boot, to the second the RTC
+ *           keeps
+ */
+uint64_t clock_realtime_ns(void) {
+    return clock_time_page.data.boot_epoch_ns + clock_monotonic_ns();
+}
+
+/*
+ * const clocksource_t *clock_source(void)
+ * Inputs: None
+ * Return Value: The clocksource `clock_init` selected
+ * Function: Lets tests and callers see which counter the clocks run on
+ */
+const clocksource_t *clock_source(void) { return clock_cs; }
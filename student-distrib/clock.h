@@ -0,0 +1,83 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include "types.h"
+
+/* Clocks `clock_gettime` can read */
+#define CLOCK_REALTIME 0  // wall-clock time since the Unix epoch, from the RTC at boot
+#define CLOCK_MONOTONIC 1 // time since `clock_init`, never goes back
+
+#define NS_PER_SEC 1000000000
+
+/* Counters the monotonic clock can run on */
+#define CLOCKSOURCE_TSC 0  // time stamp counter, calibrated against the PIT
+#define CLOCKSOURCE_HPET 1 // HPET main counter, only if the machine has one
+
+/* A free-running counter and how to turn its counts into nanoseconds:
+ * ns = counts * mult >> shift */
+typedef struct clocksource {
+    const char *name;
+    uint64_t (*read)(void);
+    uint32_t mult;
+    uint32_t shift;
+} clocksource_t;
+
+/* The time page, mapped read-only into every process at USER_TIME_PAGE so the clocks can be read
+ * without a syscall (the layout is ece391_time_page_t on the user side). The kernel makes `seq`
+ * odd while it updates the page and even again after, a reader retries if `seq` was odd or
+ * changed across its read. */
+typedef struct clock_page {
+    volatile uint32_t seq;
+    // CLOCKSOURCE_* the clocks run on, the page can only be used from user space on the TSC
+    uint32_t source;
+    // pit_ticks at the last update, and pit_tsc_counts
+    uint32_t ticks;
+    uint32_t tsc_counts;
+    // conversion of the clocksource's counts: ns = counts * mult >> shift
+    uint32_t mult;
+    uint32_t shift;
+    // clocksource count at the last update and CLOCK_MONOTONIC at that count
+    uint64_t base_counts;
+    uint64_t base_ns;
+    // CLOCK_REALTIME - CLOCK_MONOTONIC
+    uint64_t boot_epoch_ns;
+} clock_page_t;
+
+/*
+ * uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem)
+ * Inputs: n - dividend
+ *         d - divisor, not 0
+ *         rem - where to store the remainder, or NULL
+ * Return Value: n / d
+ * Function: Divides a 64-bit number without libgcc, with one divl per half
+ */
+static inline uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t high = n >> 32;
+    uint32_t q_low, r;
+    asm("divl %4" : "=a"(q_low), "=d"(r) : "a"((uint32_t)n), "d"(high % d), "rm"(d));
+    if (rem != NULL) {
+        *rem = r;
+    }
+    return ((uint64_t)(high / d) << 32) | q_low;
+}
+
+/* Picks the clocksource (CLOCKSOURCE_HPET falls back to the TSC without one) and reads the wall
+ * clock from the RTC. */
+extern void clock_init(uint32_t source);
+
+/* Moves the time page's base to now and records the tick count, from the PIT interrupt. */
+extern void clock_tick(uint32_t ticks);
+
+/* Address of the time page, for `paging_init` to map it. */
+extern uint32_t clock_page_address(void);
+
+/* Nanoseconds since `clock_init` on the selected clocksource. */
+extern uint64_t clock_monotonic_ns(void);
+
+/* Nanoseconds since the Unix epoch. */
+extern uint64_t clock_realtime_ns(void);
+
+/* The selected clocksource. */
+extern const clocksource_t *clock_source(void);
+
+#endif /* _CLOCK_H */
@@ -2,9 +2,11 @@
 
 #include "lib.h"
 #include "syscall.h"
+#include "terminal.h"
 
 #define EXCEPTION_HANDLER(name, msg)                                                               \
     void name(void) {                                                                              \
+        terminal_sync();                                                                           \
         clear();                                                                                   \
         printf(":( encountered an error: " msg "\n");                                              \
         get_scheduler_pcb()->exception_occured = 1;                                                \
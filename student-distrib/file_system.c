@@ -238,6 +238,7 @@ func_pt_t make_file_fops(void) {
     f.close = file_close;
     f.read = file_read;
     f.write = file_write;
+    f.ioctl = NULL;
     return f;
 }
 
@@ -255,5 +256,6 @@ func_pt_t make_dir_fops(void) {
     f.close = dir_close;
     f.read = dir_read;
     f.write = dir_write;
+    f.ioctl = NULL;
     return f;
 }
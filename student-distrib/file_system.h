@@ -49,6 +49,7 @@ typedef struct func_pt {
     int32_t (*close)(int32_t fd);
     int32_t (*read)(int32_t fd, void *buf, int32_t nbytes);
     int32_t (*write)(int32_t fd, const void *buf, int32_t nbytes);
+    int32_t (*ioctl)(int32_t fd, uint32_t request, uint32_t arg);
 } func_pt_t;
 
 /* file descriptior */
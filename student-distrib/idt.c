@@ -2,8 +2,10 @@
 
 #include "exceptions.h"
 #include "keyboard.h"
+#include "lapic.h"
 #include "pit.h"
 #include "rtc.h"
+#include "smp.h"
 #include "syscall.h"
 #include "x86_desc.h"
 
@@ -77,4 +79,19 @@ void init_idt() {
     idt[PIT_HANDLER_VEC].present = 1;   /* mark entry present       */
     idt[PIT_HANDLER_VEC].reserved3 = 0; /* change to interrupt gate */
     SET_IDT_ENTRY(idt[PIT_HANDLER_VEC], pit_handler);
+
+    /* Enable interrupt vector for local APIC timer interrupts. */
+    idt[LAPIC_TIMER_VEC].present = 1;   /* mark entry present       */
+    idt[LAPIC_TIMER_VEC].reserved3 = 0; /* change to interrupt gate */
+    SET_IDT_ENTRY(idt[LAPIC_TIMER_VEC], pit_lapic_handler);
+
+    /* Enable interrupt vector for reschedule IPIs from the other CPUs. */
+    idt[SMP_RESCHED_VEC].present = 1;   /* mark entry present       */
+    idt[SMP_RESCHED_VEC].reserved3 = 0; /* change to interrupt gate */
+    SET_IDT_ENTRY(idt[SMP_RESCHED_VEC], smp_resched_handler);
+
+    /* Enable interrupt vector for spurious local APIC interrupts. */
+    idt[LAPIC_SPURIOUS_VEC].present = 1;   /* mark entry present       */
+    idt[LAPIC_SPURIOUS_VEC].reserved3 = 0; /* change to interrupt gate */
+    SET_IDT_ENTRY(idt[LAPIC_SPURIOUS_VEC], lapic_spurious_handler);
 }
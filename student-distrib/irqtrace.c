@@ -0,0 +1,88 @@
+#include "irqtrace.h"
+
+#include "smp.h"
+#include "spinlock.h"
+
+irqoff_stats_t irqoff_stats;
+
+/* Protects irqoff_stats. Only taken with interrupts already off, so a plain spinlock. */
+static spinlock_t irqtrace_lock = SPINLOCK_INIT;
+
+/* TSC value and site where each CPU's current window opened, start 0 when none is open. */
+static uint64_t window_start[MAX_CPUS];
+static const char *window_site[MAX_CPUS];
+
+/*
+ * irqtrace_off(const char *site)
+ *   DESCRIPTION: Opens an interrupts-off window on this CPU. If one is already open, interrupts
+ *                were enabled somewhere the tracker doesn't see (an iret, or the idle task's sti)
+ *                and the old window is dropped.
+ *
+ *   INPUTS: site - where interrupts were disabled
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with interrupts disabled
+ */
+void irqtrace_off(const char *site) {
+    uint32_t cpu = smp_cpu_id();
+    window_start[cpu] = rdtsc();
+    window_site[cpu] = site;
+}
+
+/*
+ * irqtrace_on(const char *site)
+ *   DESCRIPTION: Closes this CPU's interrupts-off window and keeps it if it is one of the longest.
+ *                The window may have been opened by another task if the CPU switched in between,
+ *                interrupts stayed off all along anyway.
+ *
+ *   INPUTS: site - where interrupts are enabled again
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with interrupts disabled
+ */
+void irqtrace_on(const char *site) {
+    uint32_t cpu = smp_cpu_id();
+    if (window_start[cpu] == 0) {
+        return;
+    }
+
+    uint32_t cycles = (uint32_t)(rdtsc() - window_start[cpu]);
+    window_start[cpu] = 0;
+
+    spin_lock(&irqtrace_lock);
+
+    irqoff_stats.windows++;
+    irqoff_stats.total_cycles += cycles;
+
+    // insertion into the sorted list of longest windows
+    int i = IRQTRACE_TOP - 1;
+    if (cycles > irqoff_stats.worst[i].cycles) {
+        while (i > 0 && cycles > irqoff_stats.worst[i - 1].cycles) {
+            irqoff_stats.worst[i] = irqoff_stats.worst[i - 1];
+            i--;
+        }
+        irqoff_stats.worst[i].cycles = cycles;
+        irqoff_stats.worst[i].start = window_site[cpu];
+        irqoff_stats.worst[i].end = site;
+    }
+
+    spin_unlock(&irqtrace_lock);
+}
+
+/*
+ * irqtrace_reset()
+ *   DESCRIPTION: Clears the statistics, e.g. before measuring a workload
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void irqtrace_reset(void) {
+    unsigned long flags;
+    cli_and_save(flags);
+    spin_lock(&irqtrace_lock);
+    memset(&irqoff_stats, 0, sizeof(irqoff_stats));
+    spin_unlock(&irqtrace_lock);
+    restore_flags(flags);
+}
@@ -0,0 +1,78 @@
+#ifndef _IRQTRACE_H
+#define _IRQTRACE_H
+
+#include "lib.h"
+#include "types.h"
+
+/* Measure how long critical sections keep interrupts disabled and remember the longest windows.
+ * Comment out to make `irq_save` and `irq_restore` plain cli_and_save and restore_flags. */
+#define IRQTRACE
+
+/* Number of longest interrupts-off windows remembered */
+#define IRQTRACE_TOP 4
+
+/* Interrupt flag in EFLAGS */
+#define EFLAGS_IF 0x200
+
+#define IRQTRACE_STR(x) #x
+#define IRQTRACE_XSTR(x) IRQTRACE_STR(x)
+
+/* Source location of a critical section boundary, kept in the longest windows */
+#define IRQTRACE_SITE (__FILE__ ":" IRQTRACE_XSTR(__LINE__))
+
+/* One interrupts-off window: how long it lasted and where it was opened and closed. */
+typedef struct irqoff_window {
+    uint32_t cycles;
+    const char *start;
+    const char *end;
+} irqoff_window_t;
+
+/* Interrupts-off statistics over all CPUs. */
+typedef struct irqoff_stats {
+    /* Number of windows measured. */
+    uint32_t windows;
+    /* Sum of their lengths in cycles. */
+    uint64_t total_cycles;
+    /* Longest windows, longest first. */
+    irqoff_window_t worst[IRQTRACE_TOP];
+} irqoff_stats_t;
+
+extern irqoff_stats_t irqoff_stats;
+
+/* Marks the start of a window on this CPU, called right after interrupts were disabled. */
+extern void irqtrace_off(const char *site);
+
+/* Marks the end of this CPU's window, called right before interrupts are enabled again. */
+extern void irqtrace_on(const char *site);
+
+/* Forgets every window measured so far. */
+extern void irqtrace_reset(void);
+
+#ifdef IRQTRACE
+
+/* Disables interrupts on this CPU, saving the flags. Opens a window if they were enabled. */
+#define irq_save(flags)                                                                            \
+    do {                                                                                           \
+        cli_and_save(flags);                                                                       \
+        if ((flags)&EFLAGS_IF) {                                                                   \
+            irqtrace_off(IRQTRACE_SITE);                                                           \
+        }                                                                                          \
+    } while (0)
+
+/* Restores the flags saved by `irq_save`, closing the window if it re-enables interrupts. */
+#define irq_restore(flags)                                                                         \
+    do {                                                                                           \
+        if ((flags)&EFLAGS_IF) {                                                                   \
+            irqtrace_on(IRQTRACE_SITE);                                                            \
+        }                                                                                          \
+        restore_flags(flags);                                                                      \
+    } while (0)
+
+#else
+
+#define irq_save(flags) cli_and_save(flags)
+#define irq_restore(flags) restore_flags(flags)
+
+#endif /* IRQTRACE */
+
+#endif /* _IRQTRACE_H */
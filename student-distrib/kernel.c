@@ -2,6 +2,7 @@
  * vim:ts=4 noexpandtab
  */
 
+#include "clock.h"
 #include "debug.h"
 #include "file_system.h"
 #include "i8259.h"
@@ -13,9 +14,11 @@
 #include "pit.h"
 #include "rtc.h"
 #include "scheduling.h"
+#include "smp.h"
 #include "syscall.h"
 #include "terminal.h"
 #include "tests.h"
+#include "timer.h"
 #include "x86_desc.h"
 
 #define RUN_TESTS
@@ -24,9 +27,45 @@
 /* Check if the bit BIT in FLAGS is set. */
 #define CHECK_FLAG(flags, bit) ((flags) & (1 << (bit)))
 
+/* Value of the `option=value` the boot command line passes for OPTION (given with its '='),
+   NULL if it doesn't. */
+static const int8_t *boot_option(const int8_t *cmdline, const int8_t *option) {
+    uint32_t len = strlen(option);
+
+    for (; *cmdline != '\0'; cmdline++) {
+        if (strncmp(cmdline, option, len) == 0) {
+            return cmdline + len;
+        }
+    }
+    return NULL;
+}
+
+/* Number of terminals the boot command line asks for with `terminals=N`, DEFAULT_TERMINALS if it
+   doesn't. */
+static uint32_t boot_terminal_count(const int8_t *cmdline) {
+    const int8_t *value = boot_option(cmdline, "terminals=");
+    if (value == NULL) {
+        return DEFAULT_TERMINALS;
+    }
+
+    uint32_t count = 0;
+    for (; *value >= '0' && *value <= '9'; value++) {
+        count = count * 10 + (*value - '0');
+    }
+    return count;
+}
+
+/* Clocksource the boot command line asks for with `clocksource=hpet`, the TSC otherwise. */
+static uint32_t boot_clocksource(const int8_t *cmdline) {
+    const int8_t *value = boot_option(cmdline, "clocksource=");
+    return value != NULL && strncmp(value, "hpet", 4) == 0 ? CLOCKSOURCE_HPET : CLOCKSOURCE_TSC;
+}
+
 /* Check if MAGIC is valid and print the Multiboot information structure
    pointed by ADDR. */
 void entry(unsigned long magic, unsigned long addr) {
+    uint32_t clocksource = CLOCKSOURCE_TSC;
+
     terminal_init();
 
     multiboot_info_t *mbi;
@@ -56,8 +95,11 @@ void entry(unsigned long magic, unsigned long addr) {
         printf("boot_device = 0x%#x\n", (unsigned)mbi->boot_device);
 
     /* Is the command line passed? */
-    if (CHECK_FLAG(mbi->flags, 2))
+    if (CHECK_FLAG(mbi->flags, 2)) {
         printf("cmdline = %s\n", (char *)mbi->cmdline);
+        terminal_set_count(boot_terminal_count((int8_t *)mbi->cmdline));
+        clocksource = boot_clocksource((int8_t *)mbi->cmdline);
+    }
 
     if (CHECK_FLAG(mbi->flags, 3)) {
         int mod_count = 0;
@@ -153,7 +195,8 @@ void entry(unsigned long magic, unsigned long addr) {
     keyboard_init();
     rtc_init();
 
-    pit_init();
+    scheduler_init();
+    timer_init();
 
     /* Init file_system */
     file_system = (boot_block_t *)(((module_t *)mbi->mods_addr)->mod_start);
@@ -163,6 +206,15 @@ void entry(unsigned long magic, unsigned long addr) {
 
     clear();
 
+    /* Start the other CPUs, they wait for the scheduler to give them a terminal */
+    smp_init();
+
+    /* Start the clocks, after the local APIC is mapped so its timer can be calibrated */
+    pit_init();
+
+    /* Start the monotonic and wall clocks on the TSC calibration `pit_init` made */
+    clock_init(clocksource);
+
     /* Enable interrupts */
     /* Do not enable the following until after you have set up your
      * IDT correctly otherwise QEMU will triple fault and simple close
@@ -1,9 +1,12 @@
 #include "keyboard.h"
 
 #include "i8259.h"
+#include "keymap.h"
 #include "lib.h"
 #include "paging.h"
 #include "scheduling.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "syscall.h"
 #include "terminal.h"
 
@@ -11,70 +14,64 @@
 #define DATA_PORT 0x60
 #define KEYBOARD_IRQ 1
 
-#define BACKSPACE_PRESS 0x0E
-#define BACKSPACE_RELEASE 0x8E
+/* Release bit of a scancode */
+#define RELEASE_BIT 0x80
 
-#define TAB_PRESS 0x0F
-#define TAB_RELEASE 0x8F
+/* Prefix of the extended scancodes */
+#define EXTENDED_PREFIX 0xE0
 
-#define CAPS_PRESS 0x3A
-#define CAPS_RELEASE 0xBA
-
-#define ENTER_PRESS 0x1C
-#define ENTER_RELEASE 0x9C
-
-#define LSHIFT_PRESS 0x2A
-#define LSHIFT_RELEASE 0xAA
-
-#define RSHIFT_PRESS 0x36
-#define RSHIFT_RELEASE 0xB6
-
-#define CTRL_PRESS 0x1D
-#define CTRL_RELEASE 0x9D
-
-#define ALT_PRESS 0x38
-#define ALT_RELEASE 0xB8
-
-#define F1_PRESS 0x3B
-#define F2_PRESS 0x3C
-#define F3_PRESS 0x3D
-#define F4_PRESS 0x3E
+/* Lines Shift+PageUp/PageDown scroll the view by */
+#define SCROLL_VIEW_LINES 12
 
 /* How many spaces in a tab. */
 #define TAB_NUM_SPACES 4
 
-#define DATA_TO_CHAR_SIZE 60
-
-/* Conversions from scancode to ASCII using data from keyboard */
-char data_to_char[DATA_TO_CHAR_SIZE][2] = {
-    {0, 0},      {0, 0},                 /* nothing */
-    {'1', '!'},  {'2', '@'}, {'3', '#'}, /* row 1 */
-    {'4', '$'},  {'5', '%'}, {'6', '^'}, {'7', '&'}, {'8', '*'}, {'9', '('}, {'0', ')'},
-    {'-', '_'},  {'=', '+'},
-
-    {0, 0},                              /* backspace */
-    {0, 0},                              /* tab */
-    {'q', 'Q'},  {'w', 'W'}, {'e', 'E'}, /* row 2 */
-    {'r', 'R'},  {'t', 'T'}, {'y', 'Y'}, {'u', 'U'}, {'i', 'I'}, {'o', 'O'}, {'p', 'P'},
-    {'[', '{'},  {']', '}'},
-
-    {0, 0},                              /* enter */
-    {0, 0},                              /* left control */
-    {'a', 'A'},  {'s', 'S'}, {'d', 'D'}, /* row 3 */
-    {'f', 'F'},  {'g', 'G'}, {'h', 'H'}, {'j', 'J'}, {'k', 'K'}, {'l', 'L'}, {';', ':'},
-    {'\'', '"'}, {'`', '~'},
-
-    {0, 0},                                          /* left shift */
-    {'\\', '|'}, {'z', 'Z'}, {'x', 'X'}, {'c', 'C'}, /* row 4 */
-    {'v', 'V'},  {'b', 'B'}, {'n', 'N'}, {'m', 'M'}, {',', '<'}, {'.', '>'}, {'/', '?'},
-
-    {0, 0},                              /* right shift */
-    {0, 0},      {0, 0},     {' ', ' '}, /* space */
-    {0, 0},                              /* caps lock */
-};
-
-/* Flags for caps lshift rshift ctrl. */
-static int capsbool, shiftbool, ctrlbool, altbool;
+/* Control character Ctrl+L types, clears the screen in canonical mode */
+#define CTRL_L 0x0C
+
+/* Modifier keys held, one bit per key so releasing one of two held shifts keeps shift on */
+#define HELD_LSHIFT 0x01
+#define HELD_RSHIFT 0x02
+#define HELD_LCTRL 0x04
+#define HELD_RCTRL 0x08
+#define HELD_LALT 0x10
+#define HELD_RALT 0x20
+#define HELD_SHIFT (HELD_LSHIFT | HELD_RSHIFT)
+#define HELD_CTRL (HELD_LCTRL | HELD_RCTRL)
+#define HELD_ALT (HELD_LALT | HELD_RALT)
+
+/* Modifier keys held and Caps Lock state, only touched by the bottom half. */
+static uint32_t held;
+static int capsbool;
+/* Set when the previous byte was the extended prefix. */
+static int extendedbool;
+
+/* Layout scancodes are decoded with, see `keyboard_set_keymap`. */
+static const keymap_t *keymap = &keymaps[0];
+
+/* Scancodes read by the interrupt handler and not decoded yet, a power of two. */
+#define SCANCODE_RING_SIZE 64
+
+/* A scancode and rdtsc when its interrupt came in. */
+typedef struct scancode {
+    uint64_t tsc;
+    uint8_t data;
+} scancode_t;
+
+/* Lock-free ring between the interrupt handler (the only writer of head) and the bottom half
+ * (the only writer of tail). */
+typedef struct scancode_ring {
+    scancode_t entries[SCANCODE_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} scancode_ring_t;
+
+static scancode_ring_t scancodes;
+
+/* Set while a CPU runs the bottom half. */
+static volatile uint32_t bottom_half_running;
+
+keyboard_stats_t keyboard_stats;
 
 /* Pointer to buffer for characters entered. */
 static keyboard_buffer_t *kb_buffer;
@@ -88,6 +85,66 @@ static int chars = 0;
  */
 void keyboard_set_buffer(keyboard_buffer_t *kb) { kb_buffer = kb; }
 
+/* void keyboard_buffer_reset(keyboard_buffer_t* kb);
+ * Inputs: keyboard_buffer_t* kb - keyboard buffer to empty
+ * Return Value: void
+ * Function: drops the line being typed and the lines entered but not read
+ */
+void keyboard_buffer_reset(keyboard_buffer_t *kb) {
+    memset(kb->buf, 0, BUFFER_SIZE);
+    kb->idx = 0;
+    kb->head = 0;
+    kb->tail = 0;
+    kb->lines_available = 0;
+}
+
+/* int32_t keyboard_buffer_enter(keyboard_buffer_t* kb);
+ * Inputs: keyboard_buffer_t* kb - keyboard buffer of the terminal Enter was pressed in
+ * Return Value: 0 on success, -1 if the queue has no room for the line
+ * Function: moves the line being typed to the queue of entered lines with a '\n', so more lines
+ *           can be typed ahead before the program reads this one
+ */
+int32_t keyboard_buffer_enter(keyboard_buffer_t *kb) {
+    if (INPUT_QUEUE_SIZE - (kb->head - kb->tail) < (uint32_t)kb->idx + 1) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < kb->idx; i++) {
+        kb->queue[kb->head++ & (INPUT_QUEUE_SIZE - 1)] = kb->buf[i];
+    }
+    kb->queue[kb->head++ & (INPUT_QUEUE_SIZE - 1)] = '\n';
+    kb->lines_available++;
+
+    memset(kb->buf, 0, BUFFER_SIZE);
+    kb->idx = 0;
+    return 0;
+}
+
+/* int32_t keyboard_set_keymap(uint32_t idx);
+ * Inputs: uint32_t idx - index of the layout in `keymaps`
+ * Return Value: 0 on success, -1 if there is no such layout
+ * Function: switches the layout keys are decoded with, for every terminal
+ */
+int32_t keyboard_set_keymap(uint32_t idx) {
+    if (idx >= NUM_KEYMAPS) {
+        return -1;
+    }
+    keymap = &keymaps[idx];
+    return 0;
+}
+
+/* uint16_t keyboard_decode(uint8_t code);
+ * Inputs: uint8_t code - scancode without its release bit, KEYMAP_EXTENDED set after the prefix
+ * Return Value: the character or KEY_* value the key gives with the modifiers held
+ * Function: a single lookup in the current layout's table for the modifier state
+ */
+static uint16_t keyboard_decode(uint8_t code) {
+    uint32_t state = ((held & HELD_SHIFT) ? KEYMAP_SHIFT : 0) | (capsbool ? KEYMAP_CAPS : 0) |
+                     ((held & HELD_CTRL) ? KEYMAP_CTRL : 0);
+    return keymap->keys[state][code];
+}
+
 /* void keyboard_init(void)
  * Inputs: void
  * Return Value: N/A
@@ -95,136 +152,262 @@ void keyboard_set_buffer(keyboard_buffer_t *kb) { kb_buffer = kb; }
  */
 void keyboard_init(void) { enable_irq(KEYBOARD_IRQ); }
 
-/* void keyboard_handler(void)
- * Inputs: void
+/* void keyboard_process(uint8_t data, uint64_t tsc)
+ * Inputs: uint8_t data - scancode
+ *         uint64_t tsc - rdtsc when the interrupt that read it came in
  * Return Value: N/A
- * Function: grabs keyboard input data and prints according ascii character
+ * Function: decodes a scancode against the terminal on screen and prints according ascii
+ *           character. Runs in the bottom half with interrupts on.
  */
-void keyboard_handler_base(void) {
-    uint8_t data = inb(DATA_PORT);
-
-    // caps lshift rshift ctrl
-    switch (data) {
-    case CAPS_PRESS:
-        capsbool ^= 1;
-        send_eoi(KEYBOARD_IRQ);
-        return;
-    case CAPS_RELEASE:
-        send_eoi(KEYBOARD_IRQ);
-        return;
-    case RSHIFT_PRESS:
-    case LSHIFT_PRESS:
-        shiftbool = 1;
-        send_eoi(KEYBOARD_IRQ);
+static void keyboard_process(uint8_t data, uint64_t tsc) {
+    if (data == EXTENDED_PREFIX) {
+        extendedbool = 1;
         return;
-    case RSHIFT_RELEASE:
-    case LSHIFT_RELEASE:
-        shiftbool = 0;
-        send_eoi(KEYBOARD_IRQ);
-        return;
-    case CTRL_PRESS:
-        ctrlbool = 1;
-        send_eoi(KEYBOARD_IRQ);
+    }
+    int extended = extendedbool;
+    extendedbool = 0;
+
+    int release = data & RELEASE_BIT;
+    uint16_t key = keyboard_decode((data & ~RELEASE_BIT) | (extended ? KEYMAP_EXTENDED : 0));
+    // includes the fake extended shifts the keyboard wraps the gray navigation keys in
+    if (key == KEY_NONE) {
         return;
-    case CTRL_RELEASE:
-        ctrlbool = 0;
-        send_eoi(KEYBOARD_IRQ);
+    }
+
+    // a program reading in raw mode gets every key as it comes, see `terminal_key_event`
+    uint8_t idx = screen_terminal_idx;
+    int raw = terminal_get_state(idx)->mode & TERMINAL_RAW;
+    if (raw) {
+        key_event_t event;
+        event.tsc = tsc;
+        event.scancode = data;
+        event.extended = extended;
+        event.ascii = (!release && key < KEY_SPECIAL) ? key : 0;
+        event.modifiers = ((held & HELD_SHIFT) ? KEY_MOD_SHIFT : 0) |
+                          ((held & HELD_CTRL) ? KEY_MOD_CTRL : 0) |
+                          ((held & HELD_ALT) ? KEY_MOD_ALT : 0) | (capsbool ? KEY_MOD_CAPS : 0);
+        event.key = key;
+        terminal_key_event(idx, &event);
+    }
+
+    // modifiers
+    uint32_t bit = 0;
+    switch (key) {
+    case KEY_CAPS_LOCK:
+        if (!release) {
+            capsbool ^= 1;
+        }
         return;
-    case ALT_PRESS:
-        altbool = 1;
-        send_eoi(KEYBOARD_IRQ);
+    case KEY_LSHIFT:
+        bit = HELD_LSHIFT;
+        break;
+    case KEY_RSHIFT:
+        bit = HELD_RSHIFT;
+        break;
+    case KEY_LCTRL:
+        bit = HELD_LCTRL;
+        break;
+    case KEY_RCTRL:
+        bit = HELD_RCTRL;
+        break;
+    case KEY_LALT:
+        bit = HELD_LALT;
+        break;
+    case KEY_RALT:
+        bit = HELD_RALT;
+        break;
+    }
+    if (bit != 0) {
+        held = release ? held & ~bit : held | bit;
         return;
-    case ALT_RELEASE:
-        altbool = 0;
-        send_eoi(KEYBOARD_IRQ);
+    }
+    if (release) {
         return;
     }
 
-    if (altbool && data == F1_PRESS) {
-        terminal_switch(0);
-        send_eoi(KEYBOARD_IRQ);
+    // Alt+F1.. switch terminals, F4 lets another task run
+    if ((held & HELD_ALT) && key >= KEY_F1 && key < KEY_F1 + terminal_count) {
+        terminal_switch(key - KEY_F1);
         return;
     }
-    if (altbool && data == F2_PRESS) {
-        terminal_switch(1);
-        send_eoi(KEYBOARD_IRQ);
+    if (key == KEY_F1 + 3) {
+        // the bottom half can't switch away, the yield happens once it is done
+        scheduler_resched();
         return;
     }
-    if (altbool && data == F3_PRESS) {
-        terminal_switch(2);
-        send_eoi(KEYBOARD_IRQ);
+
+    // Shift+PageUp/PageDown look through the history of the terminal on screen
+    if ((held & HELD_SHIFT) && key == KEY_PAGE_UP) {
+        terminal_scroll_view(SCROLL_VIEW_LINES);
         return;
     }
-    if (data == F4_PRESS) {
-        send_eoi(KEYBOARD_IRQ);
-        scheduler();
+    if ((held & HELD_SHIFT) && key == KEY_PAGE_DOWN) {
+        terminal_scroll_view(-SCROLL_VIEW_LINES);
         return;
     }
 
-    uint32_t prev_base_address = page_table[VID_MEM_INDEX].base_address;
+    // any other key goes back to the live screen
+    terminal_view_live();
+
+    // no echo or line editing in raw mode, and only characters are typed
+    if (raw || key >= KEY_SPECIAL) {
+        return;
+    }
+    uint8_t c = key;
+
+    // the screen and the buffer are shared with the other CPUs' terminal reads and writes, and
+    // this CPU's screen pointers are borrowed until the end
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
     keyboard_buffer_t *prev_kb_buffer = kb_buffer;
     int *prev_screen_x = get_screen_x();
     int *prev_screen_y = get_screen_y();
-
-    page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-    flush_tlb();
+    int *prev_screen_origin = get_screen_origin();
+    scrollback_t *prev_screen_history = get_screen_history();
+    int32_t *prev_screen_pinned = get_screen_pinned();
+    pcb_t *wake_pcb = NULL;
 
     terminal_state_t *current_terminal_state = terminal_get_state(screen_terminal_idx);
     keyboard_set_buffer(&current_terminal_state->kb_buffer);
     set_screen_xy(&current_terminal_state->cursor_x, &current_terminal_state->cursor_y);
+    set_screen_origin(&current_terminal_state->origin);
+    set_screen_history(&current_terminal_state->history);
+    set_screen_pinned(&current_terminal_state->pinned);
 
-    if (ctrlbool && data == 0x26) {
+    if (c == CTRL_L) {
         clear();
-    } else {
-        if (kb_buffer == NULL) {
-            if (data == BACKSPACE_PRESS && chars > 0) {
-                putc(0x08); // this is ASCII for backspace value, rest is done in putc function
-                chars--;
-            } else if (data == ENTER_PRESS) {
-                putc('\n');
-                chars = 0;
-            } else if (data == TAB_PRESS) {
-                int i;
-                for (i = 0; i < TAB_NUM_SPACES; i++) {
-                    putc(' ');
-                    chars++;
-                }
-            } else if (data < DATA_TO_CHAR_SIZE && data_to_char[data][capsbool ^ shiftbool]) {
-                putc(data_to_char[data][capsbool ^ shiftbool]);
+    } else if (kb_buffer == NULL) {
+        if (c == '\b' && chars > 0) {
+            putc(0x08); // this is ASCII for backspace value, rest is done in putc function
+            chars--;
+        } else if (c == '\n') {
+            putc('\n');
+            chars = 0;
+        } else if (c == '\t') {
+            int i;
+            for (i = 0; i < TAB_NUM_SPACES; i++) {
+                putc(' ');
                 chars++;
             }
-        } else {
-            if (data == BACKSPACE_PRESS && kb_buffer->idx > 0) {
-                putc(0x08); // this is ASCII for backspace value, rest is done in putc function
-                kb_buffer->buf[--kb_buffer->idx] = 0;
-                chars--;
-            } else if (data == ENTER_PRESS && kb_buffer->idx <= (BUFFER_SIZE - 1)) {
-                putc('\n');
-                kb_buffer->buf[kb_buffer->idx++] = '\n';
-                kb_buffer->data_available = 1;
-                chars = 0;
-            } else if (data == TAB_PRESS && kb_buffer->idx < BUFFER_SIZE - TAB_NUM_SPACES) {
-                int i;
-                for (i = 0; i < TAB_NUM_SPACES; i++) {
-                    putc(' ');
-                    kb_buffer->buf[kb_buffer->idx++] = ' ';
-                    chars++;
-                }
-            } else if (data < DATA_TO_CHAR_SIZE && data_to_char[data][capsbool ^ shiftbool]) {
-                putc(data_to_char[data][capsbool ^ shiftbool]);
+        } else if (c >= ' ' && c < 0x7F) {
+            putc(c);
+            chars++;
+        }
+    } else {
+        if (c == '\b' && kb_buffer->idx > 0) {
+            putc(0x08); // this is ASCII for backspace value, rest is done in putc function
+            kb_buffer->buf[--kb_buffer->idx] = 0;
+            chars--;
+        } else if (c == '\n' && keyboard_buffer_enter(kb_buffer) == 0) {
+            // a full queue keeps the line on screen to be entered once there is room
+            putc('\n');
+            wake_pcb = current_terminal_state->curr_pcb;
+            chars = 0;
+        } else if (c == '\t' && kb_buffer->idx < BUFFER_SIZE - TAB_NUM_SPACES) {
+            int i;
+            for (i = 0; i < TAB_NUM_SPACES; i++) {
+                putc(' ');
+                kb_buffer->buf[kb_buffer->idx++] = ' ';
                 chars++;
-                if (kb_buffer->idx < (BUFFER_SIZE - 1)) {
-                    kb_buffer->buf[kb_buffer->idx++] = data_to_char[data][capsbool ^ shiftbool];
-                }
+            }
+        } else if (c >= ' ' && c < 0x7F) {
+            putc(c);
+            chars++;
+            if (kb_buffer->idx < (BUFFER_SIZE - 1)) {
+                kb_buffer->buf[kb_buffer->idx++] = c;
             }
         }
     }
 
-    page_table[VID_MEM_INDEX].base_address = prev_base_address;
-    flush_tlb();
-
     keyboard_set_buffer(prev_kb_buffer);
     set_screen_xy(prev_screen_x, prev_screen_y);
+    set_screen_origin(prev_screen_origin);
+    set_screen_history(prev_screen_history);
+    set_screen_pinned(prev_screen_pinned);
+
+    spin_unlock_irqrestore(&terminal_lock, flags);
+
+    // the scheduler lock is taken before the terminal lock, wake the reader once it's released
+    scheduler_wake(wake_pcb);
+}
+
+/* void keyboard_queue_scancode(uint8_t data, uint64_t tsc)
+ * Inputs: uint8_t data - scancode read from the keyboard
+ *         uint64_t tsc - rdtsc when its interrupt came in
+ * Return Value: N/A
+ * Function: adds a scancode to the ring for the bottom half, or drops it if the ring is full.
+ *           Single producer: IRQ1 isn't delivered again before the EOI, and only the bottom half
+ *           moves the tail.
+ */
+void keyboard_queue_scancode(uint8_t data, uint64_t tsc) {
+    uint32_t head = scancodes.head;
+    if (head - scancodes.tail < SCANCODE_RING_SIZE) {
+        scancodes.entries[head & (SCANCODE_RING_SIZE - 1)].data = data;
+        scancodes.entries[head & (SCANCODE_RING_SIZE - 1)].tsc = tsc;
+        asm volatile("" : : : "memory");
+        scancodes.head = head + 1;
+    } else {
+        keyboard_stats.dropped++;
+    }
+    keyboard_stats.scancodes++;
+}
+
+/* void keyboard_bottom_half(void)
+ * Inputs: void
+ * Return Value: N/A
+ * Function: drains the scancode ring with interrupts on, once the handler has sent its EOI. Only
+ *           one CPU drains at a time; a scancode queued while another CPU drains is picked up by
+ *           that one before it stops. The draining CPU isn't switched away until it is done.
+ */
+void keyboard_bottom_half(void) {
+    do {
+        if (xchg(&bottom_half_running, 1) != 0) {
+            return;
+        }
+
+        // switching away while holding bottom_half_running would stop every CPU from draining
+        scheduler_preempt_disable();
+        sti();
+        while (scancodes.tail != scancodes.head) {
+            scancode_t scancode = scancodes.entries[scancodes.tail & (SCANCODE_RING_SIZE - 1)];
+            asm volatile("" : : : "memory");
+            scancodes.tail++;
+
+            uint64_t start = rdtsc();
+            keyboard_process(scancode.data, scancode.tsc);
+            uint32_t cycles = (uint32_t)(rdtsc() - start);
+            keyboard_stats.bottom_half_cycles += cycles;
+            if (cycles > keyboard_stats.bottom_half_max_cycles) {
+                keyboard_stats.bottom_half_max_cycles = cycles;
+            }
+        }
+        cli();
 
+        bottom_half_running = 0;
+        // a switch put off while draining, e.g. for F4, happens now
+        scheduler_preempt_enable();
+        // a scancode may have come in on another CPU after the ring looked empty
+    } while (scancodes.tail != scancodes.head);
+}
+
+/* void keyboard_handler(void)
+ * Inputs: void
+ * Return Value: N/A
+ * Function: queues the scancode in the scancode ring, sends the EOI and runs the bottom half.
+ *           The handler itself only reads the port and stores two values, decoding and echo
+ *           happen after the EOI with interrupts on.
+ */
+void keyboard_handler_base(void) {
+    uint64_t tsc = rdtsc();
+    keyboard_queue_scancode(inb(DATA_PORT), tsc);
     send_eoi(KEYBOARD_IRQ);
+
+    uint32_t cycles = (uint32_t)(rdtsc() - tsc);
+    keyboard_stats.isr_cycles += cycles;
+    if (cycles > keyboard_stats.isr_max_cycles) {
+        keyboard_stats.isr_max_cycles = cycles;
+    }
+
+    keyboard_bottom_half();
 }
@@ -1,20 +1,48 @@
 #ifndef _KEYBOARD_H_
 #define _KEYBOARD_H_
 
+#include "types.h"
+
 #define KEYBOARD_HANDLER_VEC 0x21
-#define BUFFER_SIZE 128 /* terminal input buffer size (chars) */
+#define BUFFER_SIZE 128       /* terminal input buffer size (chars) */
+#define INPUT_QUEUE_SIZE 1024 /* entered lines a terminal holds (chars), a power of two */
 
 /* Struct containing information for the keyboard buffer. */
 typedef struct keyboard_buffer {
-    char buf[BUFFER_SIZE]; /* keyboard buffer                      */
-    int idx;               /* next index to write to in buffer     */
-    int data_available;    /* flag for if data is available or not */
+    char buf[BUFFER_SIZE];        /* line being typed                       */
+    int idx;                      /* next index to write to in buffer       */
+    char queue[INPUT_QUEUE_SIZE]; /* entered lines not read yet, '\n' ended */
+    uint32_t head;                /* free-running write position in queue   */
+    uint32_t tail;                /* free-running read position in queue    */
+    int lines_available;          /* number of entered lines in queue       */
 } keyboard_buffer_t;
 
+/* Keyboard interrupt statistics, cycle counts are measured with rdtsc. */
+typedef struct keyboard_stats {
+    /* Scancodes the interrupt handler read, and the ones dropped because the ring was full. */
+    uint32_t scancodes;
+    uint32_t dropped;
+    /* Cycles from entering the handler to its EOI, the part that runs with interrupts off. */
+    uint64_t isr_cycles;
+    uint32_t isr_max_cycles;
+    /* Cycles the bottom half spent decoding and echoing, what the handler used to do itself. */
+    uint64_t bottom_half_cycles;
+    uint32_t bottom_half_max_cycles;
+} keyboard_stats_t;
+
+extern keyboard_stats_t keyboard_stats;
+
 extern void keyboard_set_buffer(keyboard_buffer_t *kb);
+extern void keyboard_buffer_reset(keyboard_buffer_t *kb);
+extern int32_t keyboard_buffer_enter(keyboard_buffer_t *kb);
+
+extern int32_t keyboard_set_keymap(uint32_t idx);
 
 extern void keyboard_init(void);
 
+extern void keyboard_queue_scancode(uint8_t data, uint64_t tsc);
+extern void keyboard_bottom_half(void);
+
 extern void keyboard_handler(void);
 extern void keyboard_handler_base(void);
 
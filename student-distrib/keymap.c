@@ -0,0 +1,83 @@
+#include "keymap.h"
+
+/* The decode tables are generated at compile time from lists of keys, one table per modifier
+ * state. Each list entry expands to a designated initializer for its scancode. */
+
+/* Keys that decode the same in every layout and modifier state. The keypad decodes as with
+ * Num Lock on, the gray navigation keys come with the extended prefix. */
+#define COMMON_KEYS(K)                                                                             \
+    K(0x01, 0x1B) K(0x0E, '\b') K(0x0F, '\t') K(0x1C, '\n') K(0x39, ' ')                           \
+    K(0x1D, KEY_LCTRL) K(0x2A, KEY_LSHIFT) K(0x36, KEY_RSHIFT) K(0x38, KEY_LALT)                   \
+    K(0x3A, KEY_CAPS_LOCK)                                                                         \
+    K(0x3B, KEY_F1) K(0x3C, KEY_F1 + 1) K(0x3D, KEY_F1 + 2) K(0x3E, KEY_F1 + 3)                    \
+    K(0x3F, KEY_F1 + 4) K(0x40, KEY_F1 + 5) K(0x41, KEY_F1 + 6) K(0x42, KEY_F1 + 7)                \
+    K(0x43, KEY_F1 + 8) K(0x44, KEY_F1 + 9) K(0x57, KEY_F1 + 10) K(0x58, KEY_F12)                  \
+    K(0x37, '*') K(0x47, '7') K(0x48, '8') K(0x49, '9') K(0x4A, '-') K(0x4B, '4') K(0x4C, '5')     \
+    K(0x4D, '6') K(0x4E, '+') K(0x4F, '1') K(0x50, '2') K(0x51, '3') K(0x52, '0') K(0x53, '.')     \
+    K(0x9C, '\n') K(0x9D, KEY_RCTRL) K(0xB5, '/') K(0xB8, KEY_RALT)                                \
+    K(0xC7, KEY_HOME) K(0xC8, KEY_UP) K(0xC9, KEY_PAGE_UP) K(0xCB, KEY_LEFT)                       \
+    K(0xCD, KEY_RIGHT) K(0xCF, KEY_END) K(0xD0, KEY_DOWN) K(0xD1, KEY_PAGE_DOWN)                   \
+    K(0xD2, KEY_INSERT) K(0xD3, KEY_DELETE)
+
+/* US QWERTY keys typing a character: scancode, unshifted, shifted */
+#define US_CHARS(C)                                                                                \
+    C(0x02, '1', '!') C(0x03, '2', '@') C(0x04, '3', '#') C(0x05, '4', '$') C(0x06, '5', '%')      \
+    C(0x07, '6', '^') C(0x08, '7', '&') C(0x09, '8', '*') C(0x0A, '9', '(') C(0x0B, '0', ')')      \
+    C(0x0C, '-', '_') C(0x0D, '=', '+') C(0x1A, '[', '{') C(0x1B, ']', '}') C(0x27, ';', ':')      \
+    C(0x28, '\'', '"') C(0x29, '`', '~') C(0x2B, '\\', '|') C(0x33, ',', '<') C(0x34, '.', '>')    \
+    C(0x35, '/', '?')
+
+/* US QWERTY letters: scancode, lowercase. Caps Lock shifts them and Ctrl types their control
+ * character. */
+#define US_LETTERS(L)                                                                              \
+    L(0x10, 'q') L(0x11, 'w') L(0x12, 'e') L(0x13, 'r') L(0x14, 't') L(0x15, 'y') L(0x16, 'u')     \
+    L(0x17, 'i') L(0x18, 'o') L(0x19, 'p') L(0x1E, 'a') L(0x1F, 's') L(0x20, 'd') L(0x21, 'f')     \
+    L(0x22, 'g') L(0x23, 'h') L(0x24, 'j') L(0x25, 'k') L(0x26, 'l') L(0x2C, 'z') L(0x2D, 'x')     \
+    L(0x2E, 'c') L(0x2F, 'v') L(0x30, 'b') L(0x31, 'n') L(0x32, 'm')
+
+/* Dvorak keys typing a character, on the same scancodes as the QWERTY keys in their place */
+#define DVORAK_CHARS(C)                                                                            \
+    C(0x02, '1', '!') C(0x03, '2', '@') C(0x04, '3', '#') C(0x05, '4', '$') C(0x06, '5', '%')      \
+    C(0x07, '6', '^') C(0x08, '7', '&') C(0x09, '8', '*') C(0x0A, '9', '(') C(0x0B, '0', ')')      \
+    C(0x0C, '[', '{') C(0x0D, ']', '}') C(0x10, '\'', '"') C(0x11, ',', '<') C(0x12, '.', '>')     \
+    C(0x1A, '/', '?') C(0x1B, '=', '+') C(0x28, '-', '_') C(0x29, '`', '~') C(0x2B, '\\', '|')     \
+    C(0x2C, ';', ':')
+
+/* Dvorak letters, 's' is on the QWERTY ';' key */
+#define DVORAK_LETTERS(L)                                                                          \
+    L(0x13, 'p') L(0x14, 'y') L(0x15, 'f') L(0x16, 'g') L(0x17, 'c') L(0x18, 'r') L(0x19, 'l')     \
+    L(0x1E, 'a') L(0x1F, 'o') L(0x20, 'e') L(0x21, 'u') L(0x22, 'i') L(0x23, 'd') L(0x24, 'h')     \
+    L(0x25, 't') L(0x26, 'n') L(0x27, 's') L(0x2D, 'q') L(0x2E, 'j') L(0x2F, 'k') L(0x30, 'x')     \
+    L(0x31, 'b') L(0x32, 'm') L(0x33, 'w') L(0x34, 'v') L(0x35, 'z')
+
+/* What an entry of each list decodes to in a table */
+#define COMMON_KEY(code, key) [code] = (key),
+#define CHAR_PLAIN(code, c, shifted) [code] = (c),
+#define CHAR_SHIFTED(code, c, shifted) [code] = (shifted),
+#define LETTER_PLAIN(code, c) [code] = (c),
+#define LETTER_SHIFTED(code, c) [code] = (c) - 'a' + 'A',
+#define LETTER_CTRL(code, c) [code] = (c) & 0x1F,
+
+/* One table of a layout */
+#define KEYMAP_TABLE(CHARS, LETTERS, CHAR, LETTER)                                                 \
+    { COMMON_KEYS(COMMON_KEY) CHARS(CHAR) LETTERS(LETTER) }
+
+/* Every table of a layout, in KEYMAP_SHIFT | KEYMAP_CAPS | KEYMAP_CTRL order */
+#define KEYMAP(name, CHARS, LETTERS)                                                               \
+    {                                                                                              \
+        name, {                                                                                    \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_PLAIN, LETTER_PLAIN),                                \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_SHIFTED, LETTER_SHIFTED),                            \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_PLAIN, LETTER_SHIFTED),                              \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_SHIFTED, LETTER_PLAIN),                              \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_PLAIN, LETTER_CTRL),                                 \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_SHIFTED, LETTER_CTRL),                               \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_PLAIN, LETTER_CTRL),                                 \
+            KEYMAP_TABLE(CHARS, LETTERS, CHAR_SHIFTED, LETTER_CTRL),                               \
+        }                                                                                          \
+    }
+
+const keymap_t keymaps[NUM_KEYMAPS] = {
+    KEYMAP("us", US_CHARS, US_LETTERS),
+    KEYMAP("dvorak", DVORAK_CHARS, DVORAK_LETTERS),
+};
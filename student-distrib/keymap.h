@@ -0,0 +1,55 @@
+#ifndef _KEYMAP_H
+#define _KEYMAP_H
+
+#include "types.h"
+
+/* What a key decodes to: a character below KEY_SPECIAL, one of the keys below otherwise.
+ * KEY_NONE for scancodes that mean nothing, like the fake shifts around the gray keys. */
+#define KEY_NONE 0
+#define KEY_SPECIAL 0x100
+
+#define KEY_F1 0x101 /* up to KEY_F12, in order */
+#define KEY_F12 0x10C
+
+#define KEY_UP 0x110
+#define KEY_DOWN 0x111
+#define KEY_LEFT 0x112
+#define KEY_RIGHT 0x113
+#define KEY_HOME 0x114
+#define KEY_END 0x115
+#define KEY_PAGE_UP 0x116
+#define KEY_PAGE_DOWN 0x117
+#define KEY_INSERT 0x118
+#define KEY_DELETE 0x119
+
+#define KEY_LSHIFT 0x120
+#define KEY_RSHIFT 0x121
+#define KEY_LCTRL 0x122
+#define KEY_RCTRL 0x123
+#define KEY_LALT 0x124
+#define KEY_RALT 0x125
+#define KEY_CAPS_LOCK 0x126
+
+/* A table is indexed by the set 1 scancode without its release bit, plus KEYMAP_EXTENDED for
+ * scancodes that came after the 0xE0 prefix. */
+#define KEYMAP_CODES 256
+#define KEYMAP_EXTENDED 0x80
+
+/* Modifier bits picking the table, so decoding is one lookup. */
+#define KEYMAP_SHIFT 0x1
+#define KEYMAP_CAPS 0x2
+#define KEYMAP_CTRL 0x4
+#define KEYMAP_STATES 8
+
+/* A keyboard layout: what each key decodes to in each modifier state. */
+typedef struct keymap {
+    const char *name;
+    uint16_t keys[KEYMAP_STATES][KEYMAP_CODES];
+} keymap_t;
+
+/* US QWERTY first, the default */
+#define NUM_KEYMAPS 2
+
+extern const keymap_t keymaps[NUM_KEYMAPS];
+
+#endif /* _KEYMAP_H */
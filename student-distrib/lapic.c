@@ -0,0 +1,107 @@
+#include "lapic.h"
+
+#include "irqtrace.h"
+#include "lib.h"
+
+/* CPUID leaf 1 EDX bit for an on-chip APIC */
+#define CPUID_APIC (1 << 9)
+
+/* Software enable bit of the spurious vector register */
+#define LAPIC_SVR_ENABLE 0x100
+
+#define LAPIC_ID_SHIFT 24
+#define LAPIC_DEST_SHIFT 24
+
+/*
+ * int32_t lapic_present(void)
+ * Description: Checks CPUID for a local APIC
+ * Inputs: None
+ * Outputs: 1 if there is one, 0 otherwise
+ */
+int32_t lapic_present(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & CPUID_APIC) != 0;
+}
+
+/*
+ * void lapic_init(void)
+ * Description: Enables this CPU's local APIC with LAPIC_SPURIOUS_VEC as its spurious vector. The
+ *              local interrupt pins are left as the BIOS set them (LINT0 passes the 8259
+ *              interrupts through on the bootstrap processor).
+ * Inputs: None
+ * Outputs: None
+ */
+void lapic_init(void) { lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VEC); }
+
+/*
+ * uint32_t lapic_id(void)
+ * Description: Reads this CPU's APIC ID
+ * Inputs: None
+ * Outputs: APIC ID
+ */
+uint32_t lapic_id(void) { return lapic_read(LAPIC_ID) >> LAPIC_ID_SHIFT; }
+
+/*
+ * void lapic_eoi(void)
+ * Description: Acknowledges the interrupt being handled to the local APIC
+ * Inputs: None
+ * Outputs: None
+ */
+void lapic_eoi(void) { lapic_write(LAPIC_EOI, 0); }
+
+/*
+ * void lapic_send_ipi(uint32_t dest, uint32_t icr)
+ * Description: Sends an IPI and waits for the local APIC to accept it
+ * Inputs: dest - APIC ID of the target CPU
+ *         icr - delivery mode, vector and shorthand
+ * Outputs: None
+ */
+void lapic_send_ipi(uint32_t dest, uint32_t icr) {
+    unsigned long flags;
+    irq_save(flags);
+
+    // writing the low half sends the IPI, so the destination goes first
+    lapic_write(LAPIC_ICR_HI, dest << LAPIC_DEST_SHIFT);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+
+    irq_restore(flags);
+}
+
+/*
+ * void lapic_timer_start(uint32_t count, int32_t periodic)
+ * Description: Programs this CPU's timer to raise LAPIC_TIMER_VEC after `count` timer clocks, and
+ *              every `count` clocks after that if periodic
+ * Inputs: count - initial count, in bus clocks divided by 16
+ *         periodic - 1 to reload the count when it expires, 0 to fire once
+ * Outputs: None
+ */
+void lapic_timer_start(uint32_t count, int32_t periodic) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VEC | (periodic ? LAPIC_TIMER_PERIODIC : 0));
+
+    // writing the initial count starts the countdown
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+/*
+ * void lapic_timer_stop(void)
+ * Description: Masks this CPU's timer and clears its count
+ * Inputs: None
+ * Outputs: None
+ */
+void lapic_timer_stop(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VEC | LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+/*
+ * uint32_t lapic_timer_current(void)
+ * Description: Reads the current count of this CPU's timer
+ * Inputs: None
+ * Outputs: timer clocks left
+ */
+uint32_t lapic_timer_current(void) { return lapic_read(LAPIC_TIMER_CUR); }
@@ -0,0 +1,73 @@
+#ifndef _LAPIC_H
+#define _LAPIC_H
+
+#include "types.h"
+
+/* Physical (and virtual, it is identity mapped) address of the local APIC registers */
+#define LAPIC_BASE 0xFEE00000
+
+/* Local APIC registers, as offsets from LAPIC_BASE */
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+
+/* Interrupt command register fields */
+#define LAPIC_ICR_FIXED 0x00000
+#define LAPIC_ICR_INIT 0x00500
+#define LAPIC_ICR_STARTUP 0x00600
+#define LAPIC_ICR_PENDING 0x01000
+#define LAPIC_ICR_ASSERT 0x04000
+#define LAPIC_ICR_ALL_BUT_SELF 0xC0000
+
+/* Local vector table fields */
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+
+/* The timer counts down at the bus clock divided by 16 */
+#define LAPIC_TIMER_DIV_16 0x3
+
+/* Vector of the local APIC timer interrupt */
+#define LAPIC_TIMER_VEC 0xEF
+
+/* Vector of spurious local APIC interrupts */
+#define LAPIC_SPURIOUS_VEC 0xFF
+
+static inline uint32_t lapic_read(uint32_t reg) { return *(volatile uint32_t *)(LAPIC_BASE + reg); }
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    *(volatile uint32_t *)(LAPIC_BASE + reg) = val;
+}
+
+/* Whether the CPU has a local APIC (CPUID feature bit). */
+extern int32_t lapic_present(void);
+
+/* Software-enables this CPU's local APIC. */
+extern void lapic_init(void);
+
+/* APIC ID of this CPU. */
+extern uint32_t lapic_id(void);
+
+/* Signals the end of an interrupt delivered by the local APIC (IPIs, local timer). */
+extern void lapic_eoi(void);
+
+/* Sends an interprocessor interrupt. `dest` is an APIC ID, ignored with a shorthand in `icr`. */
+extern void lapic_send_ipi(uint32_t dest, uint32_t icr);
+
+/* Starts this CPU's timer counting down from `count`, once or over and over. */
+extern void lapic_timer_start(uint32_t count, int32_t periodic);
+
+/* Stops this CPU's timer. */
+extern void lapic_timer_stop(void);
+
+/* Count left until this CPU's timer fires, 0 once a one-shot has fired or when stopped. */
+extern uint32_t lapic_timer_current(void);
+
+extern void lapic_spurious_handler(void);
+
+#endif /* _LAPIC_H */
@@ -4,42 +4,137 @@
 #include "lib.h"
 
 #include "paging.h"
+#include "scrollback.h"
+#include "smp.h"
 
 #define VIDEO 0xB8000
 #define NUM_COLS 80
 #define NUM_ROWS 25
 #define ATTRIB 0x7
 
+/* CRTC registers holding the cell the display starts at */
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW 0x0D
+
 /* Access the character data at a given (x, y) on the screen. */
-#define VIDEO_CHAR(x, y) (*(uint8_t *)(video_mem + ((NUM_COLS * (y) + (x)) << 1)))
+#define VIDEO_CHAR(x, y) (*(uint8_t *)(video_mem + ((*screen_origin + NUM_COLS * (y) + (x)) << 1)))
 /* Access the character attribute at a given (x, y) on the screen. */
-#define VIDEO_ATTR(x, y) (*(uint8_t *)(video_mem + ((NUM_COLS * (y) + (x)) << 1) + 1))
-
-static int *screen_x;
-static int *screen_y;
+#define VIDEO_ATTR(x, y)                                                                           \
+    (*(uint8_t *)(video_mem + ((*screen_origin + NUM_COLS * (y) + (x)) << 1) + 1))
+/* Access the character and attribute at a given (x, y) on the screen as one 16-bit cell. */
+#define VIDEO_CELL(x, y) (((uint16_t *)video_mem) + (*screen_origin + NUM_COLS * (y) + (x)))
+
+/* Cursor of the terminal each CPU is writing to, see `set_screen_xy` */
+static int *cpu_screen_x[MAX_CPUS];
+static int *cpu_screen_y[MAX_CPUS];
+#define screen_x (cpu_screen_x[smp_cpu_id()])
+#define screen_y (cpu_screen_y[smp_cpu_id()])
+/* Cell of video memory where the top left corner of that terminal's screen is, see
+ * `set_screen_origin`. It stays in the terminal's region of VID_REGION_CELLS cells. */
+static int *cpu_screen_origin[MAX_CPUS];
+#define screen_origin (cpu_screen_origin[smp_cpu_id()])
+/* History the lines scrolling off that terminal's screen go to, NULL to drop them */
+static scrollback_t *cpu_screen_history[MAX_CPUS];
+#define screen_history (cpu_screen_history[smp_cpu_id()])
+/* Escape sequence state of that terminal, NULL to print escapes as they are */
+static ansi_state_t *cpu_screen_ansi[MAX_CPUS];
+#define screen_ansi (cpu_screen_ansi[smp_cpu_id()])
+/* Nonzero while that terminal's screen has to stay at the start of its region, NULL for never */
+static int32_t *cpu_screen_pinned[MAX_CPUS];
+#define screen_pinned (cpu_screen_pinned[smp_cpu_id()])
 static char *video_mem = (char *)VIDEO;
 
+/* Cell the CRTC starts displaying at */
+static int crtc_start = 0;
+
+/* Escape sequence introducer */
+#define ESC 0x1B
+
+/* VGA color of each ANSI color number (black red green yellow blue magenta cyan white) */
+static const uint8_t ansi_colors[8] = {0x0, 0x4, 0x2, 0x6, 0x1, 0x5, 0x3, 0x7};
+
+/* First cell of the region of video memory a cell is in */
+#define VIDEO_REGION(cell) ((cell) & ~(VID_REGION_CELLS - 1))
+
+/* Whether this CPU writes to the terminal being displayed */
+#define ON_SCREEN() (VIDEO_REGION(*screen_origin) == VIDEO_REGION(crtc_start))
+
 static void scroll(void);
+static void scroll_video(void);
 
 int *get_screen_x(void) { return screen_x; }
 
 int *get_screen_y(void) { return screen_y; }
 
+int *get_screen_origin(void) { return screen_origin; }
+
+scrollback_t *get_screen_history(void) { return screen_history; }
+
+ansi_state_t *get_screen_ansi(void) { return screen_ansi; }
+
+int32_t *get_screen_pinned(void) { return screen_pinned; }
+
 /* void set_screen_xy(void);
  * Inputs: void
  * Return Value: none
- * Function: need to set screen_x and screen_y*/
+ * Function: need to set screen_x and screen_y (of this CPU)*/
 void set_screen_xy(int *x, int *y) {
     screen_x = x;
     screen_y = y;
 }
 
+/* void set_screen_origin(int* origin);
+ * Inputs: int* origin = where the terminal's screen starts in video memory
+ * Return Value: none
+ * Function: need to set screen_origin (of this CPU) along with screen_x and screen_y */
+void set_screen_origin(int *origin) { screen_origin = origin; }
+
+/* void set_screen_history(scrollback_t* history);
+ * Inputs: scrollback_t* history = where lines scrolling off the screen are kept, or NULL
+ * Return Value: none
+ * Function: need to set screen_history (of this CPU) along with the other screen pointers */
+void set_screen_history(scrollback_t *history) { screen_history = history; }
+
+/* void set_screen_ansi(ansi_state_t* ansi);
+ * Inputs: ansi_state_t* ansi = escape sequence state of the terminal, or NULL
+ * Return Value: none
+ * Function: need to set screen_ansi (of this CPU) along with the other screen pointers */
+void set_screen_ansi(ansi_state_t *ansi) { screen_ansi = ansi; }
+
+/* void set_screen_pinned(int32_t* pinned);
+ * Inputs: int32_t* pinned = whether the terminal's screen is mapped by vidmap, or NULL
+ * Return Value: none
+ * Function: need to set screen_pinned (of this CPU) along with the other screen pointers */
+void set_screen_pinned(int32_t *pinned) { screen_pinned = pinned; }
+
+/* void ansi_init(ansi_state_t* ansi);
+ * Inputs: ansi_state_t* ansi = escape sequence state to reset
+ * Return Value: none
+ * Function: leaves any sequence in progress and goes back to the default attribute */
+void ansi_init(ansi_state_t *ansi) {
+    ansi->state = ANSI_NORMAL;
+    ansi->attrib = ATTRIB;
+    ansi->param = 0;
+}
+
+/* void set_screen_start(int start);
+ * Inputs: int start = cell of video memory to show in the top left corner
+ * Return Value: none
+ * Function: pans the display, the cursor position is relative to it */
+void set_screen_start(int start) {
+    crtc_start = start;
+    outb(CRTC_START_HIGH, 0x3D4);
+    outb((uint8_t)((start >> 8) & 0xFF), 0x3D5);
+    outb(CRTC_START_LOW, 0x3D4);
+    outb((uint8_t)(start & 0xFF), 0x3D5);
+}
+
 /* void set_cursor(void);
  * Inputs: void
  * Return Value: none
  * Function: puts cursor in right spot */
 void set_cursor(int x, int y) {
-    uint16_t pos = y * NUM_COLS + x;
+    uint16_t pos = crtc_start + y * NUM_COLS + x;
     outb(0x0F, 0x3D4);
     outb((uint8_t)(pos & 0xFF), 0x3D5);
     outb(0x0E, 0x3D4);
@@ -56,12 +151,14 @@ void set_cursor(int x, int y) {
  * Return Value: none
  * Function: Clears video memory */
 void clear(void) {
-    int32_t i;
-    for (i = 0; i < NUM_ROWS * NUM_COLS; i++) {
-        *(uint8_t *)(video_mem + (i << 1)) = ' ';
-        *(uint8_t *)(video_mem + (i << 1) + 1) = ATTRIB;
+    // start over at the beginning of the terminal's region, where vidmap's page points
+    *screen_origin = VIDEO_REGION(*screen_origin);
+    if (ON_SCREEN()) {
+        set_screen_start(*screen_origin);
     }
 
+    memset_word(VIDEO_CELL(0, 0), (ATTRIB << 8) | ' ', NUM_ROWS * NUM_COLS);
+
     *screen_x = 0;
     *screen_y = 0;
     set_cursor(*screen_x, *screen_y);
@@ -240,9 +337,9 @@ void putc(uint8_t c) {
         (*screen_x)++;
     }
 
-    // Only update cursor if text is actually on the screen (virtual video page is pointing to
-    // actual physical video memory)
-    if (page_table[VID_MEM_INDEX].base_address == VID_MEM_INDEX) {
+    // Only update cursor if text is actually on the screen (the terminal's region is the one the
+    // display starts in)
+    if (ON_SCREEN()) {
         set_cursor(*screen_x, *screen_y);
     }
 }
@@ -253,15 +350,324 @@ void putc(uint8_t c) {
  * Function: Scrolls up one line on the screen
  */
 void scroll(void) {
-    int y;
-    for (y = 0; y < NUM_ROWS; y++) {
-        int x;
-        for (x = 0; x < NUM_COLS; x++) {
-            VIDEO_CHAR(x, y) = y < NUM_ROWS - 1 ? VIDEO_CHAR(x, y + 1) : 0;
-            VIDEO_ATTR(x, y) = y < NUM_ROWS - 1 ? VIDEO_ATTR(x, y + 1) : ATTRIB;
+    scroll_video();
+    (*screen_y)--;
+}
+
+/* void scroll_video(void);
+ * Inputs: void
+ * Return Value: void
+ * Function: Moves the screen contents up one line and blanks the last one, leaving the cursor.
+ *           The screen scrolls by moving down a line through its terminal's region of video
+ *           memory (panning the display if it is shown) and only copies its lines back to the
+ *           start of the region once it reaches the end. A pinned screen always copies, it stays
+ *           where vidmap maps it.
+ */
+static void scroll_video(void) {
+    if (screen_history != NULL) {
+        scrollback_push_row(screen_history, VIDEO_CELL(0, 0), NUM_COLS);
+    }
+
+    int region = VIDEO_REGION(*screen_origin);
+    int pinned = screen_pinned != NULL && *screen_pinned;
+    if (!pinned && *screen_origin + (NUM_ROWS + 1) * NUM_COLS <= region + VID_REGION_CELLS) {
+        *screen_origin += NUM_COLS;
+    } else {
+        memmove(((uint16_t *)video_mem) + region, VIDEO_CELL(0, 1),
+                (NUM_ROWS - 1) * NUM_COLS * 2);
+        *screen_origin = region;
+    }
+    memset_word(VIDEO_CELL(0, NUM_ROWS - 1), ATTRIB << 8, NUM_COLS);
+
+    if (ON_SCREEN()) {
+        set_screen_start(*screen_origin);
+    }
+}
+
+/* void ansi_sgr(ansi_state_t* ansi);
+ * Inputs: ansi_state_t* ansi = state holding the parameters of an SGR sequence
+ * Return Value: void
+ * Function: Sets the attribute from the parameters: 0 reset, 1/22 bright on/off, 30-37 and 90-97
+ *           foreground, 40-47 background, 39/49 default foreground/background */
+static void ansi_sgr(ansi_state_t *ansi) {
+    int i;
+    for (i = 0; i <= ansi->param && i < ANSI_MAX_PARAMS; i++) {
+        uint16_t p = ansi->params[i];
+        if (p == 0) {
+            ansi->attrib = ATTRIB;
+        } else if (p == 1) {
+            ansi->attrib |= 0x08;
+        } else if (p == 22) {
+            ansi->attrib &= ~0x08;
+        } else if (p >= 30 && p <= 37) {
+            ansi->attrib = (ansi->attrib & ~0x07) | ansi_colors[p - 30];
+        } else if (p == 39) {
+            ansi->attrib = (ansi->attrib & ~0x0F) | (ATTRIB & 0x0F);
+        } else if (p >= 40 && p <= 47) {
+            ansi->attrib = (ansi->attrib & ~0x70) | (ansi_colors[p - 40] << 4);
+        } else if (p == 49) {
+            ansi->attrib = (ansi->attrib & ~0x70) | (ATTRIB & 0x70);
+        } else if (p >= 90 && p <= 97) {
+            ansi->attrib = (ansi->attrib & ~0x0F) | 0x08 | ansi_colors[p - 90];
         }
     }
-    (*screen_y)--;
+}
+
+/* void ansi_feed(ansi_state_t* ansi, uint8_t c, int* x, int* y);
+ * Inputs: ansi_state_t* ansi = escape sequence state of the screen
+ *         uint8_t c = next character of the sequence, or the ESC starting it
+ *         int* x, int* y = cursor, moved by the sequence
+ * Return Value: void
+ * Function: Steps the escape sequence parser. Supports cursor position (CSI row;col H or f),
+ *           cursor up/down/forward/back (CSI n A/B/C/D), erase in display (CSI n J), erase in
+ *           line (CSI n K) and SGR colors (CSI ... m). Other sequences are read and dropped. */
+static void ansi_feed(ansi_state_t *ansi, uint8_t c, int *x, int *y) {
+    switch (ansi->state) {
+    case ANSI_NORMAL:
+        ansi->state = ANSI_ESC;
+        return;
+    case ANSI_ESC:
+        if (c == '[') {
+            ansi->state = ANSI_CSI;
+            ansi->param = 0;
+            memset(ansi->params, 0, sizeof(ansi->params));
+        } else {
+            ansi->state = ANSI_NORMAL;
+        }
+        return;
+    }
+
+    // parameters and intermediate bytes until the final byte
+    if (c >= '0' && c <= '9') {
+        if (ansi->param < ANSI_MAX_PARAMS && ansi->params[ansi->param] < 1000) {
+            ansi->params[ansi->param] = ansi->params[ansi->param] * 10 + (c - '0');
+        }
+        return;
+    }
+    if (c == ';') {
+        if (ansi->param < ANSI_MAX_PARAMS) {
+            ansi->param++;
+        }
+        return;
+    }
+    if (c < 0x40 || c > 0x7E) {
+        return;
+    }
+    ansi->state = ANSI_NORMAL;
+
+    // counts of 0 mean 1, positions are 1-based
+    int n = ansi->params[0] ? ansi->params[0] : 1;
+    uint16_t blank = (ansi->attrib << 8) | ' ';
+    int from, to;
+    switch (c) {
+    case 'H':
+    case 'f':
+        *y = n - 1;
+        *x = ansi->params[1] ? ansi->params[1] - 1 : 0;
+        break;
+    case 'A':
+        *y -= n;
+        break;
+    case 'B':
+        *y += n;
+        break;
+    case 'C':
+        *x += n;
+        break;
+    case 'D':
+        *x -= n;
+        break;
+    case 'J':
+    case 'K':
+        // 0 from the cursor to the end, 1 from the start to the cursor, 2 all of it
+        from = c == 'J' ? 0 : *y * NUM_COLS;
+        to = c == 'J' ? NUM_ROWS * NUM_COLS : (*y + 1) * NUM_COLS;
+        if (ansi->params[0] == 0) {
+            from = *y * NUM_COLS + *x;
+        } else if (ansi->params[0] == 1) {
+            to = *y * NUM_COLS + (*x < NUM_COLS ? *x + 1 : NUM_COLS);
+        }
+        if (from < to) {
+            memset_word(VIDEO_CELL(0, 0) + from, blank, to - from);
+        }
+        return;
+    case 'm':
+        ansi_sgr(ansi);
+        return;
+    default:
+        return;
+    }
+
+    // only the cursor motions get the cursor clamped, the rest leave a pending wrap at NUM_COLS
+    if (*x < 0) {
+        *x = 0;
+    } else if (*x >= NUM_COLS) {
+        *x = NUM_COLS - 1;
+    }
+    if (*y < 0) {
+        *y = 0;
+    } else if (*y >= NUM_ROWS) {
+        *y = NUM_ROWS - 1;
+    }
+}
+
+/* int32_t putbuf(const int8_t* buf, int32_t n);
+ * Inputs: const int8_t* buf = characters to print
+ *         int32_t n = number of characters in buf
+ * Return Value: number of characters printed, NUL characters are skipped
+ * Function: Outputs characters like `putc` does, but writes runs of printable characters straight
+ *           into video memory and leaves the hardware cursor alone, see `sync_cursor`. If the
+ *           screen has escape sequence state, the sequences are interpreted (see `ansi_feed`) and
+ *           characters are drawn in the attribute they set. */
+int32_t putbuf(const int8_t *buf, int32_t n) {
+    int *px = screen_x;
+    int *py = screen_y;
+    ansi_state_t *ansi = screen_ansi;
+    int x = *px;
+    int y = *py;
+    int32_t printed = 0;
+
+    int32_t i = 0;
+    while (i < n) {
+        uint8_t c = buf[i];
+
+        // a sequence may have been cut between two writes, the state carries it over
+        if (ansi != NULL && (c == ESC || ansi->state != ANSI_NORMAL)) {
+            ansi_feed(ansi, c, &x, &y);
+            printed++;
+            i++;
+            continue;
+        }
+
+        if (c == '\n' || c == '\r') {
+            y++;
+            if (y == NUM_ROWS) {
+                scroll_video();
+                y--;
+            }
+            x = 0;
+            printed++;
+            i++;
+            continue;
+        }
+
+        if (c == 0x08) { /* backspace ASCII code */
+            if (x != 0 || y != 0) {
+                x--;
+                if (x == -1) {
+                    x = NUM_COLS - 1;
+                    y--;
+                }
+                *VIDEO_CELL(x, y) = ATTRIB << 8;
+            }
+            printed++;
+            i++;
+            continue;
+        }
+
+        if (c == 0) {
+            i++;
+            continue;
+        }
+
+        // wrap before the first character that doesn't fit, like `putc`
+        if (x == NUM_COLS) {
+            x = 0;
+            y++;
+            if (y == NUM_ROWS) {
+                scroll_video();
+                y--;
+            }
+        }
+
+        // copy the run of printable characters up to the end of the line
+        uint16_t attrib = (ansi != NULL ? ansi->attrib : ATTRIB) << 8;
+        uint16_t *cell = VIDEO_CELL(x, y);
+        int32_t end = i + (NUM_COLS - x);
+        if (end > n) {
+            end = n;
+        }
+        while (i < end) {
+            c = buf[i];
+            if (c == '\n' || c == '\r' || c == 0x08 || c == 0 || (c == ESC && ansi != NULL)) {
+                break;
+            }
+            *cell++ = attrib | c;
+            x++;
+            printed++;
+            i++;
+        }
+    }
+
+    *px = x;
+    *py = y;
+    return printed;
+}
+
+/* void scroll_past(const int8_t* buf, int32_t n);
+ * Inputs: const int8_t* buf = characters to print
+ *         int32_t n = number of characters in buf
+ * Return Value: void
+ * Function: Takes in output that would scroll off the screen before anyone saw it: its lines go
+ *           to the history as if they had been printed and scrolled, without drawing the screen.
+ *           The rows above the cursor go first and the line being built is kept in the top row,
+ *           the caller clears the screen once all of it is passed. A backspace at the start of a
+ *           line doesn't go back up. */
+void scroll_past(const int8_t *buf, int32_t n) {
+    int x = *screen_x;
+    int y = *screen_y;
+
+    if (y != 0) {
+        int r;
+        for (r = 0; r < y && screen_history != NULL; r++) {
+            scrollback_push_row(screen_history, VIDEO_CELL(0, r), NUM_COLS);
+        }
+        memmove(VIDEO_CELL(0, 0), VIDEO_CELL(0, y), NUM_COLS * 2);
+        y = 0;
+    }
+
+    int32_t i;
+    for (i = 0; i < n; i++) {
+        uint8_t c = buf[i];
+        if (c == 0) {
+            continue;
+        }
+        if (c == 0x08) {
+            if (x != 0) {
+                x--;
+                *VIDEO_CELL(x, 0) = ATTRIB << 8;
+            }
+            continue;
+        }
+
+        // the line is done at a newline, or when a character doesn't fit
+        if (c == '\n' || c == '\r' || x == NUM_COLS) {
+            if (screen_history != NULL) {
+                scrollback_push_row(screen_history, VIDEO_CELL(0, 0), x);
+            }
+            memset_word(VIDEO_CELL(0, 0), ATTRIB << 8, NUM_COLS);
+            x = 0;
+            if (c == '\n' || c == '\r') {
+                continue;
+            }
+        }
+        *VIDEO_CELL(x, 0) = (ATTRIB << 8) | c;
+        x++;
+    }
+
+    *screen_x = x;
+    *screen_y = y;
+}
+
+/* void sync_cursor(void);
+ * Inputs: void
+ * Return Value: void
+ * Function: Moves the hardware cursor to this CPU's screen position, if the terminal it writes to
+ *           is the one on screen */
+void sync_cursor(void) {
+    if (ON_SCREEN()) {
+        set_cursor(*screen_x, *screen_y);
+    }
 }
 
 /* int8_t* itoa(uint32_t value, int8_t* buf, int32_t radix);
@@ -5,16 +5,49 @@
 #ifndef _LIB_H
 #define _LIB_H
 
+#include "scrollback.h"
 #include "types.h"
 
+/* Parameters of an escape sequence kept, the rest are ignored */
+#define ANSI_MAX_PARAMS 4
+
+/* Where the escape sequence parser is in a sequence */
+#define ANSI_NORMAL 0
+#define ANSI_ESC 1
+#define ANSI_CSI 2
+
+/* Escape sequence parser state and current attribute of a terminal's screen, see `putbuf`. */
+typedef struct ansi_state {
+    uint8_t state;
+    /* Attribute new characters are drawn with, set by SGR sequences. */
+    uint8_t attrib;
+    /* Index of the parameter being read and the parameters so far, 0 when left out. */
+    uint8_t param;
+    uint16_t params[ANSI_MAX_PARAMS];
+} ansi_state_t;
+
+void ansi_init(ansi_state_t *ansi);
+
 int *get_screen_x(void);
 int *get_screen_y(void);
+int *get_screen_origin(void);
+scrollback_t *get_screen_history(void);
+ansi_state_t *get_screen_ansi(void);
+int32_t *get_screen_pinned(void);
 void set_screen_xy(int *x, int *y);
+void set_screen_origin(int *origin);
+void set_screen_history(scrollback_t *history);
+void set_screen_ansi(ansi_state_t *ansi);
+void set_screen_pinned(int32_t *pinned);
+void set_screen_start(int start);
 void set_cursor(int x, int y);
 void clear(void);
 
 int32_t printf(int8_t *format, ...);
 void putc(uint8_t c);
+int32_t putbuf(const int8_t *buf, int32_t n);
+void scroll_past(const int8_t *buf, int32_t n);
+void sync_cursor(void);
 int32_t puts(int8_t *s);
 int8_t *itoa(uint32_t value, int8_t *buf, int32_t radix);
 int8_t *strrev(int8_t *s);
@@ -72,6 +105,13 @@ static inline uint32_t inl(port) {
     return val;
 }
 
+/* Reads the 64-bit time-stamp counter (cycles since reset) */
+static inline uint64_t rdtsc(void) {
+    uint64_t val;
+    asm volatile("rdtsc" : "=A"(val));
+    return val;
+}
+
 /* Writes a byte to a port */
 #define outb(data, port)                                                                           \
     do {                                                                                           \
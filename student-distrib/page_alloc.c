@@ -0,0 +1,97 @@
+#include "page_alloc.h"
+
+#include "spinlock.h"
+
+/* One bit per page of the pool, set while it is handed out. Zero at boot, so the pool can be
+ * used before anything is initialized. */
+static uint32_t page_used[PAGE_POOL_PAGES / 32];
+
+/* Protects `page_used` between CPUs. */
+static spinlock_t page_lock = SPINLOCK_INIT;
+
+#define PAGE_USED(page) (page_used[(page) >> 5] & (1 << ((page)&31)))
+
+/*
+ * page_alloc(uint32_t pages, uint32_t align)
+ *   DESCRIPTION: Takes the first run of free pages of the pool that is big enough and aligned
+ *
+ *   INPUTS: pages - number of contiguous pages wanted
+ *           align - the first page's address is a multiple of this many pages, a power of two
+ *   OUTPUTS: none
+ *   RETURN VALUE: address of the first page, NULL if no run is free
+ *   SIDE EFFECTS: none
+ */
+void *page_alloc(uint32_t pages, uint32_t align) {
+    if (pages == 0 || align == 0) {
+        return NULL;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&page_lock, flags);
+
+    uint32_t start = 0;
+    while (start + pages <= PAGE_POOL_PAGES) {
+        uint32_t n = 0;
+        while (n < pages && !PAGE_USED(start + n)) {
+            n++;
+        }
+
+        if (n == pages) {
+            for (n = 0; n < pages; n++) {
+                page_used[(start + n) >> 5] |= 1 << ((start + n) & 31);
+            }
+            spin_unlock_irqrestore(&page_lock, flags);
+            return (void *)(PAGE_POOL_START + start * FOURKB_BITS);
+        }
+
+        // the run can't start before the used page, go to the next aligned page after it
+        start = (start + n + align) & ~(align - 1);
+    }
+
+    spin_unlock_irqrestore(&page_lock, flags);
+    return NULL;
+}
+
+/*
+ * page_free(void *addr, uint32_t pages)
+ *   DESCRIPTION: Gives back pages taken with `page_alloc`
+ *
+ *   INPUTS: addr - address `page_alloc` returned
+ *           pages - number of pages asked for
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void page_free(void *addr, uint32_t pages) {
+    uint32_t start = ((uint32_t)addr - PAGE_POOL_START) / FOURKB_BITS;
+
+    unsigned long flags;
+    spin_lock_irqsave(&page_lock, flags);
+
+    uint32_t n;
+    for (n = 0; n < pages; n++) {
+        page_used[(start + n) >> 5] &= ~(1 << ((start + n) & 31));
+    }
+
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+/*
+ * page_free_count()
+ *   DESCRIPTION: Counts the pages of the pool not handed out
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of free pages
+ *   SIDE EFFECTS: none
+ */
+uint32_t page_free_count(void) {
+    uint32_t count = 0;
+    uint32_t page;
+    for (page = 0; page < PAGE_POOL_PAGES; page++) {
+        if (!PAGE_USED(page)) {
+            count++;
+        }
+    }
+    return count;
+}
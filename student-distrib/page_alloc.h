@@ -0,0 +1,26 @@
+#ifndef _PAGE_ALLOC_H
+#define _PAGE_ALLOC_H
+
+#include "types.h"
+#include "x86_desc.h"
+
+/* Physical memory the kernel hands out by the page: the free RAM between the BIOS area and the
+ * kernel's 4MB page. `paging_init` maps it to itself, kernel only, so a page can be used at its
+ * physical address before and after paging is on. */
+#define PAGE_POOL_START 0x100000
+#define PAGE_POOL_END 0x400000
+#define PAGE_POOL_PAGES ((PAGE_POOL_END - PAGE_POOL_START) / FOURKB_BITS)
+
+/* Pages needed to hold an object of `bytes` bytes. */
+#define PAGES_FOR(bytes) (((bytes) + FOURKB_BITS - 1) / FOURKB_BITS)
+
+/* Takes `pages` contiguous pages starting on a multiple of `align` pages, NULL if none are free. */
+extern void *page_alloc(uint32_t pages, uint32_t align);
+
+/* Gives back pages taken with `page_alloc`. */
+extern void page_free(void *addr, uint32_t pages);
+
+/* Number of pages of the pool not handed out. */
+extern uint32_t page_free_count(void);
+
+#endif /* _PAGE_ALLOC_H */
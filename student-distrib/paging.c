@@ -1,8 +1,25 @@
 #include "paging.h"
 
+#include "clock.h"
+#include "lib.h"
+#include "page_alloc.h"
+#include "smp.h"
+#include "syscall.h"
+
 /* Starting address given to us in documentation*/
 #define KERNEL_ADDRESS 0x400000
 
+/* Tables of the application processors. What each CPU runs decides its user and video mappings,
+ * so every CPU gets its own copies of the bootstrap processor's tables. */
+static page_directory_t ap_page_dir[MAX_CPUS - 1][PAGE_NUM] __attribute__((aligned(FOURKB_BITS)));
+static page_table_t ap_page_table[MAX_CPUS - 1][PAGE_NUM] __attribute__((aligned(FOURKB_BITS)));
+static page_table_t ap_uservid_page_table[MAX_CPUS - 1][PAGE_NUM]
+    __attribute__((aligned(FOURKB_BITS)));
+
+page_directory_t *cpu_page_dir[MAX_CPUS] = {page_dir};
+static page_table_t *cpu_page_table[MAX_CPUS] = {page_table};
+static page_table_t *cpu_uservid_page_table[MAX_CPUS] = {uservid_page_table};
+
 /*
  * init_preg
  *   DESCRIPTION: Enables paging by setting appropriate bits in CR0, CR3, adn CR4.
@@ -73,12 +90,15 @@ void paging_init() {
     page_dir[0].page_size = 0;
     page_dir[0].page_table_address = ((int)page_table) >> ADDRESS_SHIFT;
 
-    page_table[VID_MEM_INDEX].present = 1;
+    // the rest of the text window, every terminal has its screen in it
+    for (i = 0; i < VID_MEM_PAGES; i++) {
+        page_table[VID_MEM_INDEX + i].present = 1;
+    }
 
-    // terminal backup video pages
-    page_table[VID_MEM1_INDEX].present = 1;
-    page_table[VID_MEM2_INDEX].present = 1;
-    page_table[VID_MEM3_INDEX].present = 1;
+    // the page pool, kernel only, where terminals get their state and off-screen video memory
+    for (i = PAGE_POOL_START / FOURKB_BITS; i < PAGE_POOL_END / FOURKB_BITS; i++) {
+        page_table[i].present = 1;
+    }
 
     // init kernel by making it present and looking at kernel address
     page_dir[1].present = 1;
@@ -99,6 +119,99 @@ void paging_init() {
     uservid_page_table[0].present = 1;
     uservid_page_table[0].base_address = VID_MEM_INDEX;
 
+    // the time page after it, read-only for user space
+    uservid_page_table[USER_TIME_INDEX].user_supervisor = 1;
+    uservid_page_table[USER_TIME_INDEX].read_write = 0;
+    uservid_page_table[USER_TIME_INDEX].present = 1;
+    uservid_page_table[USER_TIME_INDEX].base_address = clock_page_address() >> ADDRESS_SHIFT;
+
     /* updating registers to init paging (CRO, CR3, CR4)*/
     init_preg((int)page_dir);
 }
+
+/*
+ * paging_init_cpu
+ *   DESCRIPTION: Copies the bootstrap processor's page directory and tables for an application
+ *                processor and points the copied directory at the copied tables
+ *
+ *   INPUTS: cpu - CPU index, at least 1
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void paging_init_cpu(uint32_t cpu) {
+    page_directory_t *dir = ap_page_dir[cpu - 1];
+    memcpy(dir, page_dir, sizeof(ap_page_dir[0]));
+    memcpy(ap_page_table[cpu - 1], page_table, sizeof(ap_page_table[0]));
+    memcpy(ap_uservid_page_table[cpu - 1], uservid_page_table, sizeof(ap_uservid_page_table[0]));
+
+    dir[0].page_table_address = ((int)ap_page_table[cpu - 1]) >> ADDRESS_SHIFT;
+    dir[USER_VID_INDEX].page_table_address = ((int)ap_uservid_page_table[cpu - 1]) >> ADDRESS_SHIFT;
+
+    cpu_page_dir[cpu] = dir;
+    cpu_page_table[cpu] = ap_page_table[cpu - 1];
+    cpu_uservid_page_table[cpu] = ap_uservid_page_table[cpu - 1];
+}
+
+/*
+ * paging_map_apic
+ *   DESCRIPTION: Maps the 4MB page with the APIC registers with caching disabled
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Flushes the TLB
+ */
+void paging_map_apic(void) {
+    page_dir[APIC_INDEX].present = 1;
+    page_dir[APIC_INDEX].write_through = 1;
+    page_dir[APIC_INDEX].cache_disabled = 1;
+    page_dir[APIC_INDEX].page_table_address = APIC_ADDRESS >> ADDRESS_SHIFT;
+    flush_tlb();
+}
+
+/*
+ * paging_set_identity
+ *   DESCRIPTION: Maps a page of the first 4MB to the same physical page on this CPU, or unmaps it
+ *
+ *   INPUTS: page_index - page number, below VID_MEM_INDEX
+ *           present - 1 to map it, 0 to unmap it
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Flushes the TLB
+ */
+void paging_set_identity(uint32_t page_index, int32_t present) {
+    page_table_t *table = cpu_page_table[smp_cpu_id()];
+    table[page_index].base_address = page_index;
+    table[page_index].present = present;
+    flush_tlb();
+}
+
+/*
+ * paging_map_user
+ *   DESCRIPTION: Points the 4MB user page at a process's physical memory on this CPU
+ *
+ *   INPUTS: address - physical address of the process's 4MB page
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Flushes the TLB
+ */
+void paging_map_user(uint32_t address) {
+    cpu_page_dir[smp_cpu_id()][USER_INDEX].page_table_address = address >> ADDRESS_SHIFT;
+    flush_tlb();
+}
+
+/*
+ * paging_map_video
+ *   DESCRIPTION: Points a CPU's user vidmap page at a physical page: the start of the screen of
+ *                the terminal it runs
+ *
+ *   INPUTS: cpu - CPU whose tables to change
+ *           page_index - physical page number
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: The caller flushes the TLB
+ */
+void paging_map_video(uint32_t cpu, uint32_t page_index) {
+    cpu_uservid_page_table[cpu][0].base_address = page_index;
+}
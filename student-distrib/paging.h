@@ -11,30 +11,24 @@
 /* Video memory address in table */
 #define VID_MEM 0xB8000
 
-/* Video memory address in table */
-#define VID_MEM_TER1 (VID_MEM + FOURKB_BITS)
-
-/* Video memory address in table */
-#define VID_MEM_TER2 (VID_MEM_TER1 + FOURKB_BITS)
-
-/* Video memory address in table */
-#define VID_MEM_TER3 (VID_MEM_TER2 + FOURKB_BITS)
-
 /* Video memory address in table */
 #define VID_MEM_INDEX (VID_MEM / FOURKB_BITS)
 
-/* Video memory address in table */
-#define VID_MEM1_INDEX (VID_MEM_TER1 / FOURKB_BITS)
-
-/* Video memory address in table */
-#define VID_MEM2_INDEX (VID_MEM_TER2 / FOURKB_BITS)
+/* Pages of the VGA text window (0xB8000 to 0xBFFFF) */
+#define VID_MEM_PAGES 8
 
-/* Video memory address in table */
-#define VID_MEM3_INDEX (VID_MEM_TER3 / FOURKB_BITS)
+/* Pages of the text window each terminal's screen lives and pans in, and the number of character
+ * cells in them (a power of two) */
+#define VID_REGION_PAGES 2
+#define VID_REGION_CELLS (VID_REGION_PAGES * FOURKB_BITS / 2)
 
 /* Video memory address in table */
 #define VIRTUAL_VID_MEM 0x8C00000
 
+/* Read-only time page every process sees next to its vidmap page, see clock.h */
+#define USER_TIME_PAGE (VIRTUAL_VID_MEM + FOURKB_BITS)
+#define USER_TIME_INDEX 1
+
 /* Video memory address in table */
 #define USER_INDEX 32
 
@@ -44,7 +38,29 @@
 /* Starting address given to us in documentation*/
 #define USER_ADDRESS 0x8000000
 
+/* 4MB page holding the I/O APIC and local APIC registers */
+#define APIC_ADDRESS 0xFEC00000
+#define APIC_INDEX (APIC_ADDRESS >> 22)
+
+/* Page directory of each CPU, loaded in CR3 by the application processors in `ap_start` */
+extern page_directory_t *cpu_page_dir[MAX_CPUS];
+
 /* Inits page_dir and page_table and CR0, CR3, CR4 as needed to start paging*/
 extern void paging_init();
 
+/* Gives an application processor its own copy of the page directory and tables */
+extern void paging_init_cpu(uint32_t cpu);
+
+/* Maps the APIC registers uncached, before the other CPUs' tables are copied */
+extern void paging_map_apic(void);
+
+/* Maps (or unmaps) a page of the first 4MB to itself on this CPU */
+extern void paging_set_identity(uint32_t page_index, int32_t present);
+
+/* Maps the 4MB user page to a physical address on this CPU and flushes the TLB */
+extern void paging_map_user(uint32_t address);
+
+/* Points a CPU's user video memory page at a physical page (by index), without flushing the TLB */
+extern void paging_map_video(uint32_t cpu, uint32_t page_index);
+
 #endif /* _PAGING_H */
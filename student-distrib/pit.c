@@ -1,36 +1,376 @@
 #include "pit.h"
 
+#include "clock.h"
 #include "i8259.h"
+#include "irqtrace.h"
+#include "lapic.h"
 #include "lib.h"
 #include "scheduling.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
 
-#define PIT_RATE 11932 // 1.19318 Mhz
 #define PIT_DATA 0x40
 #define PIT_CMD 0x43
-#define PIT_MODE 0x37 // square wave
+#define PIT_MODE 0x37    // square wave
+#define PIT_ONESHOT 0x30 // channel 0, lobyte/hibyte, interrupt on terminal count
+#define PIT_LATCH 0x00   // latch channel 0 count
 #define PIT_IRQ 0
 
+/* Channel 2 is gated through the keyboard controller's port B, its output can be read back there.
+ * Calibration runs it for one tick in interrupt-on-terminal-count mode. */
+#define PIT_CH2_DATA 0x42
+#define PIT_CH2_ONESHOT 0xB0 // channel 2, lobyte/hibyte, interrupt on terminal count
+#define PIT_PORT_B 0x61
+#define PIT_PORT_B_GATE 0x01
+#define PIT_PORT_B_SPEAKER 0x02
+#define PIT_PORT_B_OUT2 0x20
+
+/* Longest one-shot we program, in ticks. The 16-bit counter allows 5, but after a shot expires
+ * the counter wraps and keeps counting down from 0xFFFF. Leaving headroom lets `pit_rearm` tell a
+ * shot that already fired (count above what was programmed) from one still running. */
+#define PIT_MAX_SHOT_TICKS 4
+
+volatile uint32_t pit_ticks = 0;
+volatile uint32_t pit_interrupts = 0;
+
+/* Local APIC timer counts per tick, 0 when the PIT drives scheduling instead. */
+uint32_t pit_lapic_counts = 0;
+
+/* TSC cycles per tick, measured along with the local APIC timer. */
+uint32_t pit_tsc_counts = 0;
+
+/* Set once `pit_init` chose the scheduling clock, the application processors wait for it. */
+static volatile int32_t pit_ready = 0;
+
+/* Whether each CPU's local APIC tick is running. Changed by its own CPU with sched_lock held, so
+ * a `pit_rearm` after a scheduler change sees whether the CPU still has to be woken up. */
+static volatile int32_t pit_cpu_tick_on[MAX_CPUS];
+
+#ifdef PIT_DYNTICK
+/* Whether a one-shot is counting down, its length in PIT counts and the tick it ends on. */
+static int32_t pit_armed = 0;
+static uint32_t pit_shot_counts;
+static uint32_t pit_shot_expiry;
+
+/* PIT counts elapsed past the last whole tick. */
+static uint32_t pit_residual = 0;
+
+/* Protects the one-shot state and the PIT ports, any CPU can rearm. */
+static spinlock_t pit_lock = SPINLOCK_INIT;
+
+/*
+ * void pit_account(uint32_t counts)
+ * Description: Adds elapsed PIT counts to the tick clock
+ * Inputs: counts - PIT counts elapsed since the last time this was called
+ * Outputs: None
+ */
+static void pit_account(uint32_t counts) {
+    pit_residual += counts;
+    pit_ticks += pit_residual / PIT_RATE;
+    pit_residual %= PIT_RATE;
+}
+
+/*
+ * void pit_oneshot(uint32_t ticks)
+ * Description: Programs the PIT to interrupt once after the given number of ticks (aligned to
+ *              tick boundaries), capped to PIT_MAX_SHOT_TICKS
+ * Inputs: ticks - ticks from now, at least 1
+ * Outputs: None
+ */
+static void pit_oneshot(uint32_t ticks) {
+    if (ticks > PIT_MAX_SHOT_TICKS) {
+        ticks = PIT_MAX_SHOT_TICKS;
+    }
+
+    pit_shot_counts = ticks * PIT_RATE - pit_residual;
+    pit_shot_expiry = pit_ticks + ticks;
+    pit_armed = 1;
+
+    outb(PIT_ONESHOT, PIT_CMD);
+    outb((uint8_t)(pit_shot_counts & 0xFF), PIT_DATA);        // send lower 8
+    outb((uint8_t)((pit_shot_counts >> 8) & 0xFF), PIT_DATA); // send upper 8
+}
+#endif
+
+/*
+ * void pit_ch2_start(uint16_t counts)
+ * Description: Starts PIT channel 2 counting down, with the speaker off. It runs on the PIT's own
+ *              clock without interrupts, a reference to measure other clocks against.
+ * Inputs: counts - PIT counts until `pit_ch2_done`, at PIT_FREQ
+ * Outputs: None
+ */
+void pit_ch2_start(uint16_t counts) {
+    // gate low while programming, speaker off
+    uint8_t port_b = inb(PIT_PORT_B) & ~(PIT_PORT_B_GATE | PIT_PORT_B_SPEAKER);
+    outb(port_b, PIT_PORT_B);
+
+    outb(PIT_CH2_ONESHOT, PIT_CMD);
+    outb((uint8_t)(counts & 0xFF), PIT_CH2_DATA);        // send lower 8
+    outb((uint8_t)((counts >> 8) & 0xFF), PIT_CH2_DATA); // send upper 8
+
+    // raising the gate starts the count, OUT2 goes high once it reaches 0
+    outb(port_b | PIT_PORT_B_GATE, PIT_PORT_B);
+}
+
+/*
+ * int32_t pit_ch2_done(void)
+ * Description: Checks if the count `pit_ch2_start` started reached 0
+ * Inputs: None
+ * Outputs: 1 once it did, 0 before
+ */
+int32_t pit_ch2_done(void) { return (inb(PIT_PORT_B) & PIT_PORT_B_OUT2) != 0; }
+
+/*
+ * void pit_ch2_stop(void)
+ * Description: Lowers PIT channel 2's gate again after `pit_ch2_start`
+ * Inputs: None
+ * Outputs: None
+ */
+void pit_ch2_stop(void) { outb(inb(PIT_PORT_B) & ~PIT_PORT_B_GATE, PIT_PORT_B); }
+
+/*
+ * void pit_calibrate(void)
+ * Description: Measures how many TSC cycles and local APIC timer counts (if there is a local APIC)
+ *              one tick takes, by letting PIT channel 2 count down one tick while they run
+ * Inputs: None
+ * Outputs: None, sets pit_tsc_counts and pit_lapic_counts
+ */
+static void pit_calibrate(void) {
+    int32_t lapic = lapic_present();
+
+    pit_ch2_start(PIT_RATE);
+    if (lapic) {
+        lapic_timer_start(0xFFFFFFFF, 0);
+    }
+    uint64_t tsc = rdtsc();
+
+    while (!pit_ch2_done()) {
+    }
+
+    pit_tsc_counts = rdtsc() - tsc;
+    if (lapic) {
+        pit_lapic_counts = 0xFFFFFFFF - lapic_timer_current();
+        lapic_timer_stop();
+    }
+    pit_ch2_stop();
+}
+
 /*
  * void pit_init(void)
- * Description: Initializes the PIT to 100 Hz
+ * Description: Initializes the PIT to 100 Hz, or to a first one-shot tick in dynamic-tick mode.
+ *              Calibrates the TSC for the clocksource. With a local APIC, calibrates its timer
+ *              too and makes it the scheduling clock of every CPU, the PIT then only keeps time
+ *              and runs the timers.
  * Inputs: None
  * Outputs: None
  */
 // https://wiki.osdev.org/Programmable_Interval_Timer
+// https://wiki.osdev.org/APIC_timer
 void pit_init(void) {
+    pit_calibrate();
+
+#ifdef PIT_DYNTICK
+    // the scheduler needs a tick to start the terminals' shells
+    pit_oneshot(1);
+#else
     outb(PIT_MODE, PIT_CMD);
     outb((uint8_t)(PIT_RATE & 0xFF), PIT_DATA);        // send lower 8
     outb((uint8_t)((PIT_RATE >> 8) & 0xFF), PIT_DATA); // send upper 8
+#endif
 
     enable_irq(PIT_IRQ);
+
+    pit_ready = 1;
+    pit_init_cpu();
 }
+
+/*
+ * void pit_init_cpu(void)
+ * Description: Starts this CPU's local APIC timer as its scheduling clock, once `pit_init` has
+ *              calibrated it. Without one this CPU is scheduled by the PIT (or its reschedule IPI).
+ * Inputs: None
+ * Outputs: None
+ */
+void pit_init_cpu(void) {
+    while (!pit_ready) {
+        asm volatile("pause");
+    }
+
+    if (pit_lapic_counts != 0) {
+        pit_cpu_tick_on[smp_cpu_id()] = 1;
+        lapic_timer_start(pit_lapic_counts, 1);
+    }
+}
+
+/*
+ * void pit_cpu_update_tick(void)
+ * Description: Starts or stops this CPU's local APIC tick as `scheduler_cpu_needs_tick` decides,
+ *              so a CPU that idles or runs a single best-effort process isn't interrupted for
+ *              nothing. Only in dynamic-tick mode, with a local APIC timer. Called by the
+ *              scheduler with sched_lock held.
+ * Inputs: None
+ * Outputs: None
+ */
+void pit_cpu_update_tick(void) {
+#ifdef PIT_DYNTICK
+    uint32_t cpu = smp_cpu_id();
+    if (pit_lapic_counts == 0) {
+        return;
+    }
+
+    int32_t on = scheduler_cpu_needs_tick(cpu);
+    if (on == pit_cpu_tick_on[cpu]) {
+        return;
+    }
+
+    pit_cpu_tick_on[cpu] = on;
+    if (on) {
+        lapic_timer_start(pit_lapic_counts, 1);
+    } else {
+        lapic_timer_stop();
+    }
+#endif
+}
+
+/*
+ * void pit_kick_cpus(void)
+ * Description: Gets the local APIC tick running again on the CPUs that need it after a
+ *              scheduler change, this one directly and the others with a reschedule IPI (their
+ *              scheduler then starts it)
+ * Inputs: None
+ * Outputs: None
+ */
+static void pit_kick_cpus(void) {
+    uint32_t self = smp_cpu_id();
+    uint32_t c;
+    for (c = 0; c < MAX_CPUS; c++) {
+        if (pit_cpu_tick_on[c] || !scheduler_cpu_needs_tick(c)) {
+            continue;
+        }
+
+        if (c == self) {
+            unsigned long flags;
+            irq_save(flags);
+            pit_cpu_tick_on[c] = 1;
+            lapic_timer_start(pit_lapic_counts, 1);
+            irq_restore(flags);
+        } else {
+            smp_send_ipi(c, SMP_RESCHED_VEC);
+        }
+    }
+}
+
+/*
+ * uint32_t pit_cpu_ticks(void)
+ * Description: Gets the scheduling clock of this CPU, to measure how long a process ran
+ * Inputs: None
+ * Outputs: local APIC ticks taken by this CPU, or pit_ticks when the PIT schedules
+ */
+uint32_t pit_cpu_ticks(void) { return pit_lapic_counts != 0 ? this_cpu()->ticks : pit_ticks; }
+
+/*
+ * void pit_rearm(void)
+ * Description: Makes sure the PIT fires by the next deadline: a quantum expiry when more than one
+ *              process can run or a real-time budget is being used, or the next timer (sleep
+ *              wakeups included). If nothing needs the clock the pending shot (if any) is left to
+ *              expire and no new one is programmed. With local APIC ticks, also restarts the
+ *              ones a CPU now needs. No-op with a fixed-rate tick.
+ * Inputs: None
+ * Outputs: None
+ */
+void pit_rearm(void) {
+#ifdef PIT_DYNTICK
+    unsigned long flags;
+    spin_lock_irqsave(&pit_lock, flags);
+
+    // the local APIC timers take care of quanta when there are any
+    if (pit_lapic_counts != 0) {
+        pit_kick_cpus();
+    }
+
+    uint32_t ticks = timer_next_expiry();
+    if (pit_lapic_counts == 0 && scheduler_needs_tick()) {
+        ticks = 1;
+    }
+
+    if (ticks == TIMER_NO_EXPIRY) {
+        spin_unlock_irqrestore(&pit_lock, flags);
+        return;
+    }
+
+    if (!pit_armed) {
+        pit_oneshot(ticks);
+    } else if (pit_shot_expiry > pit_ticks + ticks) {
+        // pending shot ends too late, account for the part that ran and start a shorter one
+        outb(PIT_LATCH, PIT_CMD);
+        uint32_t count = inb(PIT_DATA);
+        count |= inb(PIT_DATA) << 8;
+
+        // a count above what we programmed means the shot already wrapped, its interrupt is
+        // pending and the handler will rearm
+        if (count <= pit_shot_counts) {
+            pit_account(pit_shot_counts - count);
+            pit_oneshot(ticks);
+        }
+    }
+
+    spin_unlock_irqrestore(&pit_lock, flags);
+#endif
+}
+
 /*
  * void pit_handler(void)
- * Description: handle pit interrupts and context switch
+ * Description: handle pit interrupts and context switch, on the bootstrap processor. With local
+ *              APIC timers scheduling, only keeps time and runs the expired timers.
  * Inputs: None
  * Outputs: None
  */
 void pit_handler_base(void) {
     send_eoi(PIT_IRQ);
-    scheduler();
+    pit_interrupts++;
+
+#ifdef PIT_DYNTICK
+    spin_lock(&pit_lock);
+    pit_armed = 0;
+    pit_account(pit_shot_counts);
+    spin_unlock(&pit_lock);
+#else
+    pit_ticks++;
+#endif
+    clock_tick(pit_ticks);
+
+    if (pit_lapic_counts != 0) {
+        timer_run();
+        pit_rearm();
+        return;
+    }
+
+    scheduler_tick();
+    timer_run();
+    pit_rearm();
+
+    // only this CPU gets the PIT interrupt, pass the tick on so the others switch too
+    smp_send_ipi_others(SMP_RESCHED_VEC);
+
+    if (scheduler_preemptible()) {
+        scheduler();
+    }
+}
+
+/*
+ * void pit_lapic_handler(void)
+ * Description: handle local APIC timer interrupts, the scheduling clock of each CPU: charge the
+ *              running process and context switch
+ * Inputs: None
+ * Outputs: None
+ */
+void pit_lapic_handler_base(void) {
+    lapic_eoi();
+    this_cpu()->ticks++;
+
+    scheduler_tick();
+    if (scheduler_preemptible()) {
+        scheduler();
+    }
 }
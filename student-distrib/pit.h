@@ -1,12 +1,59 @@
 #ifndef _PIT_H
 #define _PIT_H
 
+#include "types.h"
+
 #define PIT_HANDLER_VEC 0x20
 
+/* Ticks per second of the scheduling clock */
+#define PIT_HZ 100
+
+/* Input clock of the PIT, and PIT counts per tick */
+#define PIT_FREQ 1193182
+#define PIT_RATE 11932
+
+/* Program the PIT in one-shot mode for the next deadline instead of interrupting at a fixed
+ * PIT_HZ. Comment out to get the fixed-rate square wave back. */
+#define PIT_DYNTICK
+
+/* Clock ticks since boot, the time base of the timers. In dynamic-tick mode it only advances
+ * while something (a quantum or a timer) is waiting on it. */
+extern volatile uint32_t pit_ticks;
+
+/* Number of PIT interrupts taken since boot. */
+extern volatile uint32_t pit_interrupts;
+
+/* Local APIC timer counts per tick (calibrated at boot), 0 if the PIT is the scheduling clock. */
+extern uint32_t pit_lapic_counts;
+
+/* TSC cycles per tick (PIT_RATE PIT counts), calibrated at boot. */
+extern uint32_t pit_tsc_counts;
+
 extern void pit_init(void);
 
+/* Starts this CPU's local APIC scheduling tick, waiting for `pit_init` on the other CPUs. */
+extern void pit_init_cpu(void);
+
+/* Runs this CPU's local APIC tick only while it needs one, in dynamic-tick mode. */
+extern void pit_cpu_update_tick(void);
+
+/* This CPU's scheduling clock, in ticks. */
+extern uint32_t pit_cpu_ticks(void);
+
+/* PIT channel 2 as a reference clock: counts down `counts` at PIT_FREQ, no interrupt. */
+extern void pit_ch2_start(uint16_t counts);
+extern int32_t pit_ch2_done(void);
+extern void pit_ch2_stop(void);
+
+/* Reprograms the next PIT interrupt after the set of deadlines changed. */
+extern void pit_rearm(void);
+
 extern void pit_handler(void);
 
 extern void pit_handler_base(void);
 
+extern void pit_lapic_handler(void);
+
+extern void pit_lapic_handler_base(void);
+
 #endif
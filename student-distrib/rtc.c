@@ -1,10 +1,12 @@
 #include "rtc.h"
 
 #include "i8259.h"
+#include "irqtrace.h"
 #include "lib.h"
 #include "scheduling.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "syscall.h"
-#include "terminal.h"
 
 #define RTC_IRQ 8
 #define RTC_IO_PORT 0x70
@@ -13,33 +15,333 @@
 #define RTC_REG_B 0x8B
 #define RTC_REG_C 0x8C
 
+/* Periodic interrupt enable bit of register B */
+#define RTC_PIE 0x40
+
+/* Time and date registers, NMI kept disabled like the registers above */
+#define RTC_SECONDS 0x80
+#define RTC_MINUTES 0x82
+#define RTC_HOURS 0x84
+#define RTC_DAY 0x87
+#define RTC_MONTH 0x88
+#define RTC_YEAR 0x89
+#define RTC_DATE_REGS 6
+
+/* Update-in-progress bit of register A: the time registers are being changed */
+#define RTC_UIP 0x80
+/* Register B bits for binary (not BCD) values and 24-hour mode, and the PM bit of the hours */
+#define RTC_BINARY 0x04
+#define RTC_24H 0x02
+#define RTC_PM 0x80
+
 #define MIN_FREQ 2
 #define MAX_FREQ 1024
+#define MAX_FREQ_LOG2 10
 #define INIT_FREQ (MAX_FREQ / MIN_FREQ)
 
 #define MIN_RATE 3
 #define MAX_RATE 15
 
-// used to track the ticks for the emulated frequency
-volatile uint32_t rtc_ticks_per_interrupt = INIT_FREQ;
+/* Time the RTC interrupts counted, in 1/MAX_FREQ s. The virtual timers' periods and deadlines
+ * are in the same unit. */
+static uint32_t rtc_ticks = 0;
+
+/* What each hardware interrupt adds to rtc_ticks at the current rate, 0 while the periodic
+ * interrupt is off */
+static uint32_t rtc_step = 0;
+
+/* Number of armed timers at each frequency, by its log2. The RTC runs at the highest. */
+static uint32_t rtc_users[MAX_FREQ_LOG2 + 1];
+
+/* Virtual timer of every file descriptor of every process, and one for kernel tests reading
+ * without a process. Closing an fd puts its timer back to the 2 Hz it starts at. */
+static rtc_vtimer_t rtc_vtimers[MAXPIDS][MAX_OPEN_FILES];
+static rtc_vtimer_t rtc_kernel_vtimer;
+
+/* Min-heap of the timers reads are waiting on, earliest deadline first. A process waits on at
+ * most one, but every fd can be queued. */
+#define RTC_HEAP_SIZE (MAXPIDS * MAX_OPEN_FILES + 1)
+static rtc_vtimer_t *rtc_heap[RTC_HEAP_SIZE];
+static int32_t rtc_heap_size = 0;
+
+/* Protects the timers, the heap, `rtc_ticks` and the RTC registers between CPUs. Taken before
+ * sched_lock. */
+static spinlock_t rtc_lock = SPINLOCK_INIT;
+
+/* Whether deadline `a` comes before deadline `b`, through the difference so it holds across a
+ * wrap of rtc_ticks */
+#define RTC_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+/*
+ * void rtc_vtimer_reset(rtc_vtimer_t *vt)
+ * Inputs: vt - timer to reset
+ * Output: None
+ * Function: Puts a timer back to 2 Hz and unanchored, as a newly opened fd has it
+ */
+static void rtc_vtimer_reset(rtc_vtimer_t *vt) {
+    vt->period = INIT_FREQ;
+    vt->deadline = 0;
+    vt->armed = 0;
+    vt->heap_idx = -1;
+    vt->fired = 0;
+    vt->pcb = NULL;
+}
+
+/*
+ * void rtc_heap_set(int32_t i, rtc_vtimer_t *vt)
+ * Inputs: i - heap position
+ *         vt - timer to put there
+ * Output: None
+ * Function: Stores a timer in the heap and records where it is
+ */
+static void rtc_heap_set(int32_t i, rtc_vtimer_t *vt) {
+    rtc_heap[i] = vt;
+    vt->heap_idx = i;
+}
+
+/*
+ * void rtc_heap_sift(int32_t i)
+ * Inputs: i - heap position holding a timer that may be out of order
+ * Output: None
+ * Function: Moves the timer up towards the root or down towards the leaves until its deadline is
+ *  between its parent's and its children's
+ */
+static void rtc_heap_sift(int32_t i) {
+    rtc_vtimer_t *vt = rtc_heap[i];
+
+    while (i > 0 && RTC_BEFORE(vt->deadline, rtc_heap[(i - 1) / 2]->deadline)) {
+        rtc_heap_set(i, rtc_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    while (2 * i + 1 < rtc_heap_size) {
+        int32_t child = 2 * i + 1;
+        if (child + 1 < rtc_heap_size &&
+            RTC_BEFORE(rtc_heap[child + 1]->deadline, rtc_heap[child]->deadline)) {
+            child++;
+        }
+        if (!RTC_BEFORE(rtc_heap[child]->deadline, vt->deadline)) {
+            break;
+        }
+        rtc_heap_set(i, rtc_heap[child]);
+        i = child;
+    }
+
+    rtc_heap_set(i, vt);
+}
+
+/*
+ * void rtc_heap_remove(rtc_vtimer_t *vt)
+ * Inputs: vt - queued timer
+ * Output: None
+ * Function: Takes a timer off the heap, the last one fills its place
+ */
+static void rtc_heap_remove(rtc_vtimer_t *vt) {
+    int32_t i = vt->heap_idx;
+    vt->heap_idx = -1;
+
+    rtc_heap_size--;
+    if (i != rtc_heap_size) {
+        rtc_heap_set(i, rtc_heap[rtc_heap_size]);
+        rtc_heap_sift(i);
+    }
+}
 
 /* void rtc_init(void)
  * Inputs: void
  * Return Value: N/A
- * Function: initializes IRQ number for RTC (IRQ8)
- *  -initializes to highest possible frequency
+ * Function: initializes the fds' virtual timers. IRQ8 stays masked until a timer is armed,
+ *  see `rtc_update_rate`.
  */
 void rtc_init(void) {
     unsigned char prev;
 
+    int i, j;
+    for (i = 0; i < MAXPIDS; i++) {
+        for (j = 0; j < MAX_OPEN_FILES; j++) {
+            rtc_vtimer_reset(&rtc_vtimers[i][j]);
+        }
+    }
+    rtc_vtimer_reset(&rtc_kernel_vtimer);
+
+    // the periodic interrupt stays off (and IRQ8 masked) until a timer needs it
+    outb(RTC_REG_B, RTC_IO_PORT);
+    prev = inb(CMOS_IO_PORT);
+    outb(RTC_REG_B, RTC_IO_PORT);
+    outb(prev & ~RTC_PIE, CMOS_IO_PORT);
+}
+
+/*
+ * void rtc_set_periodic(int32_t on)
+ * Inputs: on - 1 to turn the periodic interrupt on, 0 to turn it off
+ * Output: None
+ * Function: Turns the RTC's periodic interrupt and IRQ8 on or off. Called with rtc_lock held.
+ */
+static void rtc_set_periodic(int32_t on) {
+    unsigned char prev;
+
     outb(RTC_REG_B, RTC_IO_PORT);
     prev = inb(CMOS_IO_PORT);
     outb(RTC_REG_B, RTC_IO_PORT);
-    outb(prev | 0x40, CMOS_IO_PORT);
+    outb(on ? prev | RTC_PIE : prev & ~RTC_PIE, CMOS_IO_PORT);
+
+    if (on) {
+        // an interrupt left unacknowledged while it was off would keep the next one from coming
+        outb(RTC_REG_C, RTC_IO_PORT);
+        inb(CMOS_IO_PORT);
+        enable_irq(RTC_IRQ);
+    } else {
+        disable_irq(RTC_IRQ);
+    }
+}
+
+/*
+ * void rtc_update_rate(void)
+ * Inputs: None
+ * Output: None
+ * Function: Programs the RTC for the highest frequency an armed timer needs, so it interrupts no
+ *  more than that. Without any the periodic interrupt is turned off, an idle system takes no RTC
+ *  interrupts at all. Called with rtc_lock held.
+ */
+static void rtc_update_rate(void) {
+    int32_t log2 = MAX_FREQ_LOG2;
+    while (log2 > 0 && rtc_users[log2] == 0) {
+        log2--;
+    }
+
+    // frequencies are at least MIN_FREQ, log2 0 means no timer is armed
+    uint32_t step = log2 > 0 ? MAX_FREQ >> log2 : 0;
+    if (step == rtc_step) {
+        return;
+    }
 
-    rtc_set_frequency(MAX_FREQ); // set to highest possible frequency
+    if (step != 0) {
+        rtc_set_frequency(1 << log2);
+    }
+    if ((step == 0) != (rtc_step == 0)) {
+        rtc_set_periodic(step != 0);
+    }
+    rtc_step = step;
+}
 
-    enable_irq(RTC_IRQ);
+/*
+ * uint32_t rtc_hw_frequency(void)
+ * Inputs: None
+ * Output: Rate the RTC interrupts at in Hz, 0 while its periodic interrupt is off
+ * Function: Reports the rate `rtc_update_rate` chose
+ */
+uint32_t rtc_hw_frequency(void) { return rtc_step == 0 ? 0 : MAX_FREQ / rtc_step; }
+
+/*
+ * uint8_t rtc_cmos_read(uint8_t reg)
+ * Inputs: reg - register to read, with the NMI disable bit
+ * Output: Value of the register
+ * Function: Reads an RTC register. Called with rtc_lock held.
+ */
+static uint8_t rtc_cmos_read(uint8_t reg) {
+    outb(reg, RTC_IO_PORT);
+    return inb(CMOS_IO_PORT);
+}
+
+/*
+ * void rtc_read_date(uint8_t *date)
+ * Inputs: date - where to store the RTC_DATE_REGS time and date registers, seconds first
+ * Output: None
+ * Function: Reads the time and date registers outside of an update. Called with rtc_lock held.
+ */
+static void rtc_read_date(uint8_t *date) {
+    static const uint8_t regs[RTC_DATE_REGS] = {RTC_SECONDS, RTC_MINUTES, RTC_HOURS,
+                                                RTC_DAY,     RTC_MONTH,   RTC_YEAR};
+    int i;
+
+    while (rtc_cmos_read(RTC_REG_A) & RTC_UIP) {
+    }
+    for (i = 0; i < RTC_DATE_REGS; i++) {
+        date[i] = rtc_cmos_read(regs[i]);
+    }
+}
+
+/*
+ * uint32_t rtc_read_epoch(void)
+ * Inputs: None
+ * Output: Wall-clock time in seconds since 1970-01-01 00:00 UTC
+ * Function: Reads the date from the RTC, taken to be in UTC and in the 2000s. The registers are
+ *  read until two reads agree, so an update between them can't tear the date.
+ */
+uint32_t rtc_read_epoch(void) {
+    uint8_t date[RTC_DATE_REGS], again[RTC_DATE_REGS];
+    uint8_t format;
+    int i;
+
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_lock, flags);
+    rtc_read_date(again);
+    do {
+        memcpy(date, again, RTC_DATE_REGS);
+        rtc_read_date(again);
+        for (i = 0; i < RTC_DATE_REGS && date[i] == again[i]; i++) {
+        }
+    } while (i < RTC_DATE_REGS);
+    format = rtc_cmos_read(RTC_REG_B);
+    spin_unlock_irqrestore(&rtc_lock, flags);
+
+    uint8_t pm = date[2] & RTC_PM;
+    date[2] &= ~RTC_PM;
+    if (!(format & RTC_BINARY)) {
+        for (i = 0; i < RTC_DATE_REGS; i++) {
+            date[i] = (date[i] >> 4) * 10 + (date[i] & 0xF);
+        }
+    }
+    if (!(format & RTC_24H)) {
+        // 12 AM is hour 0, 12 PM hour 12
+        date[2] = date[2] % 12 + (pm ? 12 : 0);
+    }
+
+    // days since the epoch of the civil date, with March as the first month so the leap day
+    // comes last in the year
+    uint32_t year = 2000 + date[5] - (date[4] <= 2);
+    uint32_t month = date[4] > 2 ? date[4] - 3 : date[4] + 9;
+    uint32_t era_year = year % 400;
+    uint32_t year_day = (153 * month + 2) / 5 + date[3] - 1;
+    uint32_t era_day = era_year * 365 + era_year / 4 - era_year / 100 + year_day;
+    uint32_t days = (year / 400) * 146097 + era_day - 719468;
+
+    return ((days * 24 + date[2]) * 60 + date[1]) * 60 + date[0];
+}
+
+/*
+ * void rtc_vtimer_use(rtc_vtimer_t *vt, int32_t delta)
+ * Inputs: vt - armed timer
+ *         delta - 1 when it is armed or gets its period, -1 when it loses them
+ * Output: None
+ * Function: Counts the timer at its frequency and reprograms the RTC if the highest one changed.
+ *  Called with rtc_lock held.
+ */
+static void rtc_vtimer_use(rtc_vtimer_t *vt, int32_t delta) {
+    rtc_users[rtc_get_log2(MAX_FREQ / vt->period)] += delta;
+    rtc_update_rate();
+}
+
+/*
+ * void rtc_tick(void)
+ * Inputs: None
+ * Output: None
+ * Function: Counts a hardware interrupt and wakes the reads whose virtual tick came. Only the
+ *  timers that are due are looked at, the rest stay in the heap.
+ */
+void rtc_tick(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_lock, flags);
+
+    rtc_ticks += rtc_step;
+    while (rtc_heap_size > 0 && !RTC_BEFORE(rtc_ticks, rtc_heap[0]->deadline)) {
+        rtc_vtimer_t *vt = rtc_heap[0];
+        rtc_heap_remove(vt);
+        vt->fired = 1;
+        scheduler_wake(vt->pcb);
+    }
+
+    spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
 /* void rtc_handler(void)
@@ -54,55 +356,134 @@ void rtc_handler_base(void) {
     outb(RTC_REG_C, RTC_IO_PORT);
     temp = inb(CMOS_IO_PORT);
 
-    // loop through each process using rtc to increment counter
-    int i;
-    for (i = 0; i < NUM_TERMINALS; i++) {
-        terminal_get_state(i)->rtc_interrupt_counter++;
-
-        if (terminal_get_state(i)->rtc_interrupt_counter >= rtc_ticks_per_interrupt) {
-            terminal_get_state(i)->rtc_interrupt_flag = 1;
-            terminal_get_state(i)->rtc_interrupt_counter = 0;
-        }
-    }
+    rtc_tick();
 
     send_eoi(RTC_IRQ);
     sti();
 }
 
+/*
+ * void rtc_vtimer_arm(rtc_vtimer_t *vt, pcb_t *pcb)
+ * Inputs: vt - timer of the fd being read, not queued
+ *         pcb - process to wake at its next tick, NULL for none
+ * Output: None
+ * Function: Queues the timer for its next tick. Ticks keep their phase from the last write (or
+ *  first read), the ones that passed without a reader are skipped.
+ */
+void rtc_vtimer_arm(rtc_vtimer_t *vt, pcb_t *pcb) {
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_lock, flags);
+
+    if (!vt->armed) {
+        vt->deadline = rtc_ticks + vt->period;
+        vt->armed = 1;
+        rtc_vtimer_use(vt, 1);
+    } else if (!RTC_BEFORE(rtc_ticks, vt->deadline)) {
+        vt->deadline += ((rtc_ticks - vt->deadline) / vt->period + 1) * vt->period;
+    }
+
+    vt->fired = 0;
+    vt->pcb = pcb;
+    rtc_heap_set(rtc_heap_size++, vt);
+    rtc_heap_sift(vt->heap_idx);
+
+    spin_unlock_irqrestore(&rtc_lock, flags);
+}
+
+/*
+ * void rtc_vtimer_release(rtc_vtimer_t *vt)
+ * Inputs: vt - timer of an fd being closed
+ * Output: None
+ * Function: Takes a timer off the heap if it is queued and puts it back to 2 Hz, unarmed. The RTC
+ *  slows down or stops if it was the fastest one left.
+ */
+void rtc_vtimer_release(rtc_vtimer_t *vt) {
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_lock, flags);
+    if (vt->heap_idx >= 0) {
+        rtc_heap_remove(vt);
+    }
+    if (vt->armed) {
+        rtc_vtimer_use(vt, -1);
+    }
+    rtc_vtimer_reset(vt);
+    spin_unlock_irqrestore(&rtc_lock, flags);
+}
+
+/*
+ * rtc_vtimer_t *rtc_fd_vtimer(int32_t fd)
+ * Inputs: fd - RTC file descriptor of the current process
+ * Output: Its virtual timer, the kernel's one without a process, NULL for a bad fd
+ * Function: Finds the timer of an fd
+ */
+static rtc_vtimer_t *rtc_fd_vtimer(int32_t fd) {
+    pcb_t *pcb = get_scheduler_pcb();
+    if (pcb == NULL) {
+        return &rtc_kernel_vtimer;
+    }
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return NULL;
+    }
+    return &rtc_vtimers[pcb->pid][fd];
+}
+
 /*
  * int32_t rtc_open()
  * Inputs: None
  * Output: Returns 0
- * Function: Initializes RTC frequency to 2 Hz
+ * Function: Nothing to do, the fd's timer is at 2 Hz since it was last closed
  */
-int32_t rtc_open(const uint8_t *filename) {
-    rtc_ticks_per_interrupt = INIT_FREQ;
-    return 0;
-}
+int32_t rtc_open(const uint8_t *filename) { return 0; }
 
 /*
  * int32_t rtc_close()
- * Inputs: None
+ * Inputs: fd - RTC file descriptor
  * Output: Returns 0
- * Function: Closes the RTC
+ * Function: Closes the RTC, putting the fd's timer back to 2 Hz for the next open
  */
-int32_t rtc_close(int32_t fd) { return 0; }
+int32_t rtc_close(int32_t fd) {
+    rtc_vtimer_t *vt = rtc_fd_vtimer(fd);
+    if (vt == NULL) {
+        return -1;
+    }
+
+    rtc_vtimer_release(vt);
+    return 0;
+}
 
 /*
  * int32_t rtc_read()
- * Inputs: None
- * Output: Returns 0
- * Function: Waits for an interrupt to be raised
+ * Inputs: fd - RTC file descriptor
+ * Output: Returns 0, -1 for a bad fd
+ * Function: Waits for the next tick of the fd's virtual timer
  */
 int32_t rtc_read(int32_t fd, void *buf, int32_t nbytes) {
-    uint8_t idx = scheduler_terminal_idx;
-    terminal_get_state(idx)->rtc_interrupt_flag = 0;
-    while (!terminal_get_state(idx)->rtc_interrupt_flag) {
+    rtc_vtimer_t *vt = rtc_fd_vtimer(fd);
+    if (vt == NULL) {
+        return -1;
     }
 
+    // Sleep until the handler fires the timer instead of spinning on it
+    unsigned long flags;
+    irq_save(flags);
+    rtc_vtimer_arm(vt, get_scheduler_pcb());
+    while (!vt->fired) {
+        scheduler_block();
+    }
+    irq_restore(flags);
+
     return 0;
 }
 
+/*
+ * int32_t rtc_write()
+ * Inputs: fd - RTC file descriptor
+ *         buf - the new frequency, a power of 2 from 2 to 1024 Hz
+ *         nbytes - 4
+ * Output: Returns 0, -1 for a bad fd or frequency
+ * Function: Sets the frequency of the fd's virtual timer, other fds keep theirs. The next tick
+ *  is a period from now.
+ */
 int32_t rtc_write(int32_t fd, const void *buf, int32_t nbytes) {
     if (buf == NULL) { // check for valid input buffer
         return -1;
@@ -118,7 +499,21 @@ int32_t rtc_write(int32_t fd, const void *buf, int32_t nbytes) {
         return -1;
     }
 
-    rtc_ticks_per_interrupt = MAX_FREQ / freq; // change the virtualized rate
+    rtc_vtimer_t *vt = rtc_fd_vtimer(fd);
+    if (vt == NULL) {
+        return -1;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_lock, flags);
+    if (vt->armed) {
+        rtc_vtimer_use(vt, -1);
+    }
+    vt->period = MAX_FREQ / freq; // change the virtualized rate
+    vt->deadline = rtc_ticks + vt->period;
+    vt->armed = 1;
+    rtc_vtimer_use(vt, 1);
+    spin_unlock_irqrestore(&rtc_lock, flags);
     return 0;
 }
 
@@ -174,5 +569,6 @@ func_pt_t make_rtc_fops(void) {
     f.close = rtc_close;
     f.read = rtc_read;
     f.write = rtc_write;
+    f.ioctl = NULL;
     return f;
 }
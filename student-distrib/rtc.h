@@ -2,14 +2,45 @@
 #define _RTC_H_
 
 #include "file_system.h"
+#include "syscall.h"
 #include "types.h"
 
 #define RTC_HANDLER_VEC 0x28
 
+/* Virtual timer of an open RTC file descriptor. It ticks at the frequency written to the fd,
+ * counted in 1/1024 s whatever rate the RTC runs at. */
+typedef struct rtc_vtimer {
+    /* 1/1024 s per virtual tick. */
+    uint32_t period;
+    /* `rtc_ticks` value of the next virtual tick, once `armed`. */
+    uint32_t deadline;
+    int32_t armed;
+    /* Position in the deadline heap while a read waits on it, -1 otherwise. */
+    int32_t heap_idx;
+    /* Set when the tick a read waits for comes, and the process waiting. */
+    volatile int32_t fired;
+    pcb_t *pcb;
+} rtc_vtimer_t;
+
 extern void rtc_init(void);
 extern void rtc_handler(void);
 extern void rtc_handler_base(void);
 
+/* Counts a hardware interrupt and wakes the reads whose virtual tick came. */
+extern void rtc_tick(void);
+
+/* Queues a virtual timer for its next tick. */
+extern void rtc_vtimer_arm(rtc_vtimer_t *vt, pcb_t *pcb);
+
+/* Dequeues a timer and disarms it, the RTC runs only as fast as the armed timers need. */
+extern void rtc_vtimer_release(rtc_vtimer_t *vt);
+
+/* Current RTC interrupt rate in Hz, 0 while it is off. */
+extern uint32_t rtc_hw_frequency(void);
+
+/* Wall-clock time from the RTC's date registers, in seconds since the Unix epoch. */
+extern uint32_t rtc_read_epoch(void);
+
 extern int32_t rtc_set_frequency(int32_t freq);
 extern int32_t rtc_get_log2(int32_t freq);
 
@@ -1,11 +1,595 @@
 #include "scheduling.h"
 
+#include "clock.h"
+#include "irqtrace.h"
 #include "lib.h"
 #include "paging.h"
+#include "pit.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "syscall.h"
 #include "terminal.h"
+#include "timer.h"
 
-uint8_t scheduler_terminal_idx = 0;
+/* Scheduler state of one CPU */
+typedef struct sched_cpu {
+    /* Terminals in this CPU's run queue, one bit per terminal. A terminal only runs on the CPU
+     * whose queue it is in; a CPU with nothing to run steals one waiting in another queue. */
+    uint32_t runqueue;
+
+    /* Context of whatever ran before the CPU's first process (the boot stack in `entry` or
+     * `ap_main`). It is saved once and never resumed. */
+    context_t boot_context;
+
+    /* Context used to start the base shell of an empty terminal, on the CPU's launch stack. Only
+     * one shell is started at a time per CPU (interrupts are off until `execute` irets to user
+     * space), so one stack is enough. */
+    context_t launch_context;
+
+    /* Context of the idle task, which halts until an interrupt makes something runnable. */
+    context_t idle_context;
+
+    /* Whether the idle task is the context currently running, and when it was switched to. */
+    int32_t idle_running;
+    uint64_t idle_start_tsc;
+
+    /* TSC value taken right before the last `switch_to`, read back by the task switched in. */
+    uint64_t switch_start_tsc;
+
+    /* TSC value when the CPU last switched to a process (or to start a shell). */
+    uint64_t run_start_tsc;
+
+    /* `pit_cpu_ticks` value at the last `scheduler_tick`, to charge real-time processes for their
+     * CPU use. */
+    uint32_t last_tick;
+} sched_cpu_t;
+
+sched_stats_t sched_stats;
+
+/* Histograms reported by `sched_gettrace`, protected by sched_lock. */
+static sched_trace_t sched_trace;
+
+/* Protects the run queues, the process states and the rest of the scheduler state. `scheduler`
+ * holds it across the context switch and the context switched to releases it, so no other CPU
+ * can pick a process whose context is still being saved. */
+static spinlock_t sched_lock = SPINLOCK_INIT;
+
+static sched_cpu_t sched_cpus[MAX_CPUS];
+static uint8_t launch_stacks[MAX_CPUS][EIGHTKB_BITS] __attribute__((aligned(16)));
+static uint8_t idle_stacks[MAX_CPUS][EIGHTKB_BITS] __attribute__((aligned(16)));
+
+/* Terminals whose shell may be started, one bit per terminal. Terminal 0 starts at boot, the
+ * others the first time they are switched to, see `scheduler_start_terminal`. */
+static uint32_t started_terminals = 0;
+
+/* CPU share reserved by admitted real-time processes, out of RT_UTIL_SCALE. */
+static uint32_t rt_utilization = 0;
+
+/*
+ * scheduler_load_terminal(uint32_t cpu, uint8_t idx)
+ *   DESCRIPTION: Points the screen coordinates and the user's video memory mapping at the given
+ *                terminal so the process about to run writes to the right place
+ *
+ *   INPUTS: cpu - CPU the terminal is about to run on, the current one
+ *           idx - terminal being switched to
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Remaps the user video memory page, the caller flushes the TLB
+ */
+static void scheduler_load_terminal(uint32_t cpu, uint8_t idx) {
+    terminal_state_t *current_terminal_state = terminal_get_state(idx);
+
+    // under the terminal lock, the keyboard handler swaps the screen pointers while holding it
+    spin_lock(&terminal_lock);
+    cpus[cpu].terminal_idx = idx;
+    set_screen_xy(&current_terminal_state->cursor_x, &current_terminal_state->cursor_y);
+    set_screen_origin(&current_terminal_state->origin);
+    set_screen_history(&current_terminal_state->history);
+    set_screen_ansi(&current_terminal_state->ansi);
+    set_screen_pinned(&current_terminal_state->pinned);
+    paging_map_video(cpu, terminal_video_page(idx));
+    spin_unlock(&terminal_lock);
+}
+
+/*
+ * scheduler_launch()
+ *   DESCRIPTION: Entry point of a launch context, starts the base shell of the CPU's terminal
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: never returns
+ *   SIDE EFFECTS: Abandons the launch stack once the shell is in user space, or once the
+ *                 scheduler switches away after the shell couldn't be started
+ */
+static void scheduler_launch(void) {
+    // switched to from `scheduler`, which still holds the lock
+    spin_unlock(&sched_lock);
+
+    execute((uint8_t *)"shell");
+
+    // Only reached if the shell couldn't be started, `execute` printed why. The terminal stops
+    // being runnable so it isn't retried (and the error printed) every quantum, switching to it
+    // again starts it over.
+    cli();
+    spin_lock(&sched_lock);
+    uint8_t idx = this_cpu()->terminal_idx;
+    started_terminals &= ~(1 << idx);
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        sched_cpus[i].runqueue &= ~(1 << idx);
+    }
+    this_cpu()->terminal_idx = -1;
+    spin_unlock(&sched_lock);
+
+    while (1) {
+        scheduler();
+    }
+}
+
+/*
+ * scheduler_terminal_pcb(uint8_t idx)
+ *   DESCRIPTION: Gets the process running on a terminal
+ *
+ *   INPUTS: idx - terminal to look at
+ *   OUTPUTS: none
+ *   RETURN VALUE: its process, NULL if it has none yet or the terminal wasn't created yet
+ *   SIDE EFFECTS: none
+ */
+static pcb_t *scheduler_terminal_pcb(uint8_t idx) {
+    terminal_state_t *state = terminal_get_state(idx);
+    return state == NULL ? NULL : state->curr_pcb;
+}
+
+/*
+ * scheduler_is_runnable(uint8_t idx)
+ *   DESCRIPTION: Checks if the scheduler has something to run on a terminal
+ *
+ *   INPUTS: idx - terminal to check
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the terminal's process is runnable (and not throttled) or it was started
+ *                 and still needs a shell, 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+static int32_t scheduler_is_runnable(uint8_t idx) {
+    if (!(started_terminals & (1 << idx))) {
+        return 0;
+    }
+
+    pcb_t *pcb = scheduler_terminal_pcb(idx);
+    return pcb == NULL || (pcb->state == TASK_RUNNABLE && !pcb->rt.throttled);
+}
+
+/*
+ * scheduler_is_running(uint8_t idx)
+ *   DESCRIPTION: Checks if a terminal's process is on a CPU right now
+ *
+ *   INPUTS: idx - terminal to check
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if some CPU is running it (or starting its shell), 0 otherwise
+ *   SIDE EFFECTS: Called with sched_lock held
+ */
+static int32_t scheduler_is_running(uint8_t idx) {
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].online && cpus[i].terminal_idx == idx && !sched_cpus[i].idle_running) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * scheduler_pick(uint32_t cpu, uint8_t start)
+ *   DESCRIPTION: Chooses the terminal to run next on a CPU. Real-time processes in its run queue
+ *                go first, earliest deadline first, then the others round robin starting at
+ *                `start`. With nothing runnable in its own queue, the CPU steals a terminal that
+ *                is waiting in another CPU's queue.
+ *
+ *   INPUTS: cpu - CPU to pick for, the current one
+ *           start - first terminal to look at for a best-effort process
+ *   OUTPUTS: none
+ *   RETURN VALUE: index of the terminal to run, -1 if nothing is runnable
+ *   SIDE EFFECTS: Moves a stolen terminal to `cpu`'s run queue. Called with sched_lock held.
+ */
+static int32_t scheduler_pick(uint32_t cpu, uint8_t start) {
+    uint32_t queue = sched_cpus[cpu].runqueue;
+    int i;
+    int32_t next_idx = -1;
+    pcb_t *best = NULL;
+
+    for (i = 0; i < terminal_count; i++) {
+        pcb_t *pcb = scheduler_terminal_pcb(i);
+        if (!(queue & (1 << i)) || pcb == NULL || pcb->rt.period == 0 ||
+            !scheduler_is_runnable(i)) {
+            continue;
+        }
+
+        // compare through the difference so deadlines past a pit_ticks wrap still order right
+        if (best == NULL || (int32_t)(pcb->rt.deadline - best->rt.deadline) < 0) {
+            best = pcb;
+            next_idx = i;
+        }
+    }
+
+    if (next_idx != -1) {
+        return next_idx;
+    }
+
+    for (i = 0; i < terminal_count; i++) {
+        uint8_t idx = (start + i) % terminal_count;
+        if ((queue & (1 << idx)) && scheduler_is_runnable(idx)) {
+            return idx;
+        }
+    }
+
+    // a terminal another CPU is running stays where it is, one that is only waiting moves here
+    for (i = 0; i < terminal_count; i++) {
+        uint8_t idx = (start + i) % terminal_count;
+        if (!(queue & (1 << idx)) && scheduler_is_runnable(idx) && !scheduler_is_running(idx)) {
+            int c;
+            for (c = 0; c < MAX_CPUS; c++) {
+                sched_cpus[c].runqueue &= ~(1 << idx);
+            }
+            sched_cpus[cpu].runqueue |= 1 << idx;
+            sched_stats.steals++;
+            return idx;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * scheduler_kick_idle()
+ *   DESCRIPTION: Sends the reschedule IPI to the other CPUs halted in their idle task, so one
+ *                with a newly runnable terminal in its queue (or able to steal it) runs it. Their
+ *                scheduling clock may be stopped, nothing else would get them to look.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with sched_lock held
+ */
+static void scheduler_kick_idle(void) {
+    uint32_t self = smp_cpu_id();
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (i != self && cpus[i].online && sched_cpus[i].idle_running) {
+            smp_send_ipi(i, SMP_RESCHED_VEC);
+        }
+    }
+}
+
+/*
+ * scheduler_rt_period(uint32_t data)
+ *   DESCRIPTION: Timer callback at the end of a real-time process's period. Counts a missed
+ *                deadline if the job was still running, then starts the next period with a full
+ *                budget.
+ *
+ *   INPUTS: data - the process's pcb
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Re-arms the period timer. The PIT handler reschedules its own CPU right after,
+ *                 idle CPUs are woken in case the refill made a throttled process runnable.
+ */
+static void scheduler_rt_period(uint32_t data) {
+    pcb_t *pcb = (pcb_t *)data;
+
+    unsigned long flags;
+    spin_lock_irqsave(&sched_lock, flags);
+
+    // the process may have gone back to best-effort on another CPU while the timer ran
+    if (pcb->rt.period != 0) {
+        // A process that blocked during the period finished its job, and one that is blocked now
+        // is waiting for its next one. A parent waiting in `execute` for its child isn't running
+        // a job.
+        if (!pcb->rt.job_done && pcb->state == TASK_RUNNABLE &&
+            terminal_get_state(pcb->rt.terminal)->curr_pcb == pcb) {
+            pcb->rt.missed++;
+        }
+
+        pcb->rt.periods++;
+        pcb->rt.used = 0;
+        pcb->rt.throttled = 0;
+        pcb->rt.job_done = 0;
+        pcb->rt.deadline = pit_ticks + pcb->rt.period;
+        timer_add(&pcb->rt.timer, pcb->rt.period);
+        scheduler_kick_idle();
+    }
+
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/*
+ * scheduler_idle()
+ *   DESCRIPTION: Entry point of a CPU's idle task. Halts until an interrupt arrives and switches
+ *                back to the scheduler as soon as one of them made a process runnable.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: never returns
+ *   SIDE EFFECTS: none
+ */
+static void scheduler_idle(void) {
+    // switched to from `scheduler`, which still holds the lock
+    spin_unlock(&sched_lock);
+
+    while (1) {
+        // sti only takes effect after the next instruction, so no interrupt is lost before hlt
+        asm volatile("sti; hlt; cli" : : : "memory");
+
+        int i;
+        for (i = 0; i < terminal_count; i++) {
+            if (scheduler_is_runnable(i)) {
+                scheduler();
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * sched_hist_add(sched_hist_t *hist, uint32_t cycles)
+ *   DESCRIPTION: Records a value in a log2 histogram
+ *
+ *   INPUTS: hist - histogram to add to
+ *           cycles - value to record
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with sched_lock held
+ */
+static void sched_hist_add(sched_hist_t *hist, uint32_t cycles) {
+    // bucket of the highest set bit
+    uint32_t bucket = 0;
+    if (cycles != 0) {
+        asm("bsrl %1, %0" : "=r"(bucket) : "rm"(cycles));
+    }
+
+    hist->count++;
+    hist->total_cycles += cycles;
+    if (cycles > hist->max_cycles) {
+        hist->max_cycles = cycles;
+    }
+    hist->buckets[bucket]++;
+}
+
+/*
+ * scheduler_trace_leave(sched_cpu_t *sched, pcb_t *prev, uint64_t entry_tsc)
+ *   DESCRIPTION: Records how long this scheduling decision took and, if the current process is
+ *                being switched out, how long it ran
+ *
+ *   INPUTS: sched - this CPU's scheduler state
+ *           prev - process being switched out, NULL if none is
+ *           entry_tsc - TSC value when `scheduler_switch` was entered
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with sched_lock held
+ */
+static void scheduler_trace_leave(sched_cpu_t *sched, pcb_t *prev, uint64_t entry_tsc) {
+    uint64_t now = rdtsc();
+    sched_hist_add(&sched_trace.pick_cycles, (uint32_t)(now - entry_tsc));
+
+    if (prev != NULL) {
+        uint32_t run = (uint32_t)(now - sched->run_start_tsc);
+        sched_hist_add(&sched_trace.run_time, run);
+        sched_hist_add(&prev->trace.run_time, run);
+        if (prev->state == TASK_BLOCKED) {
+            sched_trace.voluntary_switches++;
+            prev->trace.voluntary_switches++;
+        }
+    }
+}
+
+/*
+ * context_switch(context_t *prev, context_t *next)
+ *   DESCRIPTION: Switches to `next` and records how long the switch took
+ *
+ *   INPUTS: prev - where to save the current context
+ *           next - context to resume
+ *   OUTPUTS: none
+ *   RETURN VALUE: void, returns when something switches back to `prev`
+ *   SIDE EFFECTS: Updates sched_stats
+ */
+static void context_switch(context_t *prev, context_t *next) {
+    sched_cpus[smp_cpu_id()].switch_start_tsc = rdtsc();
+    switch_to(prev, next);
+
+    // Running in the task that was just switched in, maybe on another CPU than it last ran on
+    uint32_t cycles = (uint32_t)(rdtsc() - sched_cpus[smp_cpu_id()].switch_start_tsc);
+    sched_stats.switches++;
+    sched_stats.last_switch_cycles = cycles;
+    sched_stats.total_switch_cycles += cycles;
+    sched_hist_add(&sched_trace.switch_cycles, cycles);
+}
+
+/*
+ * scheduler_switch()
+ *   DESCRIPTION: Picks what this CPU runs next and switches to it: the base shell of an empty
+ *                terminal, a process, or the idle task if nothing can run
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void, returns when the current context is switched back to
+ *   SIDE EFFECTS: Called with interrupts disabled and sched_lock held, which is held again on
+ *                 return (possibly taken by another CPU that switched back to us)
+ */
+static void scheduler_switch(void) {
+    uint64_t entry_tsc = rdtsc();
+    uint32_t cpu_id = smp_cpu_id();
+    cpu_t *cpu = &cpus[cpu_id];
+    sched_cpu_t *sched = &sched_cpus[cpu_id];
+
+    pcb_t *prev = get_scheduler_pcb();
+    context_t *prev_context;
+    if (sched->idle_running) {
+        prev_context = &sched->idle_context;
+    } else if (prev == NULL) {
+        prev_context = &sched->boot_context;
+    } else {
+        prev_context = &prev->context;
+    }
+
+    // process whose run ends if the CPU switches away
+    pcb_t *running = sched->idle_running ? NULL : prev;
+
+    // look at next best-effort process in "queue" (the current one last), at boot the current
+    // (empty) terminal gets its shell first
+    uint8_t start;
+    if (cpu->terminal_idx < 0) {
+        start = cpu_id % terminal_count;
+    } else if (sched->idle_running || prev != NULL) {
+        start = (cpu->terminal_idx + 1) % terminal_count;
+    } else {
+        start = cpu->terminal_idx;
+    }
+
+    int32_t next_idx = scheduler_pick(cpu_id, start);
+
+    // nothing to run, halt in the idle task until an interrupt wakes someone up
+    if (next_idx == -1) {
+        if (!sched->idle_running) {
+            scheduler_trace_leave(sched, running, entry_tsc);
+            sched->idle_running = 1;
+            sched_stats.idle_entries++;
+            pit_cpu_update_tick();
+            sched->idle_start_tsc = rdtsc();
+            context_switch(prev_context, &sched->idle_context);
+        } else {
+            scheduler_trace_leave(sched, NULL, entry_tsc);
+        }
+        return;
+    }
+
+    pcb_t *next = terminal_get_state(next_idx)->curr_pcb;
+    if (!sched->idle_running && next != NULL && next == prev) {
+        scheduler_trace_leave(sched, NULL, entry_tsc);
+        pit_cpu_update_tick();
+        return;
+    }
+
+    scheduler_trace_leave(sched, running, entry_tsc);
+    sched->run_start_tsc = rdtsc();
+
+    if (sched->idle_running) {
+        sched_stats.idle_cycles += rdtsc() - sched->idle_start_tsc;
+        sched->idle_running = 0;
+    }
+
+    // switch the vid memory being written
+    scheduler_load_terminal(cpu_id, next_idx);
+    pit_cpu_update_tick();
+
+    // base case of empty terminal, start its shell on the launch stack
+    if (next == NULL) {
+        flush_tlb();
+
+        sched->launch_context.esp = (uint32_t)(launch_stacks[cpu_id] + EIGHTKB_BITS);
+        sched->launch_context.eip = (uint32_t)scheduler_launch;
+        switch_to(prev_context, &sched->launch_context);
+        return;
+    }
+
+    // update page table
+    paging_map_user(KERNEL_END + (next->pid * FOURMB_BITS));
+
+    // save esp0 in the TSS
+    cpu->tss->ss0 = KERNEL_DS;
+    cpu->tss->esp0 = KERNEL_END - (next->pid * EIGHTKB_BITS);
+
+    if (next->wake_tsc != 0) {
+        uint32_t latency = (uint32_t)(rdtsc() - next->wake_tsc);
+        sched_hist_add(&sched_trace.wakeup_latency, latency);
+        sched_hist_add(&next->trace.wakeup_latency, latency);
+        next->wake_tsc = 0;
+    }
+
+    context_switch(prev_context, &next->context);
+}
+
+/*
+ * scheduler_init()
+ *   DESCRIPTION: Prepares each CPU's idle task so the scheduler can fall back to it, and puts
+ *                terminal 0 in the bootstrap processor's run queue. The other terminals join a
+ *                queue when they are first switched to, and idle CPUs steal them from there.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void scheduler_init(void) {
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        sched_cpus[i].idle_context.esp = (uint32_t)(idle_stacks[i] + EIGHTKB_BITS);
+        sched_cpus[i].idle_context.eip = (uint32_t)scheduler_idle;
+        sched_cpus[i].idle_running = 0;
+        sched_cpus[i].runqueue = 0;
+        sched_cpus[i].last_tick = 0;
+    }
+
+    started_terminals = 1;
+    sched_cpus[0].runqueue = 1;
+}
+
+/*
+ * scheduler_start_terminal(uint8_t idx)
+ *   DESCRIPTION: Lets a created terminal get its shell the first time it is switched to, so the
+ *                terminals nobody looks at don't take a PID and the memory of a shell. It joins
+ *                this CPU's run queue and the idle CPUs are woken up to steal it.
+ *
+ *   INPUTS: idx - terminal being shown
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Safe to call from interrupt handlers
+ */
+void scheduler_start_terminal(uint8_t idx) {
+    unsigned long flags;
+    spin_lock_irqsave(&sched_lock, flags);
+
+    if (started_terminals & (1 << idx)) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return;
+    }
+    started_terminals |= 1 << idx;
+
+    sched_cpus[smp_cpu_id()].runqueue |= 1 << idx;
+    scheduler_kick_idle();
+
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    // a second runnable terminal in the queue needs quanta
+    pit_rearm();
+}
+
+/*
+ * scheduler_terminal_started(uint8_t idx)
+ *   DESCRIPTION: Checks if a terminal was let start its shell, see `scheduler_start_terminal`
+ *
+ *   INPUTS: idx - terminal to check
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if it was started (and its shell didn't fail to launch), 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+int32_t scheduler_terminal_started(uint8_t idx) { return (started_terminals >> idx) & 1; }
+
+/*
+ * scheduler_terminal_queued(uint8_t idx)
+ *   DESCRIPTION: Checks if a terminal is in a CPU's run queue
+ *
+ *   INPUTS: idx - terminal to check
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if some CPU's run queue holds it, 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+int32_t scheduler_terminal_queued(uint8_t idx) {
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (sched_cpus[i].runqueue & (1 << idx)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
 /*
  * scheduler()
@@ -14,72 +598,354 @@ uint8_t scheduler_terminal_idx = 0;
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: void
- *   SIDE EFFECTS: Base case has it execute shell if terminal is empty otherwise context switches in a round robin way.
+ *   SIDE EFFECTS: Base case has it execute shell if terminal is empty otherwise context switches
+ *                 to the real-time process with the earliest deadline, or in a round robin way
+ *                 to the next runnable process, or to the idle task if nothing can run. Must be
+ *                 called with interrupts disabled.
  */
 void scheduler() {
-    // if base case of empty terminal then call execute to initalize temrinal
-    if (get_scheduler_pcb() == NULL) {
-        // get the context of the terminal ready
-        terminal_state_t *current_terminal_state = terminal_get_state(scheduler_terminal_idx);
-        keyboard_set_buffer(&current_terminal_state->kb_buffer);
-        set_screen_xy(&current_terminal_state->cursor_x, &current_terminal_state->cursor_y);
-
-        if (scheduler_terminal_idx == screen_terminal_idx) {
-            page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-            set_cursor(current_terminal_state->cursor_x, current_terminal_state->cursor_y);
+    spin_lock(&sched_lock);
+    scheduler_switch();
+    spin_unlock(&sched_lock);
+}
+
+/*
+ * scheduler_yield()
+ *   DESCRIPTION: Lets another task run from any kernel path, e.g. while waiting for an event
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Returns with the caller's interrupt flag restored
+ */
+void scheduler_yield(void) {
+    unsigned long flags;
+    irq_save(flags);
+    scheduler();
+    irq_restore(flags);
+}
+
+/*
+ * scheduler_preempt_disable()
+ *   DESCRIPTION: Keeps the timer and reschedule interrupts from switching this CPU away, for
+ *                code that holds something only it can release (e.g. the keyboard bottom half).
+ *                Nests.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void scheduler_preempt_disable(void) { this_cpu()->preempt_count++; }
+
+/*
+ * scheduler_preempt_enable()
+ *   DESCRIPTION: Undoes one `scheduler_preempt_disable`. The outermost one yields if an interrupt
+ *                or `scheduler_resched` wanted a switch meanwhile.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: May context switch
+ */
+void scheduler_preempt_enable(void) {
+    cpu_t *cpu = this_cpu();
+    if (--cpu->preempt_count == 0 && cpu->resched_pending) {
+        cpu->resched_pending = 0;
+        scheduler_yield();
+    }
+}
+
+/*
+ * scheduler_preemptible()
+ *   DESCRIPTION: Checked by interrupt handlers before they call `scheduler`
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if this CPU may be switched away, 0 if the switch has to wait for
+ *                 `scheduler_preempt_enable`
+ *   SIDE EFFECTS: Records the put off switch
+ */
+int32_t scheduler_preemptible(void) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->preempt_count != 0) {
+        cpu->resched_pending = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * scheduler_resched()
+ *   DESCRIPTION: Lets another task run as soon as this CPU may switch, from paths that can't
+ *                switch themselves
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: May context switch
+ */
+void scheduler_resched(void) {
+    if (scheduler_preemptible()) {
+        scheduler_yield();
+    }
+}
+
+/*
+ * scheduler_block()
+ *   DESCRIPTION: Stops running the current process until `scheduler_wake` is called on it.
+ *                Callers should check their wait condition with interrupts disabled and call
+ *                this in a loop. A wakeup from another CPU between the check and the block is
+ *                remembered and makes this return right away.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Without a process (e.g. kernel tests) it just waits for the next interrupt
+ */
+void scheduler_block(void) {
+    unsigned long flags;
+    irq_save(flags);
+
+    pcb_t *pcb = get_scheduler_pcb();
+    if (pcb == NULL) {
+        asm volatile("sti; hlt" : : : "memory");
+    } else {
+        spin_lock(&sched_lock);
+        if (pcb->wake_pending) {
+            pcb->wake_pending = 0;
         } else {
-            page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX + (scheduler_terminal_idx + 1);
+            pcb->state = TASK_BLOCKED;
+            pcb->rt.job_done = 1;
+            scheduler_switch();
         }
+        spin_unlock(&sched_lock);
+    }
 
-        flush_tlb();
+    irq_restore(flags);
+}
 
-        execute((uint8_t *)"shell");
+/*
+ * scheduler_cpu_needs_tick(uint32_t cpu)
+ *   DESCRIPTION: Decides if a CPU needs its scheduling clock: to end a quantum when it has more
+ *                than one runnable terminal in its queue, or to charge a running real-time
+ *                process's budget
+ *
+ *   INPUTS: cpu - CPU to look at
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if a tick is needed, 0 otherwise
+ *   SIDE EFFECTS: Reads the scheduler state without the lock, every change to it that could need
+ *                 a tick is followed by a `pit_rearm`
+ */
+int32_t scheduler_cpu_needs_tick(uint32_t cpu) {
+    if (!cpus[cpu].online) {
+        return 0;
     }
 
-    // save terminal context before switching
-    register uint32_t ebp asm("ebp");
-    get_scheduler_pcb()->ebp_scheduler = ebp;
+    int32_t idx = cpus[cpu].terminal_idx;
+    if (!sched_cpus[cpu].idle_running && idx >= 0) {
+        pcb_t *pcb = scheduler_terminal_pcb(idx);
+        if (pcb != NULL && pcb->rt.period != 0) {
+            return 1;
+        }
+    }
 
-    // look at next process in "queue"
-    scheduler_terminal_idx = (scheduler_terminal_idx + 1) % NUM_TERMINALS;
+    int32_t count = 0;
+    int i;
+    for (i = 0; i < terminal_count; i++) {
+        if ((sched_cpus[cpu].runqueue & (1 << i)) && scheduler_is_runnable(i)) {
+            count++;
+        }
+    }
+    return count > 1;
+}
 
-    if (get_scheduler_pcb() == NULL) {
+/*
+ * scheduler_needs_tick()
+ *   DESCRIPTION: Decides if the PIT must interrupt on the next tick, when it is the scheduling
+ *                clock of every CPU
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if any CPU needs a tick, 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+int32_t scheduler_needs_tick(void) {
+    int c;
+    for (c = 0; c < MAX_CPUS; c++) {
+        if (scheduler_cpu_needs_tick(c)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * scheduler_tick()
+ *   DESCRIPTION: Charges the ticks elapsed since this CPU's last tick to its running process if
+ *                it is real-time, and throttles it once its budget for the period is used up
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Called with interrupts disabled, by this CPU's scheduling clock handler (local
+ *                 APIC timer, or PIT before the expired timers run) and the reschedule IPI handler
+ */
+void scheduler_tick(void) {
+    spin_lock(&sched_lock);
+
+    sched_cpu_t *sched = &sched_cpus[smp_cpu_id()];
+    uint32_t now = pit_cpu_ticks();
+    uint32_t elapsed = now - sched->last_tick;
+    sched->last_tick = now;
+
+    pcb_t *pcb = get_scheduler_pcb();
+    if (!sched->idle_running && pcb != NULL && pcb->rt.period != 0) {
+        pcb->rt.used += elapsed;
+        if (pcb->rt.used >= pcb->rt.budget && !pcb->rt.throttled) {
+            pcb->rt.throttled = 1;
+            pcb->rt.throttles++;
+        }
+    }
+
+    spin_unlock(&sched_lock);
+}
+
+/*
+ * scheduler_rt_util(uint32_t period, uint32_t budget)
+ *   DESCRIPTION: Computes the share of the CPU a reservation takes, rounded up
+ *
+ *   INPUTS: period - period in ticks, not 0
+ *           budget - CPU ticks per period, at most `period`
+ *   OUTPUTS: none
+ *   RETURN VALUE: budget / period in RT_UTIL_SCALE units
+ *   SIDE EFFECTS: none
+ */
+static uint32_t scheduler_rt_util(uint32_t period, uint32_t budget) {
+    // budget * RT_UTIL_SCALE overflows 32 bits from a few million ticks on
+    return div64_32((uint64_t)budget * RT_UTIL_SCALE + period - 1, period, NULL);
+}
+
+/*
+ * scheduler_set_rt(pcb_t *pcb, uint32_t period, uint32_t budget)
+ *   DESCRIPTION: Moves a process to the real-time class, or back to best-effort with a period of
+ *                0. Admission control refuses a reservation that would take the total real-time
+ *                utilization over RT_MAX_UTILIZATION.
+ *
+ *   INPUTS: pcb - process to change
+ *           period - period in ticks, 0 for best-effort, at most TIMER_MAX_TICKS
+ *           budget - CPU ticks per period, between 1 and `period`
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, -1 for invalid parameters or if the system would be overloaded
+ *   SIDE EFFECTS: Resets the process's real-time statistics and starts its first period now
+ */
+int32_t scheduler_set_rt(pcb_t *pcb, uint32_t period, uint32_t budget) {
+    // deadlines are compared through their difference, a longer period wouldn't order right
+    if (period > TIMER_MAX_TICKS || (period != 0 && (budget == 0 || budget > period))) {
+        return -1;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&sched_lock, flags);
+
+    uint32_t old_util = 0;
+    uint32_t new_util = 0;
+    if (pcb->rt.period != 0) {
+        old_util = scheduler_rt_util(pcb->rt.period, pcb->rt.budget);
+    }
+    if (period != 0) {
+        new_util = scheduler_rt_util(period, budget);
+    }
+
+    if (rt_utilization - old_util + new_util > RT_MAX_UTILIZATION) {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return -1;
+    }
+    rt_utilization = rt_utilization - old_util + new_util;
+
+    if (pcb->rt.period != 0) {
+        timer_cancel(&pcb->rt.timer);
+    }
+
+    pcb->rt.period = period;
+    pcb->rt.budget = budget;
+    pcb->rt.used = 0;
+    pcb->rt.throttled = 0;
+    pcb->rt.job_done = 0;
+    pcb->rt.terminal = this_cpu()->terminal_idx;
+    pcb->rt.periods = 0;
+    pcb->rt.missed = 0;
+    pcb->rt.throttles = 0;
+
+    if (period != 0) {
+        pcb->rt.deadline = pit_ticks + period;
+        timer_setup(&pcb->rt.timer, scheduler_rt_period, (uint32_t)pcb);
+        timer_add(&pcb->rt.timer, period);
+    }
+
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return 0;
+}
+
+/*
+ * scheduler_wake(pcb_t *pcb)
+ *   DESCRIPTION: Makes a blocked process runnable again, or makes its next `scheduler_block`
+ *                return right away if it hasn't blocked yet
+ *
+ *   INPUTS: pcb - process to wake, may be NULL
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Kicks the idle CPUs so one of them can pick the process up
+ */
+void scheduler_wake(pcb_t *pcb) {
+    if (pcb == NULL) {
         return;
     }
 
-    // switch the vid memory being written
-    terminal_state_t *current_terminal_state = terminal_get_state(scheduler_terminal_idx);
-    keyboard_set_buffer(&current_terminal_state->kb_buffer);
-    set_screen_xy(&current_terminal_state->cursor_x, &current_terminal_state->cursor_y);
+    unsigned long flags;
+    spin_lock_irqsave(&sched_lock, flags);
 
-    if (scheduler_terminal_idx == screen_terminal_idx) {
-        page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-        uservid_page_table[0].base_address = VID_MEM_INDEX;
-        set_cursor(current_terminal_state->cursor_x, current_terminal_state->cursor_y);
+    if (pcb->state == TASK_BLOCKED) {
+        pcb->state = TASK_RUNNABLE;
+        pcb->wake_tsc = rdtsc();
     } else {
-        page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX + (scheduler_terminal_idx + 1);
-        uservid_page_table[0].base_address = VID_MEM_INDEX + (scheduler_terminal_idx + 1);
+        pcb->wake_pending = 1;
     }
 
-    // update page table
-    page_dir[USER_INDEX].page_table_address =
-        (KERNEL_END + (get_scheduler_pcb()->pid * FOURMB_BITS)) >> ADDRESS_SHIFT;
+    scheduler_kick_idle();
 
-    flush_tlb();
+    spin_unlock_irqrestore(&sched_lock, flags);
 
-    // save esp0 in the TSS
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = KERNEL_END - (get_scheduler_pcb()->pid * EIGHTKB_BITS);
-
-    uint32_t saved_ebp = get_scheduler_pcb()->ebp_scheduler;
-
-    // some ASM code to restore ebp
-    asm volatile("          \n\
-        movl %0, %%ebp      \n\
-        leave               \n\
-        ret                 \n\
-        "
-                 :
-                 : "r"(saved_ebp)
-                 : "ebp");
+    // with dynamic ticks the clock may be stopped, a second runnable process needs quanta
+    pit_rearm();
+}
+
+/*
+ * scheduler_get_trace(pcb_t *pcb, sched_trace_t *trace, uint32_t reset)
+ *   DESCRIPTION: Copies the scheduler histograms, a consistent snapshot across CPUs, and a
+ *                process's own ones
+ *
+ *   INPUTS: pcb - process whose histograms go in `trace->task`, NULL for none (left zero)
+ *           trace - where to copy them
+ *           reset - nonzero to clear them (the process's too) after the copy
+ *   OUTPUTS: trace
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void scheduler_get_trace(pcb_t *pcb, sched_trace_t *trace, uint32_t reset) {
+    unsigned long flags;
+    spin_lock_irqsave(&sched_lock, flags);
+
+    memcpy(trace, &sched_trace, sizeof(sched_trace_t));
+    if (pcb != NULL) {
+        memcpy(&trace->task, &pcb->trace, sizeof(sched_task_trace_t));
+    }
+    if (reset) {
+        memset(&sched_trace, 0, sizeof(sched_trace_t));
+        if (pcb != NULL) {
+            memset(&pcb->trace, 0, sizeof(sched_task_trace_t));
+        }
+    }
+
+    spin_unlock_irqrestore(&sched_lock, flags);
 }
@@ -4,10 +4,79 @@
 #include "syscall.h"
 #include "terminal.h"
 
-/* Index of the terminal the process thescheduler is currently running is in. */
-extern uint8_t scheduler_terminal_idx;
+/* Real-time utilization is counted in thousandths of the CPU. Admission control keeps a tenth
+ * of it for best-effort processes so the shells stay responsive. */
+#define RT_UTIL_SCALE 1000
+#define RT_MAX_UTILIZATION 900
+
+/* Context switch statistics, cycle counts are measured with rdtsc. */
+typedef struct sched_stats {
+    /* Number of task-to-task switches performed. */
+    uint32_t switches;
+    /* Cycles spent in the most recent switch (from before `switch_to` until the next task runs). */
+    uint32_t last_switch_cycles;
+    /* Sum of cycles spent in all switches. */
+    uint64_t total_switch_cycles;
+    /* Number of times the idle task was switched to because nothing was runnable. */
+    uint32_t idle_entries;
+    /* Cycles spent in the idle tasks (halted or handling interrupts on their stacks). */
+    uint64_t idle_cycles;
+    /* Number of terminals an idle CPU took from another CPU's run queue. */
+    uint32_t steals;
+} sched_stats_t;
+
+extern sched_stats_t sched_stats;
+
+/* Saves the current kernel context into `prev` and resumes `next` (scheduling_asm.S). */
+extern void switch_to(context_t *prev, context_t *next);
+
+/* Sets up the idle tasks and the run queues. */
+void scheduler_init(void);
+
+/* Lets a terminal get its shell, the first time it is switched to. */
+void scheduler_start_terminal(uint8_t idx);
+
+/* Whether a terminal was switched to and given its shell, or is in some CPU's run queue. */
+int32_t scheduler_terminal_started(uint8_t idx);
+int32_t scheduler_terminal_queued(uint8_t idx);
 
 /* Context switches between terminals in the background when called by the PIT. */
 void scheduler();
 
+/* Gives up the CPU from any kernel path, returning once the scheduler switches back. */
+void scheduler_yield(void);
+
+/* Keeps interrupts from switching this CPU away until `scheduler_preempt_enable`. */
+void scheduler_preempt_disable(void);
+
+/* Ends a `scheduler_preempt_disable`, running a switch that was put off meanwhile. */
+void scheduler_preempt_enable(void);
+
+/* Whether an interrupt may switch this CPU away now, otherwise the switch is put off. */
+int32_t scheduler_preemptible(void);
+
+/* Has this CPU yield once preemption is enabled again, right away if it is. */
+void scheduler_resched(void);
+
+/* Marks the current process blocked and switches away until `scheduler_wake` is called on it. */
+void scheduler_block(void);
+
+/* Whether a CPU needs its scheduling clock (quantum expiry or real-time budget). */
+int32_t scheduler_cpu_needs_tick(uint32_t cpu);
+
+/* Whether the PIT must interrupt on the next tick, for any CPU. */
+int32_t scheduler_needs_tick(void);
+
+/* Charges this CPU's running real-time process for the ticks since its last tick. */
+void scheduler_tick(void);
+
+/* Admits a process to the real-time (EDF) class, or returns it to best-effort with period 0. */
+int32_t scheduler_set_rt(pcb_t *pcb, uint32_t period, uint32_t budget);
+
+/* Makes a blocked process runnable again. Safe to call from interrupt handlers. */
+void scheduler_wake(pcb_t *pcb);
+
+/* Copies the latency and context switch histograms, clearing them if `reset` is nonzero. */
+void scheduler_get_trace(pcb_t *pcb, sched_trace_t *trace, uint32_t reset);
+
 #endif
@@ -0,0 +1,121 @@
+#include "scrollback.h"
+
+#include "lib.h"
+
+#define SCROLLBACK_MASK (SCROLLBACK_SIZE - 1)
+
+/* Character byte of a screen cell */
+#define CELL_CHAR(cell) ((uint8_t)((cell)&0xFF))
+
+/*
+ * scrollback_init(scrollback_t *sb)
+ *   DESCRIPTION: Empties a history
+ *
+ *   INPUTS: sb - history to empty
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void scrollback_init(scrollback_t *sb) {
+    sb->head = 0;
+    sb->tail = 0;
+    sb->lines = 0;
+}
+
+/*
+ * scrollback_drop(scrollback_t *sb)
+ *   DESCRIPTION: Forgets the oldest line of a history
+ *
+ *   INPUTS: sb - non-empty history
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+static void scrollback_drop(scrollback_t *sb) {
+    while (sb->buf[sb->tail++ & SCROLLBACK_MASK] != '\n') {
+    }
+    sb->lines--;
+}
+
+/*
+ * scrollback_push_row(scrollback_t *sb, const uint16_t *row, uint32_t cols)
+ *   DESCRIPTION: Appends a row of screen cells to a history as a line. Only the characters are
+ *                kept and trailing blanks are dropped, so short lines take little room.
+ *
+ *   INPUTS: sb - history to append to
+ *           row - cells of the row
+ *           cols - number of cells, at most the screen width
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Drops the oldest lines when the history is full
+ */
+void scrollback_push_row(scrollback_t *sb, const uint16_t *row, uint32_t cols) {
+    uint32_t len = cols;
+    while (len > 0 && (CELL_CHAR(row[len - 1]) == 0 || CELL_CHAR(row[len - 1]) == ' ')) {
+        len--;
+    }
+
+    // room for the characters and the newline
+    while (SCROLLBACK_SIZE - (sb->head - sb->tail) < len + 1) {
+        scrollback_drop(sb);
+    }
+
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        uint8_t c = CELL_CHAR(row[i]);
+        // the newline ends lines in the buffer, blank cells are stored as spaces
+        sb->buf[sb->head++ & SCROLLBACK_MASK] = (c == 0 || c == '\n') ? ' ' : c;
+    }
+    sb->buf[sb->head++ & SCROLLBACK_MASK] = '\n';
+    sb->lines++;
+}
+
+/*
+ * scrollback_render(scrollback_t *sb, uint32_t back, uint16_t *view, const uint16_t *screen,
+ *                   uint32_t rows, uint32_t cols)
+ *   DESCRIPTION: Draws the screen as it was `back` lines ago: the last `back` lines of the history
+ *                followed by the top rows of the live screen
+ *
+ *   INPUTS: sb - history of the terminal
+ *           back - number of lines to go back, at most the number of lines held
+ *           view - cells to draw into, `rows` rows of `cols` cells
+ *           screen - cells of the live screen, same size
+ *           rows, cols - size of the screen
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void scrollback_render(scrollback_t *sb, uint32_t back, uint16_t *view, const uint16_t *screen,
+                       uint32_t rows, uint32_t cols) {
+    if (back > sb->lines) {
+        back = sb->lines;
+    }
+
+    // walk back to the start of the first line shown
+    uint32_t pos = sb->head;
+    uint32_t n;
+    for (n = 0; n < back; n++) {
+        pos--;
+        while (pos != sb->tail && sb->buf[(pos - 1) & SCROLLBACK_MASK] != '\n') {
+            pos--;
+        }
+    }
+
+    uint32_t r;
+    for (r = 0; r < rows; r++) {
+        uint16_t *out = view + r * cols;
+        if (r >= back) {
+            memcpy(out, screen + (r - back) * cols, cols * 2);
+            continue;
+        }
+
+        uint32_t c = 0;
+        uint8_t ch;
+        while ((ch = sb->buf[pos++ & SCROLLBACK_MASK]) != '\n') {
+            if (c < cols) {
+                out[c++] = (SCROLLBACK_ATTRIB << 8) | ch;
+            }
+        }
+        memset_word(out + c, (SCROLLBACK_ATTRIB << 8) | ' ', cols - c);
+    }
+}
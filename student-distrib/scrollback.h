@@ -0,0 +1,35 @@
+#ifndef _SCROLLBACK_H
+#define _SCROLLBACK_H
+
+#include "types.h"
+
+/* Bytes of text a terminal's history holds, a power of two. Lines are stored without their
+ * trailing blanks, so this is a few thousand lines of typical output. */
+#define SCROLLBACK_SIZE 65536
+
+/* Attribute history lines are shown with, only the characters are kept. */
+#define SCROLLBACK_ATTRIB 0x07
+
+/* Lines that scrolled off the top of a screen, oldest first. Each line is stored as its
+ * characters followed by a '\n'; the oldest lines are dropped to make room. */
+typedef struct scrollback {
+    uint8_t buf[SCROLLBACK_SIZE];
+    /* Free-running end of the newest line and start of the oldest one. */
+    uint32_t head;
+    uint32_t tail;
+    /* Number of lines held. */
+    uint32_t lines;
+} scrollback_t;
+
+/* Empties a history. */
+extern void scrollback_init(scrollback_t *sb);
+
+/* Appends a row of screen cells as a line, dropping its trailing blanks. */
+extern void scrollback_push_row(scrollback_t *sb, const uint16_t *row, uint32_t cols);
+
+/* Draws `rows` rows of a view `back` lines up from the live screen: the end of the history
+ * followed by the top of the screen. */
+extern void scrollback_render(scrollback_t *sb, uint32_t back, uint16_t *view,
+                              const uint16_t *screen, uint32_t rows, uint32_t cols);
+
+#endif /* _SCROLLBACK_H */
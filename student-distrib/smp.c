@@ -0,0 +1,225 @@
+#include "smp.h"
+
+#include "lapic.h"
+#include "lib.h"
+#include "paging.h"
+#include "pit.h"
+#include "scheduling.h"
+#include "syscall.h"
+
+/* Reading this unused port takes about a microsecond */
+#define IO_DELAY_PORT 0x80
+
+/* Waits of the INIT-SIPI-SIPI sequence, and how long the APs get to come online */
+#define INIT_DELAY_US 10000
+#define SIPI_DELAY_US 200
+#define AP_WAIT_US 100000
+
+#define PAGE_SHIFT 12
+
+cpu_t cpus[MAX_CPUS];
+
+uint32_t smp_num_cpus = 1;
+
+/* Next CPU index an application processor claims in `ap_start`. */
+volatile uint32_t smp_next_cpu = 1;
+
+/* Boot stacks of the application processors, each ends up as that CPU's first context. */
+uint8_t ap_stacks[MAX_CPUS - 1][AP_STACK_SIZE] __attribute__((aligned(16)));
+
+static tss_t ap_tss[MAX_CPUS - 1];
+
+/* Real mode startup code (smp_asm.S) */
+extern uint8_t smp_trampoline[];
+extern uint8_t smp_trampoline_end[];
+
+/*
+ * smp_delay_us(uint32_t us)
+ *   DESCRIPTION: Busy-waits for about the given number of microseconds, before the PIT runs
+ *
+ *   INPUTS: us - microseconds to wait
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+static void smp_delay_us(uint32_t us) {
+    while (us-- > 0) {
+        inb(IO_DELAY_PORT);
+    }
+}
+
+/*
+ * smp_set_tss(uint32_t cpu)
+ *   DESCRIPTION: Fills in the GDT entry of an application processor's TSS, like `entry` does for
+ *                the bootstrap processor's
+ *
+ *   INPUTS: cpu - CPU index, at least 1
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Modifies the GDT
+ */
+static void smp_set_tss(uint32_t cpu) {
+    seg_desc_t the_tss_desc;
+    the_tss_desc.granularity = 0x0;
+    the_tss_desc.opsize = 0x0;
+    the_tss_desc.reserved = 0x0;
+    the_tss_desc.avail = 0x0;
+    the_tss_desc.present = 0x1;
+    the_tss_desc.dpl = 0x0;
+    the_tss_desc.sys = 0x0;
+    the_tss_desc.type = 0x9;
+
+    SET_TSS_PARAMS(the_tss_desc, &ap_tss[cpu - 1], tss_size);
+    ap_tss_desc_ptr[cpu - 1] = the_tss_desc;
+
+    ap_tss[cpu - 1].ldt_segment_selector = KERNEL_LDT;
+    ap_tss[cpu - 1].ss0 = KERNEL_DS;
+    ap_tss[cpu - 1].esp0 = (uint32_t)ap_stacks[cpu - 1] + AP_STACK_SIZE;
+}
+
+/*
+ * smp_init()
+ *   DESCRIPTION: Sets up the per-CPU data and starts the application processors with the INIT,
+ *                startup, startup IPI sequence broadcast to every other CPU. Each one claims an
+ *                index, sets itself up in `ap_main` and waits for the scheduler to give it work.
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Maps the local APIC, sets smp_num_cpus. Without a local APIC only the
+ *                 bootstrap processor runs.
+ */
+void smp_init(void) {
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        cpus[i].id = i;
+        cpus[i].online = 0;
+        cpus[i].terminal_idx = -1;
+        cpus[i].ticks = 0;
+        cpus[i].preempt_count = 0;
+        cpus[i].resched_pending = 0;
+        cpus[i].tss = i == 0 ? &tss : &ap_tss[i - 1];
+    }
+
+    // the bootstrap processor starts terminal 0's shell first
+    cpus[0].online = 1;
+    cpus[0].terminal_idx = 0;
+
+    if (!lapic_present()) {
+        return;
+    }
+
+    paging_map_apic();
+    lapic_init();
+    cpus[0].apic_id = lapic_id();
+
+    for (i = 1; i < MAX_CPUS; i++) {
+        paging_init_cpu(i);
+        smp_set_tss(i);
+    }
+
+    // low memory is left unmapped, map the trampoline's page just to copy it there
+    paging_set_identity(TRAMPOLINE_ADDR >> PAGE_SHIFT, 1);
+    memcpy((void *)TRAMPOLINE_ADDR, smp_trampoline, smp_trampoline_end - smp_trampoline);
+    paging_set_identity(TRAMPOLINE_ADDR >> PAGE_SHIFT, 0);
+
+    // the second startup IPI is ignored by the CPUs the first one already started
+    lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    smp_delay_us(INIT_DELAY_US);
+    for (i = 0; i < 2; i++) {
+        lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_STARTUP |
+                              (TRAMPOLINE_ADDR >> PAGE_SHIFT));
+        smp_delay_us(SIPI_DELAY_US);
+    }
+
+    // there's no table of how many CPUs exist, give them all a fixed time to show up
+    smp_delay_us(AP_WAIT_US);
+
+    smp_num_cpus = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+        smp_num_cpus += cpus[i].online;
+    }
+    printf("SMP: %u CPUs online\n", smp_num_cpus);
+}
+
+/*
+ * ap_main(uint32_t cpu)
+ *   DESCRIPTION: Sets up an application processor once `ap_start` enabled paging and switched to
+ *                its stack, then halts until the scheduler sends it work
+ *
+ *   INPUTS: cpu - index claimed by this CPU
+ *   OUTPUTS: none
+ *   RETURN VALUE: never returns
+ *   SIDE EFFECTS: Marks the CPU online
+ */
+void ap_main(uint32_t cpu) {
+    // smp_cpu_id works from here on
+    ltr(TSS_SELECTOR(cpu));
+    lldt(KERNEL_LDT);
+    lidt(idt_desc_ptr);
+
+    lapic_init();
+    cpus[cpu].apic_id = lapic_id();
+    cpus[cpu].online = 1;
+
+    // start this CPU's scheduling clock once the bootstrap processor calibrated it
+    pit_init_cpu();
+
+    // The first scheduler call (local tick or reschedule IPI) saves this context as the CPU's
+    // boot context, never resumed
+    sti();
+    while (1) {
+        asm volatile("hlt");
+    }
+}
+
+/*
+ * smp_send_ipi(uint32_t cpu, uint8_t vector)
+ *   DESCRIPTION: Interrupts another CPU
+ *
+ *   INPUTS: cpu - CPU index
+ *           vector - interrupt vector to raise on it
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void smp_send_ipi(uint32_t cpu, uint8_t vector) {
+    if (cpu < MAX_CPUS && cpus[cpu].online) {
+        lapic_send_ipi(cpus[cpu].apic_id, LAPIC_ICR_FIXED | vector);
+    }
+}
+
+/*
+ * smp_send_ipi_others(uint8_t vector)
+ *   DESCRIPTION: Interrupts every other CPU
+ *
+ *   INPUTS: vector - interrupt vector to raise on them
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void smp_send_ipi_others(uint8_t vector) {
+    if (smp_num_cpus > 1) {
+        lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_FIXED | vector);
+    }
+}
+
+/*
+ * smp_resched_handler_base()
+ *   DESCRIPTION: Handles the reschedule IPI: picks up page table changes made by other CPUs,
+ *                charges the tick to the running process and lets the scheduler run
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: May context switch
+ */
+void smp_resched_handler_base(void) {
+    lapic_eoi();
+    flush_tlb();
+
+    scheduler_tick();
+    if (scheduler_preemptible()) {
+        scheduler();
+    }
+}
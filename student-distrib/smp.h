@@ -0,0 +1,71 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include "types.h"
+#include "x86_desc.h"
+
+/* Size of the boot stack of each application processor */
+#define AP_STACK_SIZE 0x2000
+#define AP_STACK_SHIFT 13
+
+/* Vector of the IPI asking a CPU to reschedule (also flushes its TLB). Without a local APIC
+ * timer the bootstrap processor sends it to the others on every PIT tick, since only it gets the
+ * PIT interrupt. */
+#define SMP_RESCHED_VEC 0xF0
+
+/* Physical address the application processors start at, must be page aligned and below 1MB */
+#define TRAMPOLINE_ADDR 0x8000
+
+#ifndef ASM
+
+/* Per-CPU data */
+typedef struct cpu {
+    uint32_t id;
+    uint32_t apic_id;
+    volatile int32_t online;
+    // Terminal whose process this CPU runs, -1 until the scheduler gives it one
+    int32_t terminal_idx;
+    // Local scheduling clock ticks taken, when the local APIC timer drives scheduling
+    volatile uint32_t ticks;
+    // Nonzero while the code running here must not be switched away from, and whether a switch
+    // was put off because of it
+    volatile int32_t preempt_count;
+    volatile int32_t resched_pending;
+    // Holds esp0 of the process running on this CPU
+    tss_t *tss;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+
+/* Number of CPUs running the kernel */
+extern uint32_t smp_num_cpus;
+
+/* Index (in `cpus`) of the CPU this runs on. Each CPU loads its own TSS, so the task register
+ * tells them apart without touching the local APIC. */
+static inline uint32_t smp_cpu_id(void) {
+    uint16_t sel;
+    asm volatile("str %w0" : "=r"(sel));
+    return sel < AP_TSS ? 0 : ((sel - AP_TSS) >> 3) + 1;
+}
+
+#define this_cpu() (&cpus[smp_cpu_id()])
+
+/* Sets up the per-CPU data and starts the application processors. Needs paging. */
+extern void smp_init(void);
+
+/* Sends a fixed IPI with the given vector to a CPU. */
+extern void smp_send_ipi(uint32_t cpu, uint8_t vector);
+
+/* Sends a fixed IPI with the given vector to every other CPU. */
+extern void smp_send_ipi_others(uint8_t vector);
+
+/* Entry point of the application processors in C, on their own stack (smp_asm.S). */
+extern void ap_main(uint32_t cpu);
+
+extern void smp_resched_handler(void);
+
+extern void smp_resched_handler_base(void);
+
+#endif /* ASM */
+
+#endif /* _SMP_H */
@@ -0,0 +1,54 @@
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+#include "irqtrace.h"
+#include "lib.h"
+#include "types.h"
+
+/* A busy-waiting lock for state shared between CPUs. Interrupts must stay off on the holding CPU
+ * (use the irqsave variants unless they already are), otherwise an interrupt handler could spin
+ * forever on a lock its own CPU holds. */
+typedef struct spinlock {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+/* Atomically stores `val` in `*addr` and returns the previous value. */
+static inline uint32_t xchg(volatile uint32_t *addr, uint32_t val) {
+    asm volatile("lock; xchgl %0, %1" : "+m"(*addr), "+r"(val) : : "memory", "cc");
+    return val;
+}
+
+/* Takes the lock, spinning until it is free. */
+static inline void spin_lock(spinlock_t *lock) {
+    while (xchg(&lock->locked, 1) != 0) {
+        // wait with plain reads so the cache line isn't bounced between the waiting CPUs
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+/* Releases the lock. Stores aren't reordered with earlier loads or stores on x86, so a compiler
+ * barrier is enough to keep the critical section before the release. */
+static inline void spin_unlock(spinlock_t *lock) {
+    asm volatile("" : : : "memory");
+    lock->locked = 0;
+}
+
+/* Disables interrupts on this CPU (saving the flags) and takes the lock */
+#define spin_lock_irqsave(lock, flags)                                                             \
+    do {                                                                                           \
+        irq_save(flags);                                                                           \
+        spin_lock(lock);                                                                           \
+    } while (0)
+
+/* Releases the lock and restores the flags saved by `spin_lock_irqsave` */
+#define spin_unlock_irqrestore(lock, flags)                                                        \
+    do {                                                                                           \
+        spin_unlock(lock);                                                                         \
+        irq_restore(flags);                                                                        \
+    } while (0)
+
+#endif /* _SPINLOCK_H */
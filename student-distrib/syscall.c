@@ -1,11 +1,17 @@
 #include "syscall.h"
 
+#include "clock.h"
 #include "file_system.h"
+#include "irqtrace.h"
 #include "lib.h"
 #include "paging.h"
+#include "pit.h"
 #include "rtc.h"
 #include "scheduling.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "terminal.h"
+#include "timer.h"
 
 #define ELF_SIZE 4
 
@@ -21,17 +27,28 @@
 /* Offset to find EIP in program image */
 #define EIP_OFFSET 24
 
+/* Time units for the sleep calls */
+#define MS_PER_SEC 1000
+#define MS_PER_TICK (MS_PER_SEC / PIT_HZ)
+#define NS_PER_TICK (NS_PER_SEC / PIT_HZ)
+
 /* Array of which PIDs are in use or not (1 or 0). */
 uint32_t pids[MAXPIDS];
 
+/* Keeps two CPUs in `execute` from claiming the same PID. */
+static spinlock_t pid_lock = SPINLOCK_INIT;
+
 /* pcb_t *get_scheduler_pcb(void)
- *   DESCRIPTION: gets the currect pcb of the scheduler's current terminal
+ *   DESCRIPTION: gets the currect pcb of the terminal this CPU is running
  *
  *   INPUTS: none
  *   OUTPUTS: pcb_t*
- *   RETURN VALUE: current pcb
+ *   RETURN VALUE: current pcb, NULL if the CPU has no terminal yet or it has no process
  */
-pcb_t *get_scheduler_pcb(void) { return terminal_get_state(scheduler_terminal_idx)->curr_pcb; }
+pcb_t *get_scheduler_pcb(void) {
+    int32_t idx = this_cpu()->terminal_idx;
+    return idx < 0 ? NULL : terminal_get_state(idx)->curr_pcb;
+}
 
 /* int32_t halt(uint8_t status)
  *   DESCRIPTION: Ends process and returns context back to parent process.
@@ -42,50 +59,62 @@ pcb_t *get_scheduler_pcb(void) { return terminal_get_state(scheduler_terminal_id
  *   SIDE EFFECTS: Returns to parent process
  */
 int32_t halt(uint8_t status) {
-    cli();
+    pcb_t *pcb = get_scheduler_pcb();
 
     // If status = 256, an exception has occured and 256 should be returned from `execute`,
     // but.. status is a uint8_t so 256 wraps to 0.
     //
     // Instead, we manually store a flag of if an exception has occured.
     uint32_t status_32 = (uint32_t)status;
-    if (get_scheduler_pcb()->exception_occured) {
+    if (pcb->exception_occured) {
         status_32 = 256;
     }
 
-    /* Check if trying to exit base shell */
-    if (get_scheduler_pcb()->parent_pcb == NULL) {
-        // Clear base shell PID
-        pids[get_scheduler_pcb()->pid] = 0;
-        terminal_get_state(scheduler_terminal_idx)->curr_pcb = NULL;
-
-        sti();
-        execute((uint8_t *)"shell");
-    }
+    /* Give back the process's real-time reservation and stop its period timer */
+    scheduler_set_rt(pcb, 0, 0);
 
-    /* Restore parent paging */
-    page_dir[USER_INDEX].page_table_address =
-        (KERNEL_END + (get_scheduler_pcb()->parent_pcb->pid * FOURMB_BITS)) >> ADDRESS_SHIFT;
-    flush_tlb();
+    /* Put the terminal back in canonical mode if this process changed it */
+    terminal_release_mode(pcb);
 
     /* Clear file descriptors */
     int i;
     for (i = 0; i < MAX_OPEN_FILES; i++) {
-        if (get_scheduler_pcb()->fds[i].flags == FD_USED) {
+        if (pcb->fds[i].flags == FD_USED) {
             close(i);
         }
     }
 
+    /* Hand the terminal back to the parent with interrupts off, so the scheduler never sees the
+     * parent as current with the child's paging and TSS */
+    cli();
+
+    // the screen only stays pinned if the parent mapped it too
+    terminal_get_state(this_cpu()->terminal_idx)->pinned =
+        pcb->parent_pcb != NULL && pcb->parent_pcb->vidmapped;
+
+    /* Check if trying to exit base shell */
+    if (pcb->parent_pcb == NULL) {
+        // Clear base shell PID
+        pids[pcb->pid] = 0;
+        terminal_get_state(this_cpu()->terminal_idx)->curr_pcb = NULL;
+
+        // interrupts stay off, a base shell is started without a process to switch back to
+        execute((uint8_t *)"shell");
+    }
+
+    /* Restore parent paging */
+    paging_map_user(KERNEL_END + (pcb->parent_pcb->pid * FOURMB_BITS));
+
     /* Write parent's process info back to TSS */
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = KERNEL_END - (get_scheduler_pcb()->parent_pcb->pid * EIGHTKB_BITS);
+    this_cpu()->tss->ss0 = KERNEL_DS;
+    this_cpu()->tss->esp0 = KERNEL_END - (pcb->parent_pcb->pid * EIGHTKB_BITS);
 
     /* Jump to execute return */
-    uint32_t saved_ebp = get_scheduler_pcb()->ebp_execute;
+    uint32_t saved_ebp = pcb->ebp_execute;
 
     /* Unset current PID in pids and restore curr_pcb */
-    pids[get_scheduler_pcb()->pid] = 0;
-    terminal_get_state(scheduler_terminal_idx)->curr_pcb = get_scheduler_pcb()->parent_pcb;
+    pids[pcb->pid] = 0;
+    terminal_get_state(this_cpu()->terminal_idx)->curr_pcb = pcb->parent_pcb;
 
     sti();
 
@@ -115,7 +144,6 @@ int32_t halt(uint8_t status) {
  *   SIDE EFFECTS: Starts a process if its able to
  */
 int32_t execute(const uint8_t *command) {
-    cli();
     int i;
 
     /* Parse args */
@@ -152,10 +180,12 @@ int32_t execute(const uint8_t *command) {
     /* Check File Validity */
     dentry_t dentry;
 
+    // errors are printed straight to the screen, after what the caller wrote before
+    terminal_sync();
+
     // file doesn't exist check
     if (read_dentry_by_name(file_name, &dentry) == -1) {
         printf("Error: Command `%s` doesn't exist\n", file_name);
-        sti();
         return -1;
     }
 
@@ -164,7 +194,6 @@ int32_t execute(const uint8_t *command) {
 
     if (read_data(dentry.inode, 0, elf_buffer, ELF_SIZE) == -1) {
         printf("Error: Unable to read first 4 bytes\n");
-        sti();
         return -1;
     }
 
@@ -172,13 +201,29 @@ int32_t execute(const uint8_t *command) {
     if (elf_buffer[0] != ELF_MN_1 || elf_buffer[1] != ELF_MN_2 || elf_buffer[2] != ELF_MN_3 ||
         elf_buffer[3] != ELF_MN_4) {
         printf("Error: `%s` is not an executable\n", file_name);
-        sti();
         return -1;
     }
 
     /* Find PID */
+    // A PID is kept for each terminal without a shell yet, so nested programs can't stop a
+    // terminal from starting. A base shell may take the one kept for its own terminal. There are
+    // fewer terminals than PIDs, so the shells can always run a program.
+    int32_t kept = 0;
+    if (get_scheduler_pcb() != NULL) {
+        for (i = 0; i < terminal_count; i++) {
+            terminal_state_t *state = terminal_get_state(i);
+            kept += state == NULL || state->curr_pcb == NULL;
+        }
+    }
+
     int pid = -1;
+    int32_t free_pids = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&pid_lock, flags);
     for (i = 0; i < MAXPIDS; i++) {
+        free_pids += pids[i] == 0;
+    }
+    for (i = 0; i < MAXPIDS && free_pids > kept; i++) {
         // select a valid PID
         if (pids[i] == 0) {
             pids[i] = 1;
@@ -186,51 +231,62 @@ int32_t execute(const uint8_t *command) {
             break;
         }
     }
+    spin_unlock_irqrestore(&pid_lock, flags);
 
     if (pid == -1) {
-        printf("Error: All PIDs used\n");
-        sti();
+        if (free_pids > 0) {
+            printf("Error: The PIDs left are kept for the other terminals' shells\n");
+        } else {
+            printf("Error: All PIDs used\n");
+        }
         return -1;
     }
 
-    // update parent and current pcb
-    terminal_state_t *current_terminal_state = terminal_get_state(scheduler_terminal_idx);
-
+    // set up the new pcb, nothing else looks at it until it is the terminal's current one
     pcb_t *curr_pcb = (pcb_t *)(KERNEL_END - (EIGHTKB_BITS * (pid + 1)));
-    pcb_t *parent_pcb = current_terminal_state->curr_pcb;
-    current_terminal_state->curr_pcb = curr_pcb;
 
-    get_scheduler_pcb()->pid = pid;
-    get_scheduler_pcb()->parent_pcb = parent_pcb;
-    memcpy(get_scheduler_pcb()->args, args, sizeof(args));
-    get_scheduler_pcb()->exception_occured = 0;
+    curr_pcb->pid = pid;
+    memcpy(curr_pcb->args, args, sizeof(args));
+    curr_pcb->exception_occured = 0;
+    curr_pcb->vidmapped = 0;
+    curr_pcb->state = TASK_RUNNABLE;
+    curr_pcb->wake_pending = 0;
+    curr_pcb->wake_tsc = 0;
+    memset(&curr_pcb->rt, 0, sizeof(rt_sched_t));
+    memset(&curr_pcb->trace, 0, sizeof(sched_task_trace_t));
 
     // Clear all FDs
     for (i = 0; i < MAX_OPEN_FILES; i++) {
-        get_scheduler_pcb()->fds[i].functions.open = NULL;
-        get_scheduler_pcb()->fds[i].functions.close = NULL;
-        get_scheduler_pcb()->fds[i].functions.read = NULL;
-        get_scheduler_pcb()->fds[i].functions.write = NULL;
-        get_scheduler_pcb()->fds[i].inode = 0;
-        get_scheduler_pcb()->fds[i].pos = 0;
-        get_scheduler_pcb()->fds[i].flags = FD_AVAIL;
+        curr_pcb->fds[i].functions.open = NULL;
+        curr_pcb->fds[i].functions.close = NULL;
+        curr_pcb->fds[i].functions.read = NULL;
+        curr_pcb->fds[i].functions.write = NULL;
+        curr_pcb->fds[i].functions.ioctl = NULL;
+        curr_pcb->fds[i].inode = 0;
+        curr_pcb->fds[i].pos = 0;
+        curr_pcb->fds[i].flags = FD_AVAIL;
     }
 
     // Set FD 0 to stdin
-    get_scheduler_pcb()->fds[0].functions = make_stdin_fops();
-    get_scheduler_pcb()->fds[0].flags = FD_USED;
+    curr_pcb->fds[0].functions = make_stdin_fops();
+    curr_pcb->fds[0].flags = FD_USED;
 
     // Set FD 1 to stdout
-    get_scheduler_pcb()->fds[1].functions = make_stdout_fops();
-    get_scheduler_pcb()->fds[1].flags = FD_USED;
+    curr_pcb->fds[1].functions = make_stdout_fops();
+    curr_pcb->fds[1].flags = FD_USED;
 
     /* Setup Paging */
 
-    // make virtual mem map to right physical address
-    page_dir[USER_INDEX].page_table_address =
-        (KERNEL_END + (get_scheduler_pcb()->pid * FOURMB_BITS)) >> ADDRESS_SHIFT;
-
-    flush_tlb();
+    // Update parent and current pcb and make virtual mem map to right physical address with
+    // interrupts off, the scheduler must never see one without the other. If it switches away
+    // after that, this context is saved and resumed as the new process's. A base shell has no
+    // parent to save into, `scheduler_launch` calls us with interrupts off and they stay off.
+    irq_save(flags);
+    terminal_state_t *current_terminal_state = terminal_get_state(this_cpu()->terminal_idx);
+    curr_pcb->parent_pcb = current_terminal_state->curr_pcb;
+    current_terminal_state->curr_pcb = curr_pcb;
+    paging_map_user(KERNEL_END + (curr_pcb->pid * FOURMB_BITS));
+    irq_restore(flags);
 
     /* Load file into memory */
 
@@ -243,23 +299,28 @@ int32_t execute(const uint8_t *command) {
     uint32_t eip = *((uint32_t *)(program_location + EIP_OFFSET));
 
     /* Prepare For Context Switch */
+    // stay on this CPU from here, its TSS must hold our stack when the iret happens
+    cli();
+
     // save current ebp
     register uint32_t ebp asm("ebp");
-    get_scheduler_pcb()->ebp_execute = ebp;
+    curr_pcb->ebp_execute = ebp;
 
     // modify esp0 and ss0 in TSS
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = KERNEL_END - (get_scheduler_pcb()->pid * EIGHTKB_BITS);
-    sti();
-
-    // push IRET context on the the correct order and call iret
-    asm volatile("    \n\
-        pushl %0      \n\
-        pushl %1      \n\
-        pushfl        \n\
-        pushl %2      \n\
-        pushl %3      \n\
-        iret          \n\
+    this_cpu()->tss->ss0 = KERNEL_DS;
+    this_cpu()->tss->esp0 = KERNEL_END - (curr_pcb->pid * EIGHTKB_BITS);
+
+    // push IRET context on the the correct order and call iret. Interrupts are only enabled by
+    // the iret itself (IF set in the pushed EFLAGS) so the scheduler can't switch away while we
+    // are still on a stack the new process doesn't own.
+    asm volatile("                \n\
+        pushl %0                  \n\
+        pushl %1                  \n\
+        pushfl                    \n\
+        orl $0x200, (%%esp)       \n\
+        pushl %2                  \n\
+        pushl %3                  \n\
+        iret                      \n\
         "
                  :
                  : "r"(USER_DS), "r"(USER_ADDRESS + FOURMB_BITS), "r"(USER_CS), "r"(eip)
@@ -303,24 +364,20 @@ int32_t read(int32_t fd, void *buf, int32_t nbytes) {
  *   SIDE EFFECTS: Writes to a buffer given the numb
  */
 int32_t write(int32_t fd, const void *buf, int32_t nbytes) {
-    cli();
     pcb_t *pcb = get_scheduler_pcb();
 
     // check for invalid arguments
     if (fd < 0 || fd >= MAX_OPEN_FILES || buf == NULL || nbytes < 0 ||
         pcb->fds[fd].flags == FD_AVAIL) {
-        sti();
         return -1;
     }
 
     // check if the function is null}
     if (pcb->fds[fd].functions.write == NULL) {
-        sti();
         return -1;
     }
-    // return the number of bytes read
+    // return the number of bytes read (the driver locks what it touches)
     uint32_t val = pcb->fds[fd].functions.write(fd, buf, nbytes);
-    sti();
     return val;
 }
 
@@ -404,6 +461,7 @@ int32_t close(int32_t fd) {
         pcb->fds[fd].functions.close = NULL;
         pcb->fds[fd].functions.read = NULL;
         pcb->fds[fd].functions.write = NULL;
+        pcb->fds[fd].functions.ioctl = NULL;
         pcb->fds[fd].inode = 0;
         pcb->fds[fd].pos = 0;
         pcb->fds[fd].flags = FD_AVAIL;
@@ -446,6 +504,9 @@ int32_t vidmap(uint8_t **screen_start) {
         return -1;
     }
 
+    // vidmap maps the start of the terminal's region, keep the screen there from now on
+    get_scheduler_pcb()->vidmapped = 1;
+    terminal_get_state(this_cpu()->terminal_idx)->pinned = 1;
     clear();
 
     // update value in screen start to point to video mem
@@ -464,3 +525,131 @@ int32_t sigreturn(void) {
     printf("sigreturn called - not implemented\n");
     return -1;
 }
+
+/* int32_t sleep(uint32_t ms)
+ * Inputs: uint32_t ms - how long to sleep, in milliseconds
+ * Return Value: 0
+ * Function: blocks the process for at least `ms` milliseconds (rounded up to whole ticks)
+ */
+int32_t sleep(uint32_t ms) {
+    // rounded up without adding first, which would wrap for the longest sleeps
+    timer_sleep(ms / MS_PER_TICK + (ms % MS_PER_TICK != 0));
+    return 0;
+}
+
+/* int32_t nanosleep(const timespec_t* req)
+ * Inputs: const timespec_t* req - how long to sleep
+ * Return Value: 0 on success, -1 for an invalid interval or one longer than the timers can wait
+ * Function: blocks the process for at least the requested time (rounded up to whole ticks)
+ */
+int32_t nanosleep(const timespec_t *req) {
+    // make sure the interval is in user space
+    if ((uint32_t)req < USER_ADDRESS ||
+        (uint32_t)req > (USER_ADDRESS + FOURMB_BITS - sizeof(timespec_t))) {
+        return -1;
+    }
+
+    // tv_sec * PIT_HZ would wrap to a short sleep
+    if (req->tv_nsec >= NS_PER_SEC || req->tv_sec > TIMER_MAX_TICKS / PIT_HZ) {
+        return -1;
+    }
+
+    timer_sleep(req->tv_sec * PIT_HZ + (req->tv_nsec + NS_PER_TICK - 1) / NS_PER_TICK);
+    return 0;
+}
+
+/* int32_t sched_setrt(uint32_t period_ms, uint32_t budget_ms)
+ * Inputs: uint32_t period_ms - period of the process's jobs in milliseconds, 0 for best-effort
+ *         uint32_t budget_ms - CPU time the process may use per period, in milliseconds
+ * Return Value: 0 on success, -1 for invalid parameters or if admission control refuses them
+ * Function: moves the process into the earliest-deadline-first real-time class, scheduled ahead
+ *           of every best-effort process. Both values are rounded up to whole ticks.
+ */
+int32_t sched_setrt(uint32_t period_ms, uint32_t budget_ms) {
+    // adding MS_PER_TICK - 1 first would wrap a period near UINT32_MAX to 0 (best-effort)
+    uint32_t period = period_ms / MS_PER_TICK + (period_ms % MS_PER_TICK != 0);
+    uint32_t budget = budget_ms / MS_PER_TICK + (budget_ms % MS_PER_TICK != 0);
+    return scheduler_set_rt(get_scheduler_pcb(), period, budget);
+}
+
+/* int32_t sched_getrt(rt_stats_t* stats)
+ * Inputs: rt_stats_t* stats - where to store the statistics
+ * Return Value: 0 on success, -1 for an invalid pointer
+ * Function: reports the process's real-time parameters and missed-deadline counts
+ */
+int32_t sched_getrt(rt_stats_t *stats) {
+    // make sure the statistics land in user space
+    if ((uint32_t)stats < USER_ADDRESS ||
+        (uint32_t)stats > (USER_ADDRESS + FOURMB_BITS - sizeof(rt_stats_t))) {
+        return -1;
+    }
+
+    pcb_t *pcb = get_scheduler_pcb();
+    stats->period_ms = pcb->rt.period * MS_PER_TICK;
+    stats->budget_ms = pcb->rt.budget * MS_PER_TICK;
+    stats->periods = pcb->rt.periods;
+    stats->missed = pcb->rt.missed;
+    stats->throttled = pcb->rt.throttles;
+    return 0;
+}
+
+/* int32_t sched_gettrace(sched_trace_t* trace, uint32_t reset)
+ * Inputs: sched_trace_t* trace - where to store the histograms
+ *         uint32_t reset - nonzero to clear them after the copy, e.g. before measuring a workload
+ * Return Value: 0 on success, -1 for an invalid pointer
+ * Function: reports the scheduler's latency, run time and context switch histograms, over all
+ *           processes and for the calling one
+ */
+int32_t sched_gettrace(sched_trace_t *trace, uint32_t reset) {
+    // make sure the histograms land in user space
+    if ((uint32_t)trace < USER_ADDRESS ||
+        (uint32_t)trace > (USER_ADDRESS + FOURMB_BITS - sizeof(sched_trace_t))) {
+        return -1;
+    }
+
+    scheduler_get_trace(get_scheduler_pcb(), trace, reset);
+    return 0;
+}
+
+/* int32_t ioctl(int32_t fd, uint32_t request, uint32_t arg)
+ * Inputs: int32_t fd - file descriptor
+ *         uint32_t request - driver specific request
+ *         uint32_t arg - argument of the request
+ * Return Value: what the driver returns, -1 if the file has no such control
+ * Function: changes or queries settings of an open file, e.g. the terminal's line discipline
+ */
+int32_t ioctl(int32_t fd, uint32_t request, uint32_t arg) {
+    pcb_t *pcb = get_scheduler_pcb();
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES || pcb->fds[fd].flags == FD_AVAIL ||
+        pcb->fds[fd].functions.ioctl == NULL) {
+        return -1;
+    }
+    return pcb->fds[fd].functions.ioctl(fd, request, arg);
+}
+
+/* int32_t clock_gettime(uint32_t clock_id, timespec_t* ts)
+ * Inputs: uint32_t clock_id - CLOCK_REALTIME or CLOCK_MONOTONIC
+ *         timespec_t* ts - where to store the time
+ * Return Value: 0 on success, -1 for an unknown clock or an invalid pointer
+ * Function: reads a clock to the nanosecond, for programs timing themselves
+ */
+int32_t clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    // make sure the time lands in user space
+    if ((uint32_t)ts < USER_ADDRESS ||
+        (uint32_t)ts > (USER_ADDRESS + FOURMB_BITS - sizeof(timespec_t))) {
+        return -1;
+    }
+
+    uint64_t ns;
+    if (clock_id == CLOCK_REALTIME) {
+        ns = clock_realtime_ns();
+    } else if (clock_id == CLOCK_MONOTONIC) {
+        ns = clock_monotonic_ns();
+    } else {
+        return -1;
+    }
+
+    ts->tv_sec = div64_32(ns, NS_PER_SEC, &ts->tv_nsec);
+    return 0;
+}
@@ -7,6 +7,7 @@
 
 #include "file_system.h"
 #include "keyboard.h"
+#include "timer.h"
 #include "types.h"
 #include "x86_desc.h"
 
@@ -23,6 +24,98 @@
 /* Max open file descriptors for a process */
 #define MAX_OPEN_FILES 8
 
+/* Time interval passed to `nanosleep`, and time returned by `clock_gettime` */
+typedef struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+/* Kernel context saved by `switch_to` when a task is switched out. The callee-saved registers
+ * (EBP, EBX, ESI, EDI) live on the task's own kernel stack, below the saved ESP. */
+typedef struct context {
+    uint32_t esp;
+    uint32_t eip;
+} context_t;
+
+/* Process scheduling states */
+#define TASK_RUNNABLE 0 // can be picked by the scheduler
+#define TASK_BLOCKED 1  // waiting for an event, skipped until `scheduler_wake`
+
+/* Real-time statistics returned by `sched_getrt` */
+typedef struct rt_stats {
+    // Parameters the process was admitted with, 0 for a best-effort process
+    uint32_t period_ms;
+    uint32_t budget_ms;
+    // Periods started since the process became real-time
+    uint32_t periods;
+    // Periods that ended while the process was still running its job
+    uint32_t missed;
+    // Periods in which the process used up its budget and was throttled
+    uint32_t throttled;
+} rt_stats_t;
+
+/* Number of buckets in a scheduler histogram, bucket i counts values in [2^i, 2^(i+1)) and
+ * bucket 0 also counts 0 */
+#define SCHED_HIST_BUCKETS 32
+
+/* Log2 histogram of cycle counts measured with rdtsc */
+typedef struct sched_hist {
+    // Number of values recorded, their sum and the largest one
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+    uint32_t buckets[SCHED_HIST_BUCKETS];
+} sched_hist_t;
+
+/* Scheduler tracing of a single process, kept in its pcb */
+typedef struct sched_task_trace {
+    // From `scheduler_wake` making the process runnable until it is switched to
+    sched_hist_t wakeup_latency;
+    // How long the process ran each time before its CPU switched to something else
+    sched_hist_t run_time;
+    // Switches away from the process because it blocked
+    uint32_t voluntary_switches;
+} sched_task_trace_t;
+
+/* Scheduler tracing returned by `sched_gettrace`, over all CPUs */
+typedef struct sched_trace {
+    // From `scheduler_wake` making a blocked process runnable until it is switched to
+    sched_hist_t wakeup_latency;
+    // How long a process ran each time before its CPU switched to something else
+    sched_hist_t run_time;
+    // Time the scheduler took to pick what runs next, switch or not
+    sched_hist_t pick_cycles;
+    // Time a context switch took, its count is the number of switches (idle task included)
+    sched_hist_t switch_cycles;
+    // Switches away from a process that blocked, the others were preemptions
+    uint32_t voluntary_switches;
+    // The same wakeup latency, run time and blocking switches of the calling process alone
+    sched_task_trace_t task;
+} sched_trace_t;
+
+/* Earliest-deadline-first state of a real-time process */
+typedef struct rt_sched {
+    // Period and CPU budget per period in ticks, period is 0 for best-effort processes
+    uint32_t period;
+    uint32_t budget;
+    // Absolute tick the current period (and job) ends at
+    uint32_t deadline;
+    // Ticks of CPU used in the current period
+    uint32_t used;
+    // Budget used up, not picked until the next period starts
+    int32_t throttled;
+    // Blocked (finished its job) at some point during the current period
+    int32_t job_done;
+    // Terminal the process runs in
+    uint8_t terminal;
+    // Fires at every period boundary
+    timer_t timer;
+    // Counters reported by `sched_getrt`
+    uint32_t periods;
+    uint32_t missed;
+    uint32_t throttles;
+} rt_sched_t;
+
 /* PCB Struct */
 typedef struct pcb {
     // Process's file descriptors
@@ -35,14 +128,27 @@ typedef struct pcb {
 
     // EBP to return to `execute`'s function frame
     uint32_t ebp_execute;
-    // EBP to return to `scheduler`'s function frame
-    uint32_t ebp_scheduler;
+    // Kernel context to resume when the scheduler switches back to this process
+    context_t context;
+    // TASK_RUNNABLE or TASK_BLOCKED
+    volatile int32_t state;
+    // Set by a wakeup that came before the process blocked, so it doesn't block at all
+    volatile int32_t wake_pending;
+    // TSC value when `scheduler_wake` made the process runnable, 0 once it ran again
+    uint64_t wake_tsc;
+    // Real-time class state, `rt.period` is 0 for best-effort processes
+    rt_sched_t rt;
+    // This process's share of the scheduler histograms
+    sched_task_trace_t trace;
 
     // Argument passed into shell
     uint8_t args[BUFFER_SIZE];
 
     // Boolean flag for if an exception has occured in this process or not
     int32_t exception_occured;
+
+    // Set once the process maps its terminal's screen with `vidmap`
+    int32_t vidmapped;
 } pcb_t;
 
 /* Pointer to current PCB. */
@@ -68,5 +174,12 @@ extern int32_t getargs(uint8_t *buf, int32_t nbytes);
 extern int32_t vidmap(uint8_t **screen_start);
 extern int32_t set_handler(int32_t signum, void *handler_address);
 extern int32_t sigreturn(void);
+extern int32_t sleep(uint32_t ms);
+extern int32_t nanosleep(const timespec_t *req);
+extern int32_t sched_setrt(uint32_t period_ms, uint32_t budget_ms);
+extern int32_t sched_getrt(rt_stats_t *stats);
+extern int32_t sched_gettrace(sched_trace_t *trace, uint32_t reset);
+extern int32_t ioctl(int32_t fd, uint32_t request, uint32_t arg);
+extern int32_t clock_gettime(uint32_t clock_id, timespec_t *ts);
 
 #endif /* _SYSCALL_H */
@@ -1,125 +1,555 @@
 #include "terminal.h"
 
+#include "irqtrace.h"
 #include "keyboard.h"
 #include "lib.h"
+#include "page_alloc.h"
 #include "paging.h"
 #include "scheduling.h"
+#include "smp.h"
 #include "syscall.h"
 #include "x86_desc.h"
 
-static terminal_state_t terminals[NUM_TERMINALS];
+/* State of each terminal, NULL until it is first used, see `terminal_create` */
+static terminal_state_t *terminals[MAX_TERMINALS];
+
+/* Rows on a screen, output followed by that many lines scrolls off before it can be seen */
+#define SCREEN_ROWS 25
+#define SCREEN_COLS 80
+
+/* The region after the ones terminals' screens can be in is where the scrollback view is drawn */
+#define VIEW_ORIGIN (VGA_REGIONS * VID_REGION_CELLS)
+
+#if VGA_REGIONS < 1
+#error "The screen on display and the scrollback view need their own region of VGA text memory"
+#endif
+
+/* First cell of the region a screen's origin is in */
+#define SCREEN_REGION(origin) ((origin) & ~(VID_REGION_CELLS - 1))
+
+/* Terminal whose screen is in each region of VGA text memory, -1 for a free region */
+static int8_t vga_region_owner[VGA_REGIONS];
+
+/* Lines the screen terminal's view is scrolled back, 0 when it shows the live screen */
+static uint32_t view_lines = 0;
 
 uint8_t screen_terminal_idx = 0;
 
-terminal_state_t *terminal_get_state(uint8_t index) { return &terminals[index]; }
+uint8_t terminal_count = DEFAULT_TERMINALS;
+
+spinlock_t terminal_lock = SPINLOCK_INIT;
+
+terminal_state_t *terminal_get_state(uint8_t index) { return terminals[index]; }
+
+/* terminal_state_t* terminal_create(uint8_t idx)
+ * Inputs: uint8_t idx - terminal to create, below terminal_count
+ * Return Value: the terminal's state, NULL if idx is out of range or the page pool is used up
+ * Function: gives a terminal its state and a blank screen the first time it is used, so only the
+ *           terminals in use take memory. The screen goes in a free region of VGA text memory,
+ *           or in pages of the pool once those are taken. Returns the existing state after that.
+ */
+terminal_state_t *terminal_create(uint8_t idx) {
+    if (idx >= terminal_count) {
+        return NULL;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
+    terminal_state_t *state = terminals[idx];
+    if (state != NULL) {
+        spin_unlock_irqrestore(&terminal_lock, flags);
+        return state;
+    }
+
+    state = page_alloc(PAGES_FOR(sizeof(terminal_state_t)), 1);
+    if (state == NULL) {
+        spin_unlock_irqrestore(&terminal_lock, flags);
+        return NULL;
+    }
+
+    int i;
+    int origin = -1;
+    for (i = 0; i < VGA_REGIONS && origin < 0; i++) {
+        if (vga_region_owner[i] < 0) {
+            vga_region_owner[i] = idx;
+            origin = i * VID_REGION_CELLS;
+        }
+    }
+    if (origin < 0) {
+        // the region is aligned like the ones in VGA memory so SCREEN_REGION works the same
+        uint8_t *screen = page_alloc(VID_REGION_PAGES, VID_REGION_PAGES);
+        if (screen == NULL) {
+            page_free(state, PAGES_FOR(sizeof(terminal_state_t)));
+            spin_unlock_irqrestore(&terminal_lock, flags);
+            return NULL;
+        }
+        origin = (screen - (uint8_t *)VID_MEM) / 2;
+    }
+
+    keyboard_buffer_reset(&state->kb_buffer);
+    state->mode = 0;
+    state->mode_owner = NULL;
+    state->key_events.head = 0;
+    state->key_events.tail = 0;
+    state->cursor_x = 0;
+    state->cursor_y = 0;
+    state->origin = origin;
+    state->pinned = 0;
+    state->out.head = 0;
+    state->out.tail = 0;
+    state->out.esc_end = 0;
+    state->out.skip_end = 0;
+    state->out.skipping = 0;
+    ansi_init(&state->ansi);
+    scrollback_init(&state->history);
+    state->curr_pcb = NULL;
+
+    memset_word((uint16_t *)VID_MEM + origin, (state->ansi.attrib << 8) | ' ', VID_REGION_CELLS);
+
+    terminals[idx] = state;
+    spin_unlock_irqrestore(&terminal_lock, flags);
+    return state;
+}
 
 /* void terminal_init(void)
  * Inputs: None
- * Return Value: int32_t 0 or -1 for success or fail
- * Function: initializes terminal buffer
+ * Return Value: none
+ * Function: creates terminal 0 and shows it, the others are created when first used
  */
 void terminal_init(void) {
     int i;
-    for (i = 0; i < NUM_TERMINALS; i++) {
-        memset(terminals[i].kb_buffer.buf, 0, BUFFER_SIZE);
-        terminals[i].kb_buffer.idx = 0;
-        terminals[i].kb_buffer.data_available = 0;
-        terminals[i].cursor_x = 0;
-        terminals[i].cursor_y = 0;
-        terminals[i].rtc_interrupt_flag = 0;
-        terminals[i].rtc_interrupt_counter = 0;
-        terminals[i].curr_pcb = NULL;
+    for (i = 0; i < VGA_REGIONS; i++) {
+        vga_region_owner[i] = -1;
     }
 
-    set_screen_xy(&terminals[0].cursor_x, &terminals[0].cursor_y);
-    keyboard_set_buffer(&terminals[0].kb_buffer);
+    terminal_state_t *state = terminal_create(0);
+    set_screen_xy(&state->cursor_x, &state->cursor_y);
+    set_screen_origin(&state->origin);
+    set_screen_history(&state->history);
+    set_screen_ansi(&state->ansi);
+    set_screen_pinned(&state->pinned);
+    clear();
+    keyboard_set_buffer(&state->kb_buffer);
 }
 
-void terminal_switch(uint8_t idx) {
-    uint8_t old_terminal_idx = screen_terminal_idx;
-    uint8_t new_terminal_idx = idx;
+/* void terminal_set_count(uint32_t count)
+ * Inputs: uint32_t count - number of terminals asked for on the boot command line
+ * Return Value: none
+ * Function: sets how many terminals can be used, between 1 and MAX_TERMINALS. Called at boot
+ *           before the scheduler is set up.
+ */
+void terminal_set_count(uint32_t count) {
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_TERMINALS) {
+        count = MAX_TERMINALS;
+    }
+    terminal_count = count;
+}
 
-    if (new_terminal_idx >= NUM_TERMINALS) {
-        return;
+/* uint32_t terminal_video_page(uint8_t idx)
+ * Inputs: uint8_t idx - terminal index, of a created terminal
+ * Return Value: physical page (by index) the terminal's screen starts on after a clear
+ * Function: first page of the terminal's region of video memory, where vidmap points. It moves
+ *           when the terminal's screen trades places with another, see `terminal_switch`.
+ */
+uint32_t terminal_video_page(uint8_t idx) {
+    return (VID_MEM + SCREEN_REGION(terminals[idx]->origin) * 2) / FOURKB_BITS;
+}
+
+/* uint32_t terminal_visible_start(output_ring_t* out)
+ * Inputs: output_ring_t* out - pending output of a terminal
+ * Return Value: position in `out` from which drawing gives the same screen as drawing everything
+ * Function: finds the start of the line SCREEN_ROWS - 1 newlines before the end, everything before
+ *           it would scroll off. A backspace or an escape sequence can go back up a line or change
+ *           how later output is drawn, if there is one the whole output is drawn.
+ */
+static uint32_t terminal_visible_start(output_ring_t *out) {
+    if (out->esc_end - out->tail - 1 < out->head - out->tail) {
+        return out->tail;
+    }
+
+    uint32_t newlines = 0;
+    uint32_t pos;
+    for (pos = out->head; pos != out->tail; pos--) {
+        char c = out->buf[(pos - 1) & (TERMINAL_OUT_SIZE - 1)];
+        if (c == 0x08) {
+            return out->tail;
+        }
+        if ((c == '\n' || c == '\r') && ++newlines == SCREEN_ROWS) {
+            return pos;
+        }
+    }
+    return out->tail;
+}
+
+/* void terminal_render(uint8_t idx, unsigned long* flags)
+ * Inputs: uint8_t idx - terminal to draw
+ *         unsigned long* flags - flags saved when terminal_lock was taken
+ * Return Value: none
+ * Function: draws a terminal's pending output on its screen, up to what was written when it was
+ *           called. Output that would scroll off right away isn't drawn at all. Called with
+ *           terminal_lock held, which is dropped (and interrupts restored) between runs of at
+ *           most TERMINAL_WRITE_CHUNK bytes so a full buffer doesn't keep interrupts off for all
+ *           of it. Another CPU may render the same terminal meanwhile, the skip is kept in the
+ *           ring so only the one that finishes it clears the screen.
+ */
+static void terminal_render(uint8_t idx, unsigned long *flags) {
+    terminal_state_t *state = terminals[idx];
+    output_ring_t *out = &state->out;
+    uint32_t end = out->head;
+
+    // the output that would scroll off only goes to the history
+    if (!out->skipping) {
+        out->skip_end = terminal_visible_start(out);
+        out->skipping = out->skip_end != out->tail;
     }
 
-    cli();
+    // others may have drawn past `end` while the lock was dropped
+    while ((int32_t)(end - out->tail) > 0) {
+        // this CPU may be running another terminal, point its screen at this one for now
+        int *prev_screen_x = get_screen_x();
+        int *prev_screen_y = get_screen_y();
+        int *prev_screen_origin = get_screen_origin();
+        scrollback_t *prev_screen_history = get_screen_history();
+        ansi_state_t *prev_screen_ansi = get_screen_ansi();
+        int32_t *prev_screen_pinned = get_screen_pinned();
+        set_screen_xy(&state->cursor_x, &state->cursor_y);
+        set_screen_origin(&state->origin);
+        set_screen_history(&state->history);
+        set_screen_ansi(&state->ansi);
+        set_screen_pinned(&state->pinned);
+
+        if (out->skipping && out->skip_end == out->tail) {
+            clear();
+            out->skipping = 0;
+        }
 
-    // Copy video memmory to old terminal's video memory and copy new terminal's video memory to
-    // video memory.
-    uint32_t prev_base_address = page_table[VID_MEM_INDEX].base_address;
-    page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-    uservid_page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-    flush_tlb();
+        uint32_t pos = out->tail & (TERMINAL_OUT_SIZE - 1);
+        uint32_t len = (out->skipping ? out->skip_end : end) - out->tail;
+        if (len > TERMINAL_OUT_SIZE - pos) {
+            len = TERMINAL_OUT_SIZE - pos;
+        }
+        if (len > TERMINAL_WRITE_CHUNK) {
+            len = TERMINAL_WRITE_CHUNK;
+        }
 
-    memcpy((void *)(VID_MEM + ((old_terminal_idx + 1) * FOURKB_BITS)), (void *)VID_MEM,
-           FOURKB_BITS);
-    memcpy((void *)VID_MEM, (void *)(VID_MEM + ((new_terminal_idx + 1) * FOURKB_BITS)),
-           FOURKB_BITS);
+        if (out->skipping) {
+            scroll_past(out->buf + pos, len);
+            out->tail += len;
+        } else {
+            putbuf(out->buf + pos, len);
+            out->tail += len;
 
-    page_table[VID_MEM_INDEX].base_address = prev_base_address;
-    uservid_page_table[VID_MEM_INDEX].base_address = prev_base_address;
-    flush_tlb();
+            // the CRTC port writes are slow, move the hardware cursor once per run
+            sync_cursor();
+        }
 
-    // Set keyboard buffer and cursor to new terminal
-    terminal_state_t *new_terminal_state = terminal_get_state(new_terminal_idx);
-    keyboard_set_buffer(&new_terminal_state->kb_buffer);
-    set_screen_xy(&new_terminal_state->cursor_x, &new_terminal_state->cursor_y);
-    set_cursor(new_terminal_state->cursor_x, new_terminal_state->cursor_y);
+        set_screen_xy(prev_screen_x, prev_screen_y);
+        set_screen_origin(prev_screen_origin);
+        set_screen_history(prev_screen_history);
+        set_screen_ansi(prev_screen_ansi);
+        set_screen_pinned(prev_screen_pinned);
 
-    // Current process's terminal was on the screen but we're switching away
-    if (scheduler_terminal_idx == old_terminal_idx) {
-        page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX + (old_terminal_idx + 1);
-        uservid_page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX + (old_terminal_idx + 1);
-        flush_tlb();
+        spin_unlock_irqrestore(&terminal_lock, *flags);
+        spin_lock_irqsave(&terminal_lock, *flags);
     }
+}
 
-    // Current process's terminal was not on the screen but we're switching onto it
-    if (scheduler_terminal_idx == new_terminal_idx) {
-        page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
-        uservid_page_table[VID_MEM_INDEX].base_address = VID_MEM_INDEX;
+/* void terminal_sync(void)
+ * Inputs: None
+ * Return Value: none
+ * Function: draws the pending output of the terminal this CPU runs, before the kernel prints to
+ *           it directly
+ */
+void terminal_sync(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
 
-        flush_tlb();
+    int32_t idx = this_cpu()->terminal_idx;
+    if (idx >= 0) {
+        terminal_render(idx, &flags);
+    }
+
+    spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+/* void terminal_scroll_view(int32_t lines)
+ * Inputs: int32_t lines - lines to scroll the view back into the history, negative to go forward
+ * Return Value: none
+ * Function: shows the terminal on screen as it was some lines ago, drawn in a region of video
+ *           memory of its own so the live screen keeps being written meanwhile
+ */
+void terminal_scroll_view(int32_t lines) {
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
+    terminal_state_t *state = terminal_get_state(screen_terminal_idx);
+    int32_t back = (int32_t)view_lines + lines;
+    if (back > (int32_t)state->history.lines) {
+        back = state->history.lines;
+    }
+    if (back < 0) {
+        back = 0;
+    }
+    view_lines = back;
+
+    if (view_lines == 0) {
+        set_screen_start(state->origin);
+        set_cursor(state->cursor_x, state->cursor_y);
+    } else {
+        scrollback_render(&state->history, view_lines, (uint16_t *)VID_MEM + VIEW_ORIGIN,
+                          (uint16_t *)VID_MEM + state->origin, SCREEN_ROWS, SCREEN_COLS);
+        set_screen_start(VIEW_ORIGIN);
+        // keep the cursor on the row it is on in the live screen, off the view if it scrolled out
+        set_cursor(state->cursor_x, state->cursor_y + view_lines);
+    }
+
+    spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+/* void terminal_view_live(void)
+ * Inputs: None
+ * Return Value: none
+ * Function: goes back to the live screen if the view was scrolled back, e.g. when typing
+ */
+void terminal_view_live(void) {
+    if (view_lines != 0) {
+        terminal_scroll_view(-(int32_t)view_lines);
+    }
+}
+
+/* void terminal_swap_screens(uint8_t a, uint8_t b)
+ * Inputs: uint8_t a, b - created terminals
+ * Return Value: none
+ * Function: exchanges the regions of memory two terminals' screens are in, contents included. Each
+ *           screen keeps its place within the region. The processes running either terminal write
+ *           to it through vidmap, so their CPUs remap the page. Called with terminal_lock held.
+ */
+static void terminal_swap_screens(uint8_t a, uint8_t b) {
+    terminal_state_t *state_a = terminals[a];
+    terminal_state_t *state_b = terminals[b];
+    int region_a = SCREEN_REGION(state_a->origin);
+    int region_b = SCREEN_REGION(state_b->origin);
+
+    // two cells at a time
+    uint32_t *cells_a = (uint32_t *)((uint16_t *)VID_MEM + region_a);
+    uint32_t *cells_b = (uint32_t *)((uint16_t *)VID_MEM + region_b);
+    int i;
+    for (i = 0; i < VID_REGION_CELLS / 2; i++) {
+        uint32_t cells = cells_a[i];
+        cells_a[i] = cells_b[i];
+        cells_b[i] = cells;
+    }
+
+    state_a->origin += region_b - region_a;
+    state_b->origin += region_a - region_b;
+    if (region_a < VIEW_ORIGIN) {
+        vga_region_owner[region_a / VID_REGION_CELLS] = b;
+    }
+    if (region_b < VIEW_ORIGIN) {
+        vga_region_owner[region_b / VID_REGION_CELLS] = a;
+    }
+
+    // the CPUs pick up the new page with the TLB flush of the reschedule IPI
+    uint32_t self = smp_cpu_id();
+    for (i = 0; i < MAX_CPUS; i++) {
+        int32_t idx = cpus[i].terminal_idx;
+        if (!cpus[i].online || (idx != a && idx != b)) {
+            continue;
+        }
+        paging_map_video(i, terminal_video_page(idx));
+        if (i == self) {
+            flush_tlb();
+        } else {
+            smp_send_ipi(i, SMP_RESCHED_VEC);
+        }
+    }
+}
+
+/* void terminal_switch(uint8_t idx)
+ * Inputs: uint8_t idx - terminal to show
+ * Return Value: none
+ * Function: pans the display to the new terminal's screen, creating the terminal if it is the
+ *           first time it is used. Terminals whose screens are in VGA memory keep their contents
+ *           there, so nothing is copied or remapped. A screen in the page pool can't be shown,
+ *           so it trades places with the one on display. Output the terminal got in the
+ *           background is drawn first. A terminal's shell is only started once it is shown, and
+ *           only the terminal shown gets keyboard input.
+ */
+void terminal_switch(uint8_t idx) {
+    terminal_state_t *new_terminal_state = terminal_create(idx);
+    if (new_terminal_state == NULL) {
+        return;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
+    if (new_terminal_state->origin >= VIEW_ORIGIN) {
+        terminal_swap_screens(screen_terminal_idx, idx);
     }
 
     screen_terminal_idx = idx;
+    view_lines = 0;
+
+    // Show the new terminal, then draw what it got in the background and set its cursor
+    set_screen_start(new_terminal_state->origin);
+    terminal_render(idx, &flags);
+    if (screen_terminal_idx == idx) {
+        set_cursor(new_terminal_state->cursor_x, new_terminal_state->cursor_y);
+    }
 
-    sti();
+    spin_unlock_irqrestore(&terminal_lock, flags);
+
+    // its shell starts now if this is the first time, the scheduler lock goes before ours
+    scheduler_start_terminal(idx);
+}
+
+/* void terminal_key_event(uint8_t idx, const key_event_t* event)
+ * Inputs: uint8_t idx - raw mode terminal the key was typed in
+ *         const key_event_t* event - the key
+ * Return Value: none
+ * Function: queues a key for the terminal's reader and wakes it. Without TERMINAL_EVENTS only
+ *           presses that type a character are kept. Called by the keyboard bottom half.
+ */
+void terminal_key_event(uint8_t idx, const key_event_t *event) {
+    terminal_state_t *state = terminals[idx];
+    key_event_ring_t *ring = &state->key_events;
+
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+    if (!(state->mode & TERMINAL_EVENTS) && event->ascii == 0) {
+        spin_unlock_irqrestore(&terminal_lock, flags);
+        return;
+    }
+    if (ring->head - ring->tail < KEY_EVENTS_SIZE) {
+        ring->events[ring->head++ & (KEY_EVENTS_SIZE - 1)] = *event;
+    }
+    pcb_t *wake_pcb = state->curr_pcb;
+    spin_unlock_irqrestore(&terminal_lock, flags);
+
+    // the scheduler lock is taken before the terminal lock
+    scheduler_wake(wake_pcb);
+}
+
+/* void terminal_release_mode(pcb_t* pcb)
+ * Inputs: pcb_t* pcb - process that is exiting
+ * Return Value: none
+ * Function: puts the terminal back in canonical mode if the process had changed its mode, so a
+ *           program that dies in raw mode doesn't leave the shell without echo
+ */
+void terminal_release_mode(pcb_t *pcb) {
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
+    int i;
+    for (i = 0; i < terminal_count; i++) {
+        terminal_state_t *state = terminals[i];
+        if (state != NULL && state->mode_owner == pcb) {
+            state->mode = 0;
+            state->mode_owner = NULL;
+            state->key_events.tail = state->key_events.head;
+        }
+    }
+
+    spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+/* int32_t terminal_readable(terminal_state_t* state)
+ * Inputs: terminal_state_t* state - terminal to check
+ * Return Value: nonzero if a read would return something right away
+ * Function: a line was entered in canonical mode, or keys are queued in raw mode
+ */
+static int32_t terminal_readable(terminal_state_t *state) {
+    if (state->mode & TERMINAL_RAW) {
+        return state->key_events.head != state->key_events.tail;
+    }
+    return state->kb_buffer.lines_available;
+}
+
+/* int32_t terminal_read_raw(terminal_state_t* state, void* buf, int32_t nbytes)
+ * Inputs: terminal_state_t* state - raw mode terminal
+ *         void* buf - where to copy the keys
+ *         int32_t nbytes - size of buf
+ * Return Value: number of bytes copied
+ * Function: hands out the queued keys, as whole key_event_t records with TERMINAL_EVENTS or as
+ *           one character per key otherwise. Called with terminal_lock held.
+ */
+static int32_t terminal_read_raw(terminal_state_t *state, void *buf, int32_t nbytes) {
+    key_event_ring_t *ring = &state->key_events;
+    int32_t bytes_read = 0;
+
+    if (state->mode & TERMINAL_EVENTS) {
+        key_event_t *events = (key_event_t *)buf;
+        while (ring->tail != ring->head && bytes_read + (int32_t)sizeof(key_event_t) <= nbytes) {
+            *events++ = ring->events[ring->tail++ & (KEY_EVENTS_SIZE - 1)];
+            bytes_read += sizeof(key_event_t);
+        }
+    } else {
+        char *buf_char = (char *)buf;
+        while (ring->tail != ring->head && bytes_read < nbytes) {
+            buf_char[bytes_read++] = ring->events[ring->tail++ & (KEY_EVENTS_SIZE - 1)].ascii;
+        }
+    }
+    return bytes_read;
 }
 
 /* int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes)
  * Inputs: int32_t fd - file descriptor
            void* buf - buffer holding bytes
            int32_t nbytes - number of bytes able to be entered into buf
- * Return Value: int32_t of number of bytes written to buf
- * Function: keyboard presses and stores into buffer buf until enter is pressed
+ * Return Value: int32_t of number of bytes written to buf, 0 if there was nothing to read in
+ *               TERMINAL_NONBLOCK mode, -1 if buf can't hold a key event in TERMINAL_EVENTS mode
+ * Function: in canonical mode, waits until a line is entered and returns it, lines typed ahead
+ *           wait in the terminal's queue. In raw mode, waits for at least one key and returns
+ *           all the keys queued that fit.
  */
 int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
-    // Wait until enter key pressed.
-    uint8_t idx = scheduler_terminal_idx;
-    while (!terminals[idx].kb_buffer.data_available) {
+    // Sleep until there is something to read, the keyboard handler wakes us up.
+    uint8_t idx = this_cpu()->terminal_idx;
+    terminal_state_t *state = terminals[idx];
+
+    if ((state->mode & TERMINAL_EVENTS) && nbytes < (int32_t)sizeof(key_event_t)) {
+        return -1;
     }
 
     unsigned long flags;
-    cli_and_save(flags);
+    irq_save(flags);
+    while (!terminal_readable(state)) {
+        if (state->mode & TERMINAL_NONBLOCK) {
+            irq_restore(flags);
+            return 0;
+        }
+        scheduler_block();
+    }
 
+    // the keyboard handler may be filling the buffer on another CPU
+    spin_lock(&terminal_lock);
+
+    if (state->mode & TERMINAL_RAW) {
+        int32_t bytes_read = terminal_read_raw(state, buf, nbytes);
+        spin_unlock_irqrestore(&terminal_lock, flags);
+        return bytes_read;
+    }
+
+    // hand out the oldest entered line, what doesn't fit in buf is left for the next read
+    keyboard_buffer_t *kb = &state->kb_buffer;
     char *buf_char = (char *)buf;
 
-    int bytes_read;
-    for (bytes_read = 0; bytes_read < nbytes && bytes_read < BUFFER_SIZE; bytes_read++) {
-        if (terminals[idx].kb_buffer.buf[bytes_read] == '\n') {
+    int bytes_read = 0;
+    while (bytes_read < nbytes) {
+        char c = kb->queue[kb->tail++ & (INPUT_QUEUE_SIZE - 1)];
+        buf_char[bytes_read++] = c;
+        if (c == '\n') {
+            kb->lines_available--;
             break;
         }
-        buf_char[bytes_read] = terminals[idx].kb_buffer.buf[bytes_read];
     }
 
-    buf_char[bytes_read++] = '\n';
-
-    memset(terminals[idx].kb_buffer.buf, 0, BUFFER_SIZE);
-    terminals[idx].kb_buffer.idx = 0;
-    terminals[idx].kb_buffer.data_available = 0;
-
-    restore_flags(flags);
+    spin_unlock_irqrestore(&terminal_lock, flags);
     return bytes_read;
 }
 
@@ -127,8 +557,11 @@ int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
  * Inputs: int32_t fd - file descriptor
            void* buf - buffer holding bytes
            int32_t nbytes - number of bytes able to be entered into buf
- * Return Value: int32_t of number of bytes written to video memory
- * Function: outputs data from buf to video memory
+ * Return Value: int32_t of number of bytes written to the terminal
+ * Function: queues data from buf on the terminal's output buffer. The terminal on screen draws
+ *           it at the end of the write, the others only once their buffer fills up or they are
+ *           switched to, so flooding a hidden terminal mostly costs the copy. VT100 cursor,
+ *           erase and color sequences are interpreted when it is drawn, see `putbuf`.
  */
 int32_t terminal_write(int32_t fd, const void *buf, int32_t nbytes) {
     (void)fd;
@@ -138,14 +571,43 @@ int32_t terminal_write(int32_t fd, const void *buf, int32_t nbytes) {
         return -1;
     }
 
+    // Copy a chunk at a time so a long write doesn't keep interrupts off for all of it
     int bytes_written = 0;
-    int i;
-    for (i = 0; i < nbytes; i++) {
-        if (buf_char[i] != 0) {
-            putc(buf_char[i]);
-            bytes_written++;
+    int i = 0;
+    while (i < nbytes) {
+        unsigned long flags;
+        spin_lock_irqsave(&terminal_lock, flags);
+
+        // without a terminal (kernel tests) draw on this CPU's screen right away
+        int32_t idx = this_cpu()->terminal_idx;
+        int end = i + TERMINAL_WRITE_CHUNK < nbytes ? i + TERMINAL_WRITE_CHUNK : nbytes;
+        if (idx < 0) {
+            bytes_written += putbuf(buf_char + i, end - i);
+            sync_cursor();
+            i = end;
+            spin_unlock_irqrestore(&terminal_lock, flags);
+            continue;
         }
+
+        output_ring_t *out = &terminals[idx]->out;
+        for (; i < end && out->head - out->tail < TERMINAL_OUT_SIZE; i++) {
+            if (buf_char[i] != 0) {
+                out->buf[out->head++ & (TERMINAL_OUT_SIZE - 1)] = buf_char[i];
+                bytes_written++;
+                if (buf_char[i] == 0x1B) {
+                    out->esc_end = out->head;
+                }
+            }
+        }
+
+        if (out->head - out->tail == TERMINAL_OUT_SIZE ||
+            (i == nbytes && idx == screen_terminal_idx)) {
+            terminal_render(idx, &flags);
+        }
+
+        spin_unlock_irqrestore(&terminal_lock, flags);
     }
+
     return bytes_written;
 }
 
@@ -163,12 +625,56 @@ int32_t terminal_open(const uint8_t *filename) { return -1; }
  */
 int32_t terminal_close(int32_t fd) { return -1; }
 
+/* int32_t terminal_ioctl(int32_t fd, uint32_t request, uint32_t arg)
+ * Inputs: int32_t fd - file descriptor
+ *         uint32_t request - TERMINAL_GET_MODE, TERMINAL_SET_MODE or TERMINAL_SET_KEYMAP
+ *         uint32_t arg - TERMINAL_* flags for TERMINAL_SET_MODE, index of the keyboard layout
+ *                        for TERMINAL_SET_KEYMAP
+ * Return Value: the mode for TERMINAL_GET_MODE, 0 for the others, -1 for a bad request
+ * Function: reads or changes the line discipline of the caller's terminal. Changing between
+ *           canonical and raw mode drops the input typed so far. The mode goes back to canonical
+ *           when the process that set it halts.
+ */
+int32_t terminal_ioctl(int32_t fd, uint32_t request, uint32_t arg) {
+    (void)fd;
+
+    int32_t idx = this_cpu()->terminal_idx;
+    if (idx < 0) {
+        return -1;
+    }
+    terminal_state_t *state = terminals[idx];
+
+    if (request == TERMINAL_GET_MODE) {
+        return state->mode;
+    }
+    if (request == TERMINAL_SET_KEYMAP) {
+        return keyboard_set_keymap(arg);
+    }
+    if (request != TERMINAL_SET_MODE || (arg & ~TERMINAL_MODE_MASK)) {
+        return -1;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&terminal_lock, flags);
+
+    if ((arg ^ state->mode) & (TERMINAL_RAW | TERMINAL_EVENTS)) {
+        keyboard_buffer_reset(&state->kb_buffer);
+        state->key_events.tail = state->key_events.head;
+    }
+    state->mode = arg;
+    state->mode_owner = arg ? get_scheduler_pcb() : NULL;
+
+    spin_unlock_irqrestore(&terminal_lock, flags);
+    return 0;
+}
+
 func_pt_t make_stdin_fops(void) {
     func_pt_t f;
     f.open = terminal_open;
     f.close = terminal_close;
     f.read = terminal_read;
     f.write = NULL;
+    f.ioctl = terminal_ioctl;
     return f;
 }
 
@@ -178,5 +684,6 @@ func_pt_t make_stdout_fops(void) {
     f.close = terminal_close;
     f.read = NULL;
     f.write = terminal_write;
+    f.ioctl = terminal_ioctl;
     return f;
 }
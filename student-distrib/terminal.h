@@ -3,23 +3,121 @@
 
 #include "file_system.h"
 #include "keyboard.h"
+#include "lib.h"
+#include "paging.h"
+#include "scrollback.h"
+#include "spinlock.h"
 #include "syscall.h"
 #include "types.h"
 
-#define NUM_TERMINALS 3
+/* Most terminals a boot can ask for, one per Alt+F key. Each one keeps a process for its shell
+ * (see `execute`) and one is left for the programs the shells run. The scheduler's run queues hold
+ * a bit per terminal. */
+#define MAX_TERMINALS (MAXPIDS - 1)
+
+/* Terminals when the boot command line doesn't set `terminals=` */
+#define DEFAULT_TERMINALS 3
+
+/* Regions of VGA text memory terminals' screens can be in, the screens of any more terminals go in
+ * pages of the pool until they are shown */
+#define VGA_REGIONS (VID_MEM_PAGES / VID_REGION_PAGES - 1)
+
+/* Bytes `terminal_write` copies into the output buffer, and a render draws, per hold of
+ * terminal_lock. */
+#define TERMINAL_WRITE_CHUNK 128
+
+/* Bytes of output a terminal holds before it has to be drawn, a power of two. */
+#define TERMINAL_OUT_SIZE 4096
+
+/* Line discipline mode flags, see `terminal_ioctl`. The default (0) is canonical mode: input is
+ * echoed and edited a line at a time and reads block until Enter. */
+/* Keys go to the reader as they are pressed, without echo or line editing. */
+#define TERMINAL_RAW 0x1
+/* Reads return 0 instead of blocking when there is nothing to read. */
+#define TERMINAL_NONBLOCK 0x2
+/* Raw reads return key_event_t records for every press and release instead of characters. */
+#define TERMINAL_EVENTS 0x4
+#define TERMINAL_MODE_MASK 0x7
+
+/* `terminal_ioctl` requests */
+#define TERMINAL_GET_MODE 1
+#define TERMINAL_SET_MODE 2
+#define TERMINAL_SET_KEYMAP 3
+
+/* Modifiers held during a key event */
+#define KEY_MOD_SHIFT 0x1
+#define KEY_MOD_CTRL 0x2
+#define KEY_MOD_ALT 0x4
+#define KEY_MOD_CAPS 0x8
+
+/* A key press or release as raw mode hands it to the reader. */
+typedef struct key_event {
+    /* rdtsc when the keyboard interrupt came in. */
+    uint64_t tsc;
+    /* Set 1 scancode, 0x80 set for a release, and whether the 0xE0 prefix came before it. */
+    uint8_t scancode;
+    uint8_t extended;
+    /* Character a press types with the modifiers held, 0 for none or a release. */
+    uint8_t ascii;
+    /* KEY_MOD_* flags. */
+    uint8_t modifiers;
+    /* What the key decodes to in the current keymap, a character or a KEY_* value. */
+    uint16_t key;
+} key_event_t;
+
+/* Key events a raw mode terminal holds for its reader, a power of two. */
+#define KEY_EVENTS_SIZE 64
+
+/* Key events waiting for a raw mode reader, newer ones are dropped when it is full. */
+typedef struct key_event_ring {
+    key_event_t events[KEY_EVENTS_SIZE];
+    /* Free-running write and read positions. */
+    uint32_t head;
+    uint32_t tail;
+} key_event_ring_t;
+
+/* Output written to a terminal and not drawn on its screen yet. */
+typedef struct output_ring {
+    char buf[TERMINAL_OUT_SIZE];
+    /* Free-running write and read positions, `head - tail` bytes are pending. */
+    uint32_t head;
+    uint32_t tail;
+    /* Position just after the last escape character written, see `terminal_visible_start`. */
+    uint32_t esc_end;
+    /* While set, a render is scrolling the output before `skip_end` past without drawing it,
+     * and whoever reaches `skip_end` clears the screen. */
+    int32_t skipping;
+    uint32_t skip_end;
+} output_ring_t;
 
 /* State specific to a terminal. */
 typedef struct terminal_state {
     /* Buffer containing keyboard text. */
     keyboard_buffer_t kb_buffer;
+    /* TERMINAL_* line discipline flags, and the process that set them. */
+    uint32_t mode;
+    pcb_t *mode_owner;
+    /* Keys waiting for a reader in raw mode. */
+    key_event_ring_t key_events;
 
     /* Coordinate of cursor on screen. */
     int cursor_x;
     int cursor_y;
+    /* Cell the screen starts at, counted from the start of VGA text memory. It moves through the
+     * terminal's region of VID_REGION_CELLS cells as it scrolls. The region is in VGA memory, or
+     * in the page pool for a terminal whose screen doesn't fit there, see `terminal_switch`. */
+    int origin;
+    /* Set while the process running the terminal has its screen mapped with vidmap, which maps
+     * the start of the region, so the screen stops moving through it. */
+    int32_t pinned;
+
+    /* Output waiting to be drawn, see `terminal_write`. */
+    output_ring_t out;
+    /* Escape sequence being read from the output and attribute it is drawn with. */
+    ansi_state_t ansi;
 
-    /* RTC flag/counter */
-    volatile uint8_t rtc_interrupt_flag;
-    volatile uint32_t rtc_interrupt_counter;
+    /* Lines that scrolled off the top of the screen. */
+    scrollback_t history;
 
     /* Pointer to this terminal's curernt process's PCB. */
     pcb_t *curr_pcb;
@@ -28,16 +126,36 @@ typedef struct terminal_state {
 /* Index of the terminal currently shown on screen. */
 extern uint8_t screen_terminal_idx;
 
+/* Number of terminals that can be switched to, set at boot. */
+extern uint8_t terminal_count;
+
+/* Protects the screens, the display start and the keyboard buffers between CPUs. Taken after
+ * sched_lock when both are needed. */
+extern spinlock_t terminal_lock;
+
 extern terminal_state_t *terminal_get_state(uint8_t idx);
+extern terminal_state_t *terminal_create(uint8_t idx);
 
 extern void terminal_init(void);
+extern void terminal_set_count(uint32_t count);
+
+extern uint32_t terminal_video_page(uint8_t idx);
 
 extern void terminal_switch(uint8_t idx);
 
+extern void terminal_sync(void);
+
+extern void terminal_scroll_view(int32_t lines);
+extern void terminal_view_live(void);
+
+extern void terminal_key_event(uint8_t idx, const key_event_t *event);
+extern void terminal_release_mode(pcb_t *pcb);
+
 extern int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes);
 extern int32_t terminal_write(int32_t fd, const void *buf, int32_t nbytes);
 extern int32_t terminal_open(const uint8_t *filename);
 extern int32_t terminal_close(int32_t fd);
+extern int32_t terminal_ioctl(int32_t fd, uint32_t request, uint32_t arg);
 
 extern func_pt_t make_stdin_fops(void);
 extern func_pt_t make_stdout_fops(void);
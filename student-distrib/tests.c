@@ -1,10 +1,22 @@
 #include "tests.h"
 
+#include "clock.h"
 #include "file_system.h"
+#include "irqtrace.h"
 #include "keyboard.h"
+#include "keymap.h"
+#include "lapic.h"
 #include "lib.h"
+#include "page_alloc.h"
+#include "paging.h"
+#include "pit.h"
 #include "rtc.h"
+#include "scheduling.h"
+#include "scrollback.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "terminal.h"
+#include "timer.h"
 #include "x86_desc.h"
 
 #define PASS 1
@@ -403,6 +415,1140 @@ int rtc_driver_test() {
     return PASS;
 }
 
+/* RTC Virtual Timer Test
+ *
+ * Queues timers at three rates and feeds the RTC interrupts by hand, checking only the timers
+ * that are due fire, that a re-armed timer keeps its phase and that the RTC runs only as fast as
+ * the armed timers need
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: per-fd RTC timers, deadline heap, adaptive RTC rate
+ * Files: rtc.h/c
+ */
+int rtc_vtimer_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    rtc_vtimer_t fast = {1, 0, 0, -1, 0, NULL};
+    rtc_vtimer_t mid = {4, 0, 0, -1, 0, NULL};
+    rtc_vtimer_t slow = {512, 0, 0, -1, 0, NULL};
+
+    // the real interrupt only comes to this CPU
+    unsigned long flags;
+    irq_save(flags);
+
+    rtc_vtimer_arm(&slow, NULL);
+    rtc_vtimer_arm(&mid, NULL);
+    rtc_vtimer_arm(&fast, NULL);
+
+    rtc_tick();
+    if (!fast.fired || mid.fired || slow.fired || fast.heap_idx != -1) {
+        result = FAIL;
+    }
+
+    rtc_tick();
+    rtc_tick();
+    if (mid.fired) {
+        result = FAIL;
+    }
+    rtc_tick();
+    if (!mid.fired || slow.fired) {
+        result = FAIL;
+    }
+
+    // the ticks without a reader are skipped, the next one is a period after the last
+    rtc_vtimer_arm(&fast, NULL);
+    rtc_tick();
+    if (!fast.fired) {
+        result = FAIL;
+    }
+
+    // the RTC runs as fast as the fastest armed timer, and stops with none
+    if (rtc_hw_frequency() != 1024) {
+        result = FAIL;
+    }
+    rtc_vtimer_release(&fast);
+    if (rtc_hw_frequency() != 256) {
+        result = FAIL;
+    }
+    rtc_vtimer_release(&mid);
+    if (rtc_hw_frequency() != 2) {
+        result = FAIL;
+    }
+    rtc_vtimer_release(&slow);
+    if (slow.heap_idx != -1 || rtc_hw_frequency() != 0) {
+        result = FAIL;
+    }
+
+    irq_restore(flags);
+    return result;
+}
+
+/* 2020-01-01 00:00 UTC, every RTC this boots on is set later */
+#define CLOCK_TEST_EPOCH 1577836800
+
+/* Clock Test
+ *
+ * Checks the 64-bit division, that the monotonic clock goes forward and measures 10 ticks of PIT
+ * channel 2 (which doesn't depend on the TSC calibration) as 100 ms, and that the wall clock is a
+ * plausible date
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: clocksource conversion, RTC date read
+ * Files: clock.h/c, pit.h/c, rtc.c
+ */
+int clock_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    uint32_t rem;
+
+    if (div64_32(12345678901234ULL, NS_PER_SEC, &rem) != 12345 || rem != 678901234) {
+        result = FAIL;
+    }
+
+    // a tick at a time, the counter is 16 bits. Interrupts off so only the count is timed.
+    unsigned long flags;
+    irq_save(flags);
+    uint64_t start = clock_monotonic_ns();
+    uint64_t elapsed = 0;
+    int i;
+    for (i = 0; i < 10; i++) {
+        pit_ch2_start(PIT_RATE);
+        uint64_t shot = clock_monotonic_ns();
+        while (!pit_ch2_done()) {
+        }
+        elapsed += clock_monotonic_ns() - shot;
+    }
+    pit_ch2_stop();
+    irq_restore(flags);
+
+    if (elapsed < 99000000 || elapsed > 101000000) {
+        printf("%s clock: 10 ticks took %u us\n", clock_source()->name,
+               (uint32_t)div64_32(elapsed, 1000, NULL));
+        result = FAIL;
+    }
+
+    if (clock_monotonic_ns() < start + elapsed) {
+        result = FAIL;
+    }
+
+    if (div64_32(clock_realtime_ns(), NS_PER_SEC, NULL) < CLOCK_TEST_EPOCH) {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* Time Page Test
+ *
+ * Reads the time page through its user mapping, and moves its base to check that the clock
+ * doesn't go back across an update
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: time page mapping and seqlock updates
+ * Files: clock.h/c, paging.c
+ */
+int time_page_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    const clock_page_t *page = (const clock_page_t *)USER_TIME_PAGE;
+
+    unsigned long flags;
+    irq_save(flags);
+
+    uint32_t seq = page->seq;
+    if ((seq & 1) || page->tsc_counts != pit_tsc_counts || page->ticks > pit_ticks ||
+        page->mult != clock_source()->mult) {
+        result = FAIL;
+    }
+
+    uint32_t ticks = pit_ticks;
+    uint64_t before = clock_monotonic_ns();
+    clock_tick(ticks);
+    uint64_t after = clock_monotonic_ns();
+    if (page->seq != seq + 2 || page->ticks != ticks || after < before) {
+        result = FAIL;
+    }
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Timer callback for timer_wheel_test, should never run */
+static void timer_test_callback(uint32_t data) { (void)data; }
+
+/* Timer Wheel Test
+ *
+ * Arms timers spread over every level of the wheel, cancels half of them and checks the
+ * pending count and next expiry along the way
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None, all timers are cancelled before returning
+ * Coverage: timer wheel insert/cancel/next expiry
+ * Files: timer.h/c
+ */
+int timer_wheel_test() {
+    TEST_HEADER;
+
+    static timer_t timers[64];
+    int result = PASS;
+    uint32_t base = timer_count();
+    int i;
+
+    // delays from 1000 ticks (first level wrap) up to ~2^27 ticks (top level)
+    for (i = 0; i < 64; i++) {
+        timer_setup(&timers[i], timer_test_callback, i);
+        timer_add(&timers[i], 1000 + (i << 21));
+    }
+
+    if (timer_count() != base + 64) {
+        result = FAIL;
+    }
+    if (timer_next_expiry() > 1000) {
+        result = FAIL;
+    }
+
+    for (i = 0; i < 64; i += 2) {
+        if (timer_cancel(&timers[i]) != 1 || timer_pending(&timers[i])) {
+            result = FAIL;
+        }
+    }
+    if (timer_cancel(&timers[0]) != 0 || timer_count() != base + 32) {
+        result = FAIL;
+    }
+
+    for (i = 1; i < 64; i += 2) {
+        timer_cancel(&timers[i]);
+    }
+    if (timer_count() != base) {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* Real-Time Admission Test
+ *
+ * Admits two real-time reservations, checks that one pushing the utilization over the bound and
+ * invalid budgets are refused, then returns both processes to best-effort
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None, both reservations are released before returning
+ * Coverage: EDF admission control and period timers
+ * Files: scheduling.h/c
+ */
+int rt_admission_test() {
+    TEST_HEADER;
+
+    static pcb_t a, b;
+    int result = PASS;
+    uint32_t base = timer_count();
+
+    if (scheduler_set_rt(&a, 10, 5) != 0 || scheduler_set_rt(&b, 10, 4) != 0) {
+        result = FAIL;
+    }
+    if (timer_count() != base + 2) {
+        result = FAIL;
+    }
+
+    // 50% + 50% is over the bound, 50% + 40% is fine, and changing a reservation only counts
+    // the difference
+    if (scheduler_set_rt(&b, 10, 5) != -1 || b.rt.budget != 4) {
+        result = FAIL;
+    }
+    if (scheduler_set_rt(&a, 20, 10) != 0) {
+        result = FAIL;
+    }
+    if (scheduler_set_rt(&a, 10, 0) != -1 || scheduler_set_rt(&a, 10, 11) != -1) {
+        result = FAIL;
+    }
+
+    // a long full reservation is still 100%, and a period past the timer range is refused
+    if (scheduler_set_rt(&a, 50000000, 50000000) != -1 || a.rt.period != 20 ||
+        scheduler_set_rt(&a, TIMER_MAX_TICKS + 1, 1) != -1) {
+        result = FAIL;
+    }
+
+    if (scheduler_set_rt(&a, 0, 0) != 0 || scheduler_set_rt(&b, 0, 0) != 0) {
+        result = FAIL;
+    }
+    if (timer_count() != base || a.rt.period != 0) {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* SMP Test
+ *
+ * Checks the spinlock and that the tests run on the bootstrap processor, which is online
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: spinlocks, CPU identification
+ * Files: spinlock.h, smp.h/c
+ */
+int smp_test() {
+    TEST_HEADER;
+
+    spinlock_t lock = SPINLOCK_INIT;
+    int result = PASS;
+
+    spin_lock(&lock);
+    if (!lock.locked || xchg(&lock.locked, 1) != 1) {
+        result = FAIL;
+    }
+    spin_unlock(&lock);
+    if (lock.locked) {
+        result = FAIL;
+    }
+
+    if (smp_cpu_id() != 0 || !this_cpu()->online) {
+        result = FAIL;
+    }
+    if (smp_num_cpus < 1 || smp_num_cpus > MAX_CPUS) {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* Local APIC Timer Test
+ *
+ * Checks that the calibrated local APIC timer of this CPU is running periodically: its count
+ * stays within one tick and reloads when it reaches 0. It may only be stopped while this CPU
+ * doesn't need a tick.
+ * Inputs: None
+ * Outputs: PASS/FAIL, PASS right away when the PIT is the scheduling clock
+ * Side Effects: None
+ * Coverage: local APIC timer calibration and setup
+ * Files: lapic.h/c, pit.h/c
+ */
+int lapic_timer_test() {
+    TEST_HEADER;
+
+    if (pit_lapic_counts == 0) {
+        return PASS;
+    }
+
+    uint32_t prev = lapic_timer_current();
+    if (prev == 0 && !scheduler_cpu_needs_tick(smp_cpu_id())) {
+        return PASS;
+    }
+    if (prev == 0 || prev > pit_lapic_counts) {
+        return FAIL;
+    }
+
+    // a count going up again means the timer reloaded, which takes at most a tick (10ms)
+    int i;
+    for (i = 0; i < 1000000; i++) {
+        uint32_t count = lapic_timer_current();
+        if (count > prev) {
+            return PASS;
+        }
+        prev = count;
+    }
+
+    return FAIL;
+}
+
+/* Scheduler Trace Test
+ *
+ * Takes the scheduler histograms and checks each is consistent: the buckets add up to the count
+ * and the largest value falls in the highest bucket used. A process's own histograms are copied
+ * with them and cleared by a reset.
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Clears the histograms
+ * Coverage: wakeup latency, run time and context switch tracing, globally and per process
+ * Files: scheduling.h/c
+ */
+int sched_trace_test() {
+    TEST_HEADER;
+
+    static sched_trace_t trace;
+    static pcb_t pcb;
+    memset(&pcb.trace, 0, sizeof(pcb.trace));
+    pcb.trace.run_time.count = 1;
+    pcb.trace.run_time.buckets[0] = 1;
+    pcb.trace.voluntary_switches = 1;
+
+    scheduler_get_trace(&pcb, &trace, 1);
+    if (trace.task.run_time.count != 1 || trace.task.voluntary_switches != 1 ||
+        pcb.trace.run_time.count != 0 || pcb.trace.voluntary_switches != 0) {
+        return FAIL;
+    }
+    scheduler_get_trace(&pcb, &trace, 0);
+
+    sched_hist_t *hists[] = {&trace.wakeup_latency,      &trace.run_time,
+                             &trace.pick_cycles,         &trace.switch_cycles,
+                             &trace.task.wakeup_latency, &trace.task.run_time};
+    int h;
+    for (h = 0; h < sizeof(hists) / sizeof(hists[0]); h++) {
+        uint32_t sum = 0;
+        int32_t top = -1;
+        int i;
+        for (i = 0; i < SCHED_HIST_BUCKETS; i++) {
+            sum += hists[h]->buckets[i];
+            if (hists[h]->buckets[i] != 0) {
+                top = i;
+            }
+        }
+
+        if (sum != hists[h]->count) {
+            return FAIL;
+        }
+        if (top > 0 && (hists[h]->max_cycles >> top) != 1) {
+            return FAIL;
+        }
+    }
+
+    return PASS;
+}
+
+/* Terminal Write Benchmark
+ *
+ * Prints 4KB of text (64 character lines) once a character at a time with putc and once with the
+ * bulk putbuf path, and reports the characters per million cycles of both
+ * Inputs: None
+ * Outputs: PASS if the bulk path is faster, FAIL otherwise. Timing under emulation or on a
+ *          loaded host varies, so it is only run by hand from `launch_tests`.
+ * Side Effects: Fills the screen
+ * Coverage: putbuf run rendering, batched scrolling and the single cursor update
+ * Files: lib.h/c, terminal.c
+ */
+int terminal_write_bench() {
+    TEST_HEADER;
+
+    static int8_t text[FOURKB_BITS];
+    int i;
+    for (i = 0; i < FOURKB_BITS; i++) {
+        text[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 26);
+    }
+
+    unsigned long flags;
+    irq_save(flags);
+
+    uint64_t start = rdtsc();
+    for (i = 0; i < FOURKB_BITS; i++) {
+        putc(text[i]);
+    }
+    uint32_t putc_cycles = (uint32_t)(rdtsc() - start);
+
+    start = rdtsc();
+    putbuf(text, FOURKB_BITS);
+    sync_cursor();
+    uint32_t putbuf_cycles = (uint32_t)(rdtsc() - start);
+
+    irq_restore(flags);
+
+    printf("putc: %d chars/Mcycle, putbuf: %d chars/Mcycle\n",
+           FOURKB_BITS * 1000 / (putc_cycles / 1000 + 1),
+           FOURKB_BITS * 1000 / (putbuf_cycles / 1000 + 1));
+
+    return putbuf_cycles < putc_cycles ? PASS : FAIL;
+}
+
+/* Scroll Panning Test
+ *
+ * Prints more lines than fit on the screen and checks the display was panned down a line per
+ * scroll instead of copied, with the text still lined up at the new start, then scrolls through
+ * the end of the terminal's region of video memory to check the wraparound copy, and that a
+ * pinned screen isn't panned
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Clears the screen
+ * Coverage: CRTC start address scrolling
+ * Files: lib.h/c
+ */
+int scroll_pan_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    int *origin = get_screen_origin();
+    int region = *origin & ~(VID_REGION_CELLS - 1);
+    int i;
+
+    unsigned long flags;
+    irq_save(flags);
+
+    clear();
+    for (i = 0; i < 30; i++) {
+        putbuf("x\n", 2);
+    }
+
+    // 25 rows, so the last 6 newlines scrolled and the top row shows the 7th line
+    if (*origin != region + 6 * 80 || *(uint8_t *)(VID_MEM + *origin * 2) != 'x') {
+        result = FAIL;
+    }
+
+    // the region holds 51 lines, the origin wraps back to its start before running out
+    for (i = 0; i < 100; i++) {
+        putbuf("y\n", 2);
+    }
+    if (*origin < region || *origin + 25 * 80 > region + VID_REGION_CELLS ||
+        *(uint8_t *)(VID_MEM + (*origin + 23 * 80) * 2) != 'y') {
+        result = FAIL;
+    }
+
+    clear();
+    if (*origin != region) {
+        result = FAIL;
+    }
+
+    // a pinned screen (mapped by vidmap) copies instead, staying at the start of its region
+    int32_t pinned = 1;
+    int32_t *prev_pinned = get_screen_pinned();
+    set_screen_pinned(&pinned);
+    for (i = 0; i < 30; i++) {
+        putbuf("z\n", 2);
+    }
+    if (*origin != region || *(uint8_t *)(VID_MEM + (*origin + 23 * 80) * 2) != 'z') {
+        result = FAIL;
+    }
+    set_screen_pinned(prev_pinned);
+    clear();
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Lazy Shell Test
+ *
+ * Checks the last terminal wasn't created, started or queued (and so has no shell) before it is
+ * first shown, and is created, queued and given its shell when switched to
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Starts the last terminal's shell, ends on terminal 0
+ * Coverage: terminals started on first switch
+ * Files: terminal.h/c, scheduling.h/c
+ */
+int lazy_shell_test() {
+    TEST_HEADER;
+
+    if (terminal_count < 2) {
+        return PASS;
+    }
+
+    int result = PASS;
+    uint8_t idx = terminal_count - 1;
+    if (terminal_get_state(idx) != NULL || scheduler_terminal_started(idx) ||
+        scheduler_terminal_queued(idx)) {
+        result = FAIL;
+    }
+
+    terminal_switch(idx);
+    terminal_state_t *state = terminal_get_state(idx);
+    if (state == NULL || screen_terminal_idx != idx || !scheduler_terminal_started(idx) ||
+        !scheduler_terminal_queued(idx)) {
+        terminal_switch(0);
+        return FAIL;
+    }
+
+    // the shell launches on the next quantum of whichever CPU picks the terminal up
+    uint32_t start = pit_ticks;
+    while (state->curr_pcb == NULL && pit_ticks - start < PIT_HZ) {
+        asm volatile("pause");
+    }
+    if (state->curr_pcb == NULL) {
+        result = FAIL;
+    }
+
+    terminal_switch(0);
+    return result;
+}
+
+/* Terminal Switch Test
+ *
+ * Switches to every terminal twice, creating them, checking each one is shown from the VGA window
+ * and that the screens keep their contents even when they had to trade places
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Creates every terminal, ends on terminal 0
+ * Coverage: page-flipped terminal switching, terminals created on demand
+ * Files: terminal.h/c, lib.h/c
+ */
+int terminal_switch_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    uint16_t cells[MAX_TERMINALS];
+    int i;
+    for (i = 0; i < terminal_count; i++) {
+        terminal_switch(i);
+        terminal_state_t *state = terminal_get_state(i);
+        if (state == NULL) {
+            return FAIL;
+        }
+        cells[i] = *(uint16_t *)(VID_MEM + state->origin * 2);
+    }
+
+    // the screens shown are in the VGA window and their contents followed them
+    for (i = 0; i < terminal_count; i++) {
+        terminal_switch(i);
+        terminal_state_t *state = terminal_get_state(i);
+        if (screen_terminal_idx != i || terminal_video_page(i) < VID_MEM_INDEX ||
+            terminal_video_page(i) >= VID_MEM_INDEX + VID_MEM_PAGES ||
+            *(uint16_t *)(VID_MEM + state->origin * 2) != cells[i]) {
+            result = FAIL;
+        }
+    }
+
+    if (terminal_create(terminal_count) != NULL) {
+        result = FAIL;
+    }
+
+    terminal_switch(0);
+    return result;
+}
+
+/* Pool Terminal Test
+ *
+ * With more terminals than regions of VGA memory (boot with `terminals=` above VGA_REGIONS),
+ * switches onto the terminal whose screen is in the page pool and back, checking the screens
+ * trade places with their contents
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Creates every terminal and starts the last one's shell, ends on terminal 0
+ * Coverage: terminal screens in the page pool, screen swapping on switch
+ * Files: terminal.h/c, page_alloc.h/c
+ */
+int terminal_pool_test() {
+    TEST_HEADER;
+
+    if (terminal_count <= VGA_REGIONS) {
+        // every terminal fits in VGA memory
+        return PASS;
+    }
+
+    // the others take the VGA regions first
+    int result = PASS;
+    uint8_t idx = terminal_count - 1;
+    int i;
+    for (i = 0; i < idx; i++) {
+        if (terminal_create(i) == NULL) {
+            return FAIL;
+        }
+    }
+    terminal_switch(0);
+    terminal_state_t *home = terminal_get_state(0);
+    terminal_state_t *pool = terminal_create(idx);
+    if (pool == NULL) {
+        return FAIL;
+    }
+
+    // the cell after the visible screen stays put while the shells print their first lines
+    uint16_t *home_cell = (uint16_t *)VID_MEM + home->origin + 80 * 25;
+    uint16_t *pool_cell = (uint16_t *)VID_MEM + pool->origin + 80 * 25;
+    *home_cell = (0x07 << 8) | 'h';
+    *pool_cell = (0x07 << 8) | 'p';
+    if (terminal_video_page(idx) < VID_MEM_INDEX + VID_MEM_PAGES) {
+        result = FAIL;
+    }
+
+    terminal_switch(idx);
+    home_cell = (uint16_t *)VID_MEM + home->origin + 80 * 25;
+    pool_cell = (uint16_t *)VID_MEM + pool->origin + 80 * 25;
+    if (screen_terminal_idx != idx || terminal_video_page(idx) < VID_MEM_INDEX ||
+        terminal_video_page(idx) >= VID_MEM_INDEX + VID_MEM_PAGES ||
+        terminal_video_page(0) < VID_MEM_INDEX + VID_MEM_PAGES ||
+        *home_cell != ((0x07 << 8) | 'h') || *pool_cell != ((0x07 << 8) | 'p')) {
+        result = FAIL;
+    }
+
+    terminal_switch(0);
+    home_cell = (uint16_t *)VID_MEM + home->origin + 80 * 25;
+    pool_cell = (uint16_t *)VID_MEM + pool->origin + 80 * 25;
+    if (screen_terminal_idx != 0 || terminal_video_page(idx) < VID_MEM_INDEX + VID_MEM_PAGES ||
+        terminal_video_page(0) >= VID_MEM_INDEX + VID_MEM_PAGES ||
+        *home_cell != ((0x07 << 8) | 'h') || *pool_cell != ((0x07 << 8) | 'p')) {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* Page Pool Test
+ *
+ * Takes pages from the pool and gives them back, checking alignment and bounds
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: page allocator
+ * Files: page_alloc.h/c
+ */
+int page_alloc_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    uint32_t a = (uint32_t)page_alloc(VID_REGION_PAGES, VID_REGION_PAGES);
+    uint32_t b = (uint32_t)page_alloc(1, 1);
+    if (a == 0 || b == 0 || a % (VID_REGION_PAGES * FOURKB_BITS) != 0) {
+        result = FAIL;
+    }
+    if (a < PAGE_POOL_START || a + VID_REGION_PAGES * FOURKB_BITS > PAGE_POOL_END ||
+        b < PAGE_POOL_START || b + FOURKB_BITS > PAGE_POOL_END) {
+        result = FAIL;
+    }
+    if (b >= a && b < a + VID_REGION_PAGES * FOURKB_BITS) {
+        result = FAIL;
+    }
+
+    // the pages are mapped, kernel only
+    if (result == PASS) {
+        *(uint32_t *)a = 0x391;
+        *(uint32_t *)b = 0x391;
+    }
+
+    if (page_alloc(PAGE_POOL_PAGES + 1, 1) != NULL) {
+        result = FAIL;
+    }
+
+    if (a != 0) {
+        page_free((void *)a, VID_REGION_PAGES);
+    }
+    if (b != 0) {
+        page_free((void *)b, 1);
+    }
+    return result;
+}
+
+/* Deferred Output Test
+ *
+ * Writes to a background terminal and checks the output is only queued, then draws it and checks
+ * it was drawn, with the lines that scrolled off skipped
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Creates terminal 1 (without starting its shell) and fills its screen
+ * Coverage: terminal output buffers and coalesced rendering
+ * Files: terminal.h/c
+ */
+int terminal_output_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    terminal_state_t *state = terminal_create(1);
+    if (state == NULL) {
+        return PASS;
+    }
+
+    unsigned long flags;
+    irq_save(flags);
+
+    // pretend to be a process on terminal 1
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = 1;
+
+    int i;
+    for (i = 0; i < 100; i++) {
+        terminal_write(1, "line\n", 5);
+    }
+    terminal_write(1, "end", 3);
+
+    if (state->out.head - state->out.tail != 503) {
+        result = FAIL;
+    }
+
+    // what switching to it would draw, without starting its shell
+    terminal_sync();
+    if (state->out.head != state->out.tail || state->cursor_y != 24 || state->cursor_x != 3 ||
+        *(uint8_t *)(VID_MEM + (state->origin + 24 * 80) * 2) != 'e' ||
+        *(uint8_t *)(VID_MEM + state->origin * 2) != 'l') {
+        result = FAIL;
+    }
+
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* ANSI Escape Sequence Test
+ *
+ * Writes a status line update with cursor positioning, colors and erases to a terminal and checks
+ * what gets drawn, and that a color change after a full row doesn't cancel its wrap
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Creates terminal 1 (without starting its shell), clears it and leaves text on it
+ * Coverage: escape sequences in the terminal write path
+ * Files: lib.h/c, terminal.h/c
+ */
+int ansi_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    terminal_state_t *state = terminal_create(1);
+    if (state == NULL) {
+        return PASS;
+    }
+
+    unsigned long flags;
+    irq_save(flags);
+
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = 1;
+
+    char *setup = "\x1b[2J\x1b[Hstatus: old value\n";
+    terminal_write(1, setup, strlen(setup));
+    // the sequence is split between two writes
+    char *update = "\x1b[1;9H\x1b[1;3";
+    terminal_write(1, update, strlen(update));
+    char *rest = "1;44mnew\x1b[0m\x1b[K\x1b[3B\x1b[2Cx";
+    terminal_write(1, rest, strlen(rest));
+
+    terminal_sync();
+    uint16_t *cells = (uint16_t *)VID_MEM + state->origin;
+    if (cells[8] != ((0x1C << 8) | 'n') || cells[10] != ((0x1C << 8) | 'w') ||
+        cells[11] != ((0x07 << 8) | ' ') || cells[15] != ((0x07 << 8) | ' ') ||
+        cells[0] != ((0x07 << 8) | 's') || cells[3 * 80 + 13] != ((0x07 << 8) | 'x') ||
+        state->cursor_x != 14 || state->cursor_y != 3 || state->ansi.state != ANSI_NORMAL) {
+        result = FAIL;
+    }
+
+    // a sequence that doesn't move the cursor keeps the wrap pending after a full row
+    char row[80];
+    memset(row, 'a', sizeof(row));
+    char *move = "\x1b[5;1H";
+    char *color = "\x1b[0mb";
+    terminal_write(1, move, strlen(move));
+    terminal_write(1, row, sizeof(row));
+    terminal_write(1, color, strlen(color));
+    terminal_sync();
+    if (cells[4 * 80 + 79] != ((0x07 << 8) | 'a') || cells[5 * 80] != ((0x07 << 8) | 'b') ||
+        state->cursor_x != 1 || state->cursor_y != 5) {
+        result = FAIL;
+    }
+
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Line Discipline Test
+ *
+ * Puts a terminal in raw non-blocking mode, feeds it keys and reads them back as characters and
+ * as key events
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None, terminal 1 is back in canonical mode
+ * Coverage: raw, non-blocking and key event reads, terminal ioctl
+ * Files: terminal.h/c
+ */
+int line_discipline_test() {
+    TEST_HEADER;
+
+    // only created, its shell isn't started
+    if (terminal_create(1) == NULL) {
+        return PASS;
+    }
+
+    int result = PASS;
+    unsigned long flags;
+    irq_save(flags);
+
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = 1;
+
+    char buf[4];
+    key_event_t events[2];
+    key_event_t key = {0x1234, 0x1E, 0, 'a', 0};
+    key_event_t shift = {0x1235, 0x2A, 0, 0, 0};
+
+    if (terminal_ioctl(0, TERMINAL_SET_MODE, TERMINAL_RAW | TERMINAL_NONBLOCK) != 0 ||
+        terminal_ioctl(0, TERMINAL_GET_MODE, 0) != (TERMINAL_RAW | TERMINAL_NONBLOCK) ||
+        terminal_ioctl(0, TERMINAL_SET_MODE, 0x100) != -1 || terminal_read(0, buf, 4) != 0) {
+        result = FAIL;
+    }
+
+    // without TERMINAL_EVENTS only keys that type something are kept
+    terminal_key_event(1, &shift);
+    terminal_key_event(1, &key);
+    if (terminal_read(0, buf, 4) != 1 || buf[0] != 'a' || terminal_read(0, buf, 4) != 0) {
+        result = FAIL;
+    }
+
+    terminal_ioctl(0, TERMINAL_SET_MODE, TERMINAL_RAW | TERMINAL_NONBLOCK | TERMINAL_EVENTS);
+    terminal_key_event(1, &shift);
+    terminal_key_event(1, &key);
+    if (terminal_read(0, buf, 4) != -1 || terminal_read(0, events, sizeof(events)) !=
+        2 * sizeof(key_event_t) || events[0].scancode != 0x2A || events[1].tsc != 0x1234) {
+        result = FAIL;
+    }
+
+    terminal_ioctl(0, TERMINAL_SET_MODE, 0);
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Type-ahead Test
+ *
+ * Enters lines before any read and reads them back one at a time, with buffers smaller than a
+ * line too
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Empties terminal 1's keyboard buffer
+ * Coverage: input line queue, canonical reads
+ * Files: keyboard.h/c, terminal.h/c
+ */
+int type_ahead_test() {
+    TEST_HEADER;
+
+    // only created, its shell isn't started
+    if (terminal_create(1) == NULL) {
+        return PASS;
+    }
+
+    int result = PASS;
+    unsigned long flags;
+    irq_save(flags);
+
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = 1;
+    terminal_ioctl(0, TERMINAL_SET_MODE, TERMINAL_NONBLOCK);
+
+    keyboard_buffer_t *kb = &terminal_get_state(1)->kb_buffer;
+    strcpy(kb->buf, "ls");
+    kb->idx = 2;
+    keyboard_buffer_enter(kb);
+    strcpy(kb->buf, "cat x");
+    kb->idx = 5;
+    keyboard_buffer_enter(kb);
+    strcpy(kb->buf, "gr");
+    kb->idx = 2;
+
+    char buf[BUFFER_SIZE];
+    if (kb->lines_available != 2 || terminal_read(0, buf, BUFFER_SIZE) != 3 ||
+        strncmp(buf, "ls\n", 3) != 0 || terminal_read(0, buf, 2) != 2 ||
+        strncmp(buf, "ca", 2) != 0 || terminal_read(0, buf, BUFFER_SIZE) != 4 ||
+        strncmp(buf, "t x\n", 4) != 0 || terminal_read(0, buf, BUFFER_SIZE) != 0) {
+        result = FAIL;
+    }
+
+    // a full queue refuses the line instead of dropping it
+    int i;
+    for (i = 0; i <= INPUT_QUEUE_SIZE / 3; i++) {
+        strcpy(kb->buf, "gr");
+        kb->idx = 2;
+        keyboard_buffer_enter(kb);
+    }
+    if (keyboard_buffer_enter(kb) != -1 || kb->idx != 2 ||
+        kb->head - kb->tail != INPUT_QUEUE_SIZE / 3 * 3) {
+        result = FAIL;
+    }
+
+    terminal_ioctl(0, TERMINAL_SET_MODE, 0);
+    keyboard_buffer_reset(kb);
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Keyboard Bottom Half Test
+ *
+ * Queues scancodes the way the interrupt handler does and checks the bottom half decodes them
+ * for a raw mode reader, and that a tick can't switch away while preemption is off
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None, the terminal on screen is back in canonical mode
+ * Coverage: scancode ring, keyboard bottom half, preemption guard
+ * Files: keyboard.h/c, terminal.h/c, scheduling.h/c
+ */
+int keyboard_bottom_half_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    unsigned long flags;
+    irq_save(flags);
+
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = screen_terminal_idx;
+    terminal_ioctl(0, TERMINAL_SET_MODE, TERMINAL_RAW | TERMINAL_NONBLOCK | TERMINAL_EVENTS);
+
+    uint32_t scancodes = keyboard_stats.scancodes;
+    keyboard_queue_scancode(0x1E, 100); // 'a' pressed
+    keyboard_queue_scancode(0x9E, 200); // 'a' released
+    keyboard_bottom_half(); // runs with interrupts on, they are off again when it returns
+
+    key_event_t events[3];
+    if (keyboard_stats.scancodes != scancodes + 2 ||
+        terminal_read(0, events, sizeof(events)) != 2 * sizeof(key_event_t) ||
+        events[0].ascii != 'a' || events[0].key != 'a' || events[0].tsc != 100 ||
+        events[1].scancode != 0x9E || events[1].ascii != 0 || events[1].tsc != 200 ||
+        this_cpu()->preempt_count != 0) {
+        result = FAIL;
+    }
+
+    // a tick while draining is put off instead of switching away (and dropped here)
+    scheduler_preempt_disable();
+    if (scheduler_preemptible() || !this_cpu()->resched_pending) {
+        result = FAIL;
+    }
+    this_cpu()->resched_pending = 0;
+    scheduler_preempt_enable();
+    if (this_cpu()->preempt_count != 0 || !scheduler_preemptible()) {
+        result = FAIL;
+    }
+
+    terminal_ioctl(0, TERMINAL_SET_MODE, 0);
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Keymap Test
+ *
+ * Checks the generated decode tables and decodes extended keys through the bottom half in the
+ * second layout
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None, the first layout is back in use
+ * Coverage: keymap tables, extended scancodes, keymap switching
+ * Files: keymap.h/c, keyboard.h/c
+ */
+int keymap_test() {
+    TEST_HEADER;
+
+    int result = PASS;
+    const keymap_t *us = &keymaps[0];
+    if (us->keys[0][0x1E] != 'a' || us->keys[KEYMAP_SHIFT][0x1E] != 'A' ||
+        us->keys[KEYMAP_CAPS][0x1E] != 'A' || us->keys[KEYMAP_SHIFT | KEYMAP_CAPS][0x1E] != 'a' ||
+        us->keys[KEYMAP_CAPS][0x02] != '1' || us->keys[KEYMAP_SHIFT][0x02] != '!' ||
+        us->keys[KEYMAP_CTRL][0x26] != 0x0C || us->keys[KEYMAP_CTRL][0x1C] != '\n' ||
+        us->keys[0][0x48 | KEYMAP_EXTENDED] != KEY_UP || us->keys[0][0x48] != '8' ||
+        us->keys[0][0x2A | KEYMAP_EXTENDED] != KEY_NONE || keymaps[1].keys[0][0x10] != '\'') {
+        result = FAIL;
+    }
+
+    unsigned long flags;
+    irq_save(flags);
+
+    int32_t prev_idx = this_cpu()->terminal_idx;
+    this_cpu()->terminal_idx = screen_terminal_idx;
+    terminal_ioctl(0, TERMINAL_SET_MODE, TERMINAL_RAW | TERMINAL_NONBLOCK | TERMINAL_EVENTS);
+    if (terminal_ioctl(0, TERMINAL_SET_KEYMAP, NUM_KEYMAPS) != -1 ||
+        terminal_ioctl(0, TERMINAL_SET_KEYMAP, 1) != 0) {
+        result = FAIL;
+    }
+
+    // fake shift, gray up arrow, then 's' on the Dvorak home row
+    keyboard_queue_scancode(0xE0, 0);
+    keyboard_queue_scancode(0x2A, 0);
+    keyboard_queue_scancode(0xE0, 0);
+    keyboard_queue_scancode(0x48, 0);
+    keyboard_queue_scancode(0x27, 0);
+    keyboard_bottom_half(); // runs with interrupts on, they are off again when it returns
+
+    key_event_t events[3];
+    if (terminal_read(0, events, sizeof(events)) != 2 * sizeof(key_event_t) ||
+        events[0].key != KEY_UP || events[0].extended != 1 || events[0].ascii != 0 ||
+        events[1].key != 's' || events[1].ascii != 's') {
+        result = FAIL;
+    }
+
+    terminal_ioctl(0, TERMINAL_SET_KEYMAP, 0);
+    terminal_ioctl(0, TERMINAL_SET_MODE, 0);
+    this_cpu()->terminal_idx = prev_idx;
+
+    irq_restore(flags);
+    return result;
+}
+
+/* Scrollback Test
+ *
+ * Pushes rows into a history until it wraps and draws a view a few lines back
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: scrollback history lines and view rendering
+ * Files: scrollback.h/c
+ */
+int scrollback_test() {
+    TEST_HEADER;
+
+    static scrollback_t sb;
+    static uint16_t screen[25 * 80];
+    static uint16_t view[25 * 80];
+
+    int result = PASS;
+    scrollback_init(&sb);
+
+    uint16_t row[80];
+    int i;
+    for (i = 0; i < 80; i++) {
+        row[i] = (0x07 << 8) | ' ';
+    }
+    for (i = 0; i < 25 * 80; i++) {
+        screen[i] = (0x07 << 8) | 's';
+    }
+
+    // 80 character rows take 81 bytes, so the oldest ones get dropped
+    int pushed = SCROLLBACK_SIZE / 81 + 100;
+    for (i = 0; i < pushed; i++) {
+        row[0] = (0x07 << 8) | ('a' + i % 26);
+        row[79] = (0x07 << 8) | 'z';
+        scrollback_push_row(&sb, row, 80);
+    }
+    if (sb.lines != SCROLLBACK_SIZE / 81 || sb.head - sb.tail > SCROLLBACK_SIZE) {
+        result = FAIL;
+    }
+
+    // trailing blanks are not kept
+    row[79] = (0x07 << 8) | ' ';
+    scrollback_push_row(&sb, row, 80);
+    if (sb.buf[(sb.head - 2) & (SCROLLBACK_SIZE - 1)] != 'a' + i % 26) {
+        result = FAIL;
+    }
+
+    scrollback_render(&sb, 2, view, screen, 25, 80);
+    if ((view[0] & 0xFF) != 'a' + (i - 1) % 26 || (view[79] & 0xFF) != 'z' ||
+        (view[80] & 0xFF) != 'a' + i % 26 || (view[80 + 79] & 0xFF) != ' ' ||
+        (view[2 * 80] & 0xFF) != 's' || (view[24 * 80 + 79] & 0xFF) != 's') {
+        result = FAIL;
+    }
+
+    return result;
+}
+
+/* Interrupts-off Tracking Test
+ *
+ * Keeps interrupts disabled over a busy loop and checks the window was measured and recorded as
+ * one of the longest with where it happened
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: Clears the interrupts-off statistics
+ * Coverage: irq_save/irq_restore window tracking
+ * Files: irqtrace.h/c
+ */
+int irqtrace_test() {
+    TEST_HEADER;
+
+    irqtrace_reset();
+
+    unsigned long flags;
+    irq_save(flags);
+    volatile int i;
+    for (i = 0; i < 10000; i++) {
+    }
+    irq_restore(flags);
+
+    // tests run with interrupts on, so the loop above was a window
+    if (irqoff_stats.windows < 1 || irqoff_stats.worst[0].cycles == 0 ||
+        irqoff_stats.worst[0].start == NULL || irqoff_stats.worst[0].end == NULL) {
+        return FAIL;
+    }
+    return PASS;
+}
+
 /* Checkpoint 3 tests */
 
 /* Checkpoint 4 tests */
@@ -434,6 +1580,34 @@ void launch_tests() {
     // TEST_OUTPUT("read_dentry_index", read_dentry_index());
     // TEST_OUTPUT("read_dentry_name", read_dentry_name());
 
+    TEST_OUTPUT("rtc_vtimer_test", rtc_vtimer_test());
+    TEST_OUTPUT("clock_test", clock_test());
+    TEST_OUTPUT("time_page_test", time_page_test());
+    TEST_OUTPUT("timer_wheel_test", timer_wheel_test());
+    TEST_OUTPUT("rt_admission_test", rt_admission_test());
+    TEST_OUTPUT("smp_test", smp_test());
+    TEST_OUTPUT("lapic_timer_test", lapic_timer_test());
+    TEST_OUTPUT("irqtrace_test", irqtrace_test());
+    TEST_OUTPUT("sched_trace_test", sched_trace_test());
+    TEST_OUTPUT("scroll_pan_test", scroll_pan_test());
+    TEST_OUTPUT("page_alloc_test", page_alloc_test());
+    TEST_OUTPUT("terminal_output_test", terminal_output_test());
+    TEST_OUTPUT("scrollback_test", scrollback_test());
+    TEST_OUTPUT("ansi_test", ansi_test());
+    TEST_OUTPUT("line_discipline_test", line_discipline_test());
+    TEST_OUTPUT("type_ahead_test", type_ahead_test());
+    TEST_OUTPUT("keyboard_bottom_half_test", keyboard_bottom_half_test());
+    TEST_OUTPUT("keymap_test", keymap_test());
+
+    // Enable to test terminal switching (starts the shells of the terminals switched to, which a
+    // boot otherwise leaves for their first Alt+F key)
+    // TEST_OUTPUT("lazy_shell_test", lazy_shell_test());
+    // TEST_OUTPUT("terminal_switch_test", terminal_switch_test());
+    // TEST_OUTPUT("terminal_pool_test", terminal_pool_test());
+
+    // Enable to measure putc against putbuf (timing depends on the host, fills the screen)
+    // TEST_OUTPUT("terminal_write_bench", terminal_write_bench());
+
     // Enable to run RTC driver test (takes a few seconds)
     // TEST_OUTPUT("rtc_driver_test", rtc_driver_test());
 
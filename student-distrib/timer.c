@@ -0,0 +1,408 @@
+#include "timer.h"
+
+#include "irqtrace.h"
+#include "lib.h"
+#include "pit.h"
+#include "scheduling.h"
+#include "spinlock.h"
+
+/* Hierarchical timer wheel (same layout as the classic Linux one). The first level has one slot
+ * per tick for the next 256 ticks, each higher level has 64 slots covering 64 times the range of
+ * the level below. A timer is queued in the lowest level whose range covers its expiry, and the
+ * slots of a higher level are cascaded down whenever the level below wraps around. Inserting and
+ * cancelling are O(1), and a tick only touches the timers that are due (plus an occasional
+ * cascade), no matter how many are pending. */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+/* Slot index of level `n` (0 being the first level above tv1) for a given tick. */
+#define TVN_INDEX(ticks, n) (((ticks) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+/* Bits in one word of the tv1 occupancy bitmap */
+#define BITMAP_WORD_BITS 32
+
+static timer_t *tv1[TVR_SIZE];
+static timer_t *tvn[TVN_LEVELS][TVN_SIZE];
+
+/* One bit per tv1 slot, set when the slot is non-empty, so the next expiry is found quickly. */
+static uint32_t tv1_bitmap[TVR_SIZE / BITMAP_WORD_BITS];
+
+/* Next tick the wheel will process. */
+static uint32_t timer_jiffies;
+
+/* Number of armed timers, in total and in the higher levels. */
+static uint32_t timers_pending;
+static uint32_t timers_upper;
+
+/* Protects the wheel. Callbacks run without it, so they can add and cancel timers. */
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/*
+ * timer_link(timer_t **head, timer_t *timer)
+ *   DESCRIPTION: Pushes a timer onto a slot list
+ *
+ *   INPUTS: head - slot list
+ *           timer - timer to add
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+static void timer_link(timer_t **head, timer_t *timer) {
+    timer->next = *head;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+/*
+ * timer_enqueue(timer_t *timer)
+ *   DESCRIPTION: Puts a timer in the slot matching its expiry
+ *
+ *   INPUTS: timer - timer with `expires` set
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Updates the tv1 bitmap and pending counts
+ */
+static void timer_enqueue(timer_t *timer) {
+    uint32_t delta = timer->expires - timer_jiffies;
+
+    // already due (e.g. re-armed from its own callback with 0 ticks), run it on the next tick
+    if ((int32_t)delta < 0) {
+        timer->expires = timer_jiffies;
+        delta = 0;
+    }
+
+    timers_pending++;
+
+    if (delta < TVR_SIZE) {
+        int32_t slot = timer->expires & TVR_MASK;
+        timer->slot = slot;
+        timer_link(&tv1[slot], timer);
+        tv1_bitmap[slot / BITMAP_WORD_BITS] |= 1U << (slot % BITMAP_WORD_BITS);
+        return;
+    }
+
+    timer->slot = -1;
+    timers_upper++;
+
+    int level;
+    for (level = 0; level < TVN_LEVELS - 1; level++) {
+        if (delta < (1U << (TVR_BITS + (level + 1) * TVN_BITS))) {
+            break;
+        }
+    }
+    timer_link(&tvn[level][TVN_INDEX(timer->expires, level)], timer);
+}
+
+/*
+ * timer_dequeue(timer_t *timer)
+ *   DESCRIPTION: Unlinks a pending timer from its slot
+ *
+ *   INPUTS: timer - pending timer
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Updates the tv1 bitmap and pending counts
+ */
+static void timer_dequeue(timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    if (timer->slot >= 0) {
+        if (tv1[timer->slot] == NULL) {
+            tv1_bitmap[timer->slot / BITMAP_WORD_BITS] &= ~(1U << (timer->slot % BITMAP_WORD_BITS));
+        }
+    } else {
+        timers_upper--;
+    }
+
+    timers_pending--;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * timer_cascade(int level)
+ *   DESCRIPTION: Moves the timers of the current slot of a higher level down the wheel
+ *
+ *   INPUTS: level - higher level to cascade from
+ *   OUTPUTS: none
+ *   RETURN VALUE: slot index that was cascaded, 0 means the next level must cascade too
+ *   SIDE EFFECTS: none
+ */
+static uint32_t timer_cascade(int level) {
+    uint32_t index = TVN_INDEX(timer_jiffies, level);
+
+    timer_t *timer = tvn[level][index];
+    tvn[level][index] = NULL;
+
+    while (timer != NULL) {
+        timer_t *next = timer->next;
+        timers_upper--;
+        timers_pending--;
+        timer_enqueue(timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+/*
+ * timer_init()
+ *   DESCRIPTION: Empties the wheel and starts it at the current tick
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void timer_init(void) {
+    memset(tv1, 0, sizeof(tv1));
+    memset(tvn, 0, sizeof(tvn));
+    memset(tv1_bitmap, 0, sizeof(tv1_bitmap));
+    timer_jiffies = pit_ticks;
+    timers_pending = 0;
+    timers_upper = 0;
+}
+
+/*
+ * timer_setup(timer_t *timer, void (*callback)(uint32_t data), uint32_t data)
+ *   DESCRIPTION: Initializes a timer that isn't armed yet
+ *
+ *   INPUTS: timer - timer to set up
+ *           callback - function called when it expires
+ *           data - argument passed to the callback
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+void timer_setup(timer_t *timer, void (*callback)(uint32_t data), uint32_t data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->slot = -1;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/*
+ * timer_add(timer_t *timer, uint32_t ticks)
+ *   DESCRIPTION: Arms a timer to fire after the given number of ticks
+ *
+ *   INPUTS: timer - set up timer
+ *           ticks - delay in ticks, 0 fires on the next tick, at most TIMER_MAX_TICKS
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: May reprogram the PIT for an earlier deadline
+ */
+void timer_add(timer_t *timer, uint32_t ticks) {
+    unsigned long flags;
+    spin_lock_irqsave(&timer_lock, flags);
+
+    if (timer->pprev != NULL) {
+        timer_dequeue(timer);
+    }
+
+    if (ticks > TIMER_MAX_TICKS) {
+        ticks = TIMER_MAX_TICKS;
+    }
+    timer->expires = pit_ticks + (ticks == 0 ? 1 : ticks);
+    timer_enqueue(timer);
+
+    spin_unlock(&timer_lock);
+
+    pit_rearm();
+    irq_restore(flags);
+}
+
+/*
+ * timer_cancel(timer_t *timer)
+ *   DESCRIPTION: Disarms a timer
+ *
+ *   INPUTS: timer - timer to disarm
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the timer was pending, 0 if it had already fired or was never armed
+ *   SIDE EFFECTS: none
+ */
+int32_t timer_cancel(timer_t *timer) {
+    unsigned long flags;
+    spin_lock_irqsave(&timer_lock, flags);
+
+    int32_t was_pending = timer->pprev != NULL;
+    if (was_pending) {
+        timer_dequeue(timer);
+    }
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return was_pending;
+}
+
+/*
+ * timer_pending(timer_t *timer)
+ *   DESCRIPTION: Checks if a timer is armed
+ *
+ *   INPUTS: timer - timer to check
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if pending, 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+int32_t timer_pending(timer_t *timer) { return timer->pprev != NULL; }
+
+/*
+ * timer_run()
+ *   DESCRIPTION: Processes every tick up to pit_ticks, cascading the higher levels when the first
+ *                one wraps and calling the callbacks of expired timers
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Must be called with interrupts disabled
+ */
+void timer_run(void) {
+    spin_lock(&timer_lock);
+
+    while ((int32_t)(pit_ticks - timer_jiffies) >= 0) {
+        uint32_t index = timer_jiffies & TVR_MASK;
+
+        if (index == 0 && timers_upper != 0) {
+            int level;
+            for (level = 0; level < TVN_LEVELS; level++) {
+                if (timer_cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        timer_jiffies++;
+
+        timer_t *timer;
+        while ((timer = tv1[index]) != NULL) {
+            timer_dequeue(timer);
+
+            // once it is dequeued a sleeper on another CPU may return and free the timer
+            void (*callback)(uint32_t data) = timer->callback;
+            uint32_t data = timer->data;
+
+            spin_unlock(&timer_lock);
+            callback(data);
+            spin_lock(&timer_lock);
+        }
+    }
+
+    spin_unlock(&timer_lock);
+}
+
+/*
+ * timer_next_expiry()
+ *   DESCRIPTION: Finds how soon the wheel needs to run again: the first non-empty tv1 slot, or the
+ *                next wrap of tv1 if timers are waiting in the higher levels
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: ticks from pit_ticks (at least 1), TIMER_NO_EXPIRY if nothing is pending
+ *   SIDE EFFECTS: none
+ */
+uint32_t timer_next_expiry(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&timer_lock, flags);
+
+    if (timers_pending == 0) {
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return TIMER_NO_EXPIRY;
+    }
+
+    uint32_t start = timer_jiffies & TVR_MASK;
+    uint32_t offset = TIMER_NO_EXPIRY;
+
+    // scan the bitmap one word at a time, starting at the current slot and wrapping around
+    int i;
+    for (i = 0; i <= TVR_SIZE / BITMAP_WORD_BITS; i++) {
+        uint32_t word_idx = (start / BITMAP_WORD_BITS + i) % (TVR_SIZE / BITMAP_WORD_BITS);
+        uint32_t word = tv1_bitmap[word_idx];
+
+        // only the bits at or after `start` in the first word, only the ones before it in the last
+        if (i == 0) {
+            word &= ~0U << (start % BITMAP_WORD_BITS);
+        } else if (i == TVR_SIZE / BITMAP_WORD_BITS) {
+            word &= (1U << (start % BITMAP_WORD_BITS)) - 1;
+        }
+
+        if (word != 0) {
+            uint32_t slot = word_idx * BITMAP_WORD_BITS + __builtin_ctz(word);
+            offset = (slot - start) & TVR_MASK;
+            break;
+        }
+    }
+
+    // a cascade at the next wrap (which is the next tick itself when start is 0) might bring
+    // down something earlier
+    if (timers_upper != 0) {
+        uint32_t wrap = (TVR_SIZE - start) & TVR_MASK;
+        if (wrap < offset) {
+            offset = wrap;
+        }
+    }
+
+    // offset is relative to timer_jiffies, the next tick to process
+    uint32_t expires = timer_jiffies + offset;
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    if ((int32_t)(expires - pit_ticks) < 1) {
+        return 1;
+    }
+    return expires - pit_ticks;
+}
+
+/*
+ * timer_count()
+ *   DESCRIPTION: Gets the number of armed timers
+ *
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of pending timers
+ *   SIDE EFFECTS: none
+ */
+uint32_t timer_count(void) { return timers_pending; }
+
+/*
+ * timer_sleep_wakeup(uint32_t data)
+ *   DESCRIPTION: Timer callback waking up the process that went to sleep
+ *
+ *   INPUTS: data - pcb of the sleeping process
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: none
+ */
+static void timer_sleep_wakeup(uint32_t data) { scheduler_wake((pcb_t *)data); }
+
+/*
+ * timer_sleep(uint32_t ticks)
+ *   DESCRIPTION: Blocks the current process until the given number of ticks has passed
+ *
+ *   INPUTS: ticks - how long to sleep
+ *   OUTPUTS: none
+ *   RETURN VALUE: void
+ *   SIDE EFFECTS: Other processes (or the idle task) run in the meantime
+ */
+void timer_sleep(uint32_t ticks) {
+    timer_t timer;
+    timer_setup(&timer, timer_sleep_wakeup, (uint32_t)get_scheduler_pcb());
+
+    unsigned long flags;
+    irq_save(flags);
+
+    timer_add(&timer, ticks);
+    while (timer_pending(&timer)) {
+        scheduler_block();
+    }
+
+    irq_restore(flags);
+}
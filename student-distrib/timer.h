@@ -0,0 +1,57 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "types.h"
+
+/* Returned by `timer_next_expiry` when no timer is pending. */
+#define TIMER_NO_EXPIRY 0xFFFFFFFF
+
+/* Longest delay `timer_add` takes, a longer one would wrap past the current tick and look due.
+ * Longer delays are cut to it. */
+#define TIMER_MAX_TICKS 0x7FFFFFFF
+
+/* A kernel timer. The caller owns the memory (it can live on a kernel stack as long as it is
+ * cancelled or has fired before the frame goes away). */
+typedef struct timer {
+    /* Links in the wheel slot's list. `pprev` points at whatever points at us. */
+    struct timer *next;
+    struct timer **pprev;
+
+    /* Absolute pit_ticks value the timer fires at. */
+    uint32_t expires;
+    /* Index in the first wheel level, or -1 when queued in a higher level. */
+    int32_t slot;
+
+    /* Called with interrupts disabled from the PIT handler. */
+    void (*callback)(uint32_t data);
+    uint32_t data;
+} timer_t;
+
+/* Sets up the timer wheel, starting at the current tick. */
+extern void timer_init(void);
+
+/* Prepares a timer with the function to run when it expires. */
+extern void timer_setup(timer_t *timer, void (*callback)(uint32_t data), uint32_t data);
+
+/* Arms a timer `ticks` ticks from now (re-arms it if it was pending). O(1). */
+extern void timer_add(timer_t *timer, uint32_t ticks);
+
+/* Disarms a timer. O(1). Returns 1 if it was pending, 0 otherwise. */
+extern int32_t timer_cancel(timer_t *timer);
+
+/* Whether a timer is armed and hasn't fired yet. */
+extern int32_t timer_pending(timer_t *timer);
+
+/* Runs every timer that expired up to pit_ticks, called from the PIT handler. */
+extern void timer_run(void);
+
+/* Ticks from now until the PIT must next run `timer_run`, or TIMER_NO_EXPIRY. */
+extern uint32_t timer_next_expiry(void);
+
+/* Number of armed timers. */
+extern uint32_t timer_count(void);
+
+/* Blocks the current process for the given number of ticks. */
+extern void timer_sleep(uint32_t ticks);
+
+#endif /* _TIMER_H */
@@ -15,6 +15,13 @@
 #define USER_DS     0x002B
 #define KERNEL_TSS  0x0030
 #define KERNEL_LDT  0x0038
+#define AP_TSS      0x0040  /* TSS of CPU 1, the other application processors follow */
+
+/* Most CPUs the kernel brings up */
+#define MAX_CPUS    4
+
+/* TSS selector of a CPU */
+#define TSS_SELECTOR(cpu)   ((cpu) == 0 ? KERNEL_TSS : AP_TSS + ((cpu) - 1) * 8)
 
 /* Size of the task state segment (TSS) */
 #define TSS_SIZE    104
@@ -129,6 +136,7 @@ extern uint32_t ldt;
 
 extern uint32_t tss_size;
 extern seg_desc_t tss_desc_ptr;
+extern seg_desc_t ap_tss_desc_ptr[MAX_CPUS - 1];
 extern tss_t tss;
 
 /* Sets runtime-settable parameters in the GDT entry for the LDT */
@@ -102,3 +102,85 @@ uint8_t* ece391_strrev(uint8_t* s)
    return s;
 }
 
+
+#define NS_PER_SEC 1000000000
+
+static inline uint64_t rdtsc(void)
+{
+    uint64_t val;
+    asm volatile ("rdtsc" : "=A" (val));
+    return val;
+}
+
+/* Divide a 64-bit number by a 32-bit one, there is no libgcc to do it */
+static inline uint32_t div64_32(uint64_t n, uint32_t d, uint32_t* rem)
+{
+    uint32_t quot;
+    asm ("divl %4" : "=a" (quot), "=d" (*rem)
+         : "a" ((uint32_t)n), "d" ((uint32_t)(n >> 32) % d), "rm" (d));
+    return quot;
+}
+
+/* Read a clock from the time page, retrying while the kernel updates it.
+   Returns -1 for an unknown clock or if the clocks don't run on the TSC. */
+static int32_t time_page_read(uint32_t clock_id, uint64_t* ns)
+{
+    const ece391_time_page_t* page = (const ece391_time_page_t*)ECE391_TIME_PAGE;
+    uint32_t seq;
+    uint64_t counts, high, low;
+
+    if (clock_id != ECE391_CLOCK_REALTIME && clock_id != ECE391_CLOCK_MONOTONIC)
+        return -1;
+
+    do {
+        seq = page->seq;
+        asm volatile ("" : : : "memory");
+        if (page->source != ECE391_CLOCKSOURCE_TSC)
+            return -1;
+
+        /* counts * mult >> shift, in two 32x32 multiplies. Another CPU's TSC set the base,
+           if this one is behind it the clock stays at the base instead of wrapping. */
+        counts = rdtsc() - page->base_counts;
+        if ((int64_t)counts < 0)
+            counts = 0;
+        high = (uint64_t)(uint32_t)(counts >> 32) * page->mult;
+        low = (uint64_t)(uint32_t)counts * page->mult;
+        *ns = page->base_ns + (high << (32 - page->shift)) + (low >> page->shift);
+        if (clock_id == ECE391_CLOCK_REALTIME)
+            *ns += page->boot_epoch_ns;
+        asm volatile ("" : : : "memory");
+    } while ((seq & 1) || seq != page->seq);
+
+    return 0;
+}
+
+/* Scheduler ticks (100 Hz) as of the kernel's last timer interrupt */
+uint32_t ece391_ticks(void)
+{
+    return ((const ece391_time_page_t*)ECE391_TIME_PAGE)->ticks;
+}
+
+/* Nanoseconds since boot, for timing code */
+uint64_t ece391_monotonic_ns(void)
+{
+    uint64_t ns;
+    ece391_timespec_t ts;
+
+    if (time_page_read(ECE391_CLOCK_MONOTONIC, &ns) == 0)
+        return ns;
+
+    (void)ece391_clock_gettime(ECE391_CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* ece391_clock_gettime without the syscall when the time page can be used */
+int32_t ece391_vclock_gettime(uint32_t clock_id, ece391_timespec_t* ts)
+{
+    uint64_t ns;
+
+    if (time_page_read(clock_id, &ns) != 0)
+        return ece391_clock_gettime(clock_id, ts);
+
+    ts->tv_sec = div64_32(ns, NS_PER_SEC, &ts->tv_nsec);
+    return 0;
+}
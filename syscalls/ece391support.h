@@ -1,6 +1,8 @@
 #if !defined(ECE391SUPPORT_H)
 #define ECE391SUPPORT_H
 
+#include "ece391syscall.h"
+
 extern uint32_t ece391_strlen(const uint8_t* s);
 extern void ece391_strcpy(uint8_t* dst, const uint8_t* src);
 extern void ece391_fdputs(int32_t fd, const uint8_t* s);
@@ -9,5 +11,10 @@ extern int32_t ece391_strncmp(const uint8_t* s1, const uint8_t* s2, uint32_t n);
 extern uint8_t *ece391_itoa(uint32_t value, uint8_t* buf, int32_t radix);
 extern uint8_t *ece391_strrev(uint8_t* s);
 
+/* Clocks read from the time page, no syscall unless the kernel doesn't run them on the TSC */
+extern uint32_t ece391_ticks(void);
+extern uint64_t ece391_monotonic_ns(void);
+extern int32_t ece391_vclock_gettime(uint32_t clock_id, ece391_timespec_t* ts);
+
 #endif /* ECE391SUPPORT_H */
 
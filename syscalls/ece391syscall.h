@@ -5,6 +5,104 @@
 
 /* All calls return >= 0 on success or -1 on failure. */
 
+/* Interval for ece391_nanosleep, time from ece391_clock_gettime */
+typedef struct ece391_timespec {
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+} ece391_timespec_t;
+
+/* Clocks for ece391_clock_gettime */
+#define ECE391_CLOCK_REALTIME  0  /* seconds since 1970-01-01 UTC */
+#define ECE391_CLOCK_MONOTONIC 1  /* since boot, nanosecond resolution */
+
+/* Time page the kernel maps read-only into every process, next to the vidmap page. The
+   helpers in ece391support.h read the clocks from it without a syscall. seq is odd while
+   the kernel updates the page and changes with every update. */
+#define ECE391_TIME_PAGE 0x8C01000
+#define ECE391_CLOCKSOURCE_TSC 0  /* source the page can be read on */
+typedef struct ece391_time_page {
+	volatile uint32_t seq;
+	uint32_t source;
+	uint32_t ticks;         /* 100 Hz scheduler ticks at the last update */
+	uint32_t tsc_counts;    /* TSC cycles per tick */
+	uint32_t mult;          /* ns = counts * mult >> shift */
+	uint32_t shift;
+	uint64_t base_counts;   /* TSC at the last update */
+	uint64_t base_ns;       /* ECE391_CLOCK_MONOTONIC then */
+	uint64_t boot_epoch_ns; /* ECE391_CLOCK_REALTIME - ECE391_CLOCK_MONOTONIC */
+} ece391_time_page_t;
+
+/* Real-time statistics filled in by ece391_sched_getrt */
+typedef struct ece391_rt_stats {
+	uint32_t period_ms;
+	uint32_t budget_ms;
+	uint32_t periods;
+	uint32_t missed;
+	uint32_t throttled;
+} ece391_rt_stats_t;
+
+/* Log2 histogram of rdtsc cycle counts, bucket i counts values in [2^i, 2^(i+1)) */
+#define ECE391_SCHED_HIST_BUCKETS 32
+typedef struct ece391_sched_hist {
+	uint32_t count;
+	uint64_t total_cycles;
+	uint32_t max_cycles;
+	uint32_t buckets[ECE391_SCHED_HIST_BUCKETS];
+} ece391_sched_hist_t;
+
+/* The calling process's own scheduler histograms, part of ece391_sched_trace_t */
+typedef struct ece391_sched_task_trace {
+	ece391_sched_hist_t wakeup_latency;
+	ece391_sched_hist_t run_time;
+	uint32_t voluntary_switches;
+} ece391_sched_task_trace_t;
+
+/* Scheduler histograms filled in by ece391_sched_gettrace, over all processes and (in task)
+   for the caller */
+typedef struct ece391_sched_trace {
+	ece391_sched_hist_t wakeup_latency;
+	ece391_sched_hist_t run_time;
+	ece391_sched_hist_t pick_cycles;
+	ece391_sched_hist_t switch_cycles;
+	uint32_t voluntary_switches;
+	ece391_sched_task_trace_t task;
+} ece391_sched_trace_t;
+
+/* Terminal line discipline, set with ece391_ioctl(fd, ECE391_TERMINAL_SET_MODE, flags) */
+#define ECE391_TERMINAL_GET_MODE 1
+#define ECE391_TERMINAL_SET_MODE 2
+#define ECE391_TERMINAL_SET_KEYMAP 3  /* arg 0 US QWERTY, 1 Dvorak */
+#define ECE391_TERMINAL_RAW      0x1  /* keys as they are pressed, no echo */
+#define ECE391_TERMINAL_NONBLOCK 0x2  /* reads return 0 when there is nothing */
+#define ECE391_TERMINAL_EVENTS   0x4  /* raw reads return ece391_key_event_t */
+
+#define ECE391_KEY_MOD_SHIFT 0x1
+#define ECE391_KEY_MOD_CTRL  0x2
+#define ECE391_KEY_MOD_ALT   0x4
+#define ECE391_KEY_MOD_CAPS  0x8
+
+/* Key press or release read in ECE391_TERMINAL_EVENTS mode */
+typedef struct ece391_key_event {
+	uint64_t tsc;
+	uint8_t scancode;
+	uint8_t extended;
+	uint8_t ascii;
+	uint8_t modifiers;
+	uint16_t key;  /* character, or ECE391_KEY_* below */
+} ece391_key_event_t;
+
+#define ECE391_KEY_F1        0x101  /* to ECE391_KEY_F1 + 11 for F12 */
+#define ECE391_KEY_UP        0x110
+#define ECE391_KEY_DOWN      0x111
+#define ECE391_KEY_LEFT      0x112
+#define ECE391_KEY_RIGHT     0x113
+#define ECE391_KEY_HOME      0x114
+#define ECE391_KEY_END       0x115
+#define ECE391_KEY_PAGE_UP   0x116
+#define ECE391_KEY_PAGE_DOWN 0x117
+#define ECE391_KEY_INSERT    0x118
+#define ECE391_KEY_DELETE    0x119
+
 /*  
  * Note that the system call for halt will have to make sure that only
  * the low byte of EBX (the status argument) is returned to the calling
@@ -21,6 +119,13 @@ extern int32_t ece391_getargs (uint8_t* buf, int32_t nbytes);
 extern int32_t ece391_vidmap (uint8_t** screen_start);
 extern int32_t ece391_set_handler (int32_t signum, void* handler);
 extern int32_t ece391_sigreturn (void);
+extern int32_t ece391_sleep (uint32_t ms);
+extern int32_t ece391_nanosleep (const ece391_timespec_t* req);
+extern int32_t ece391_sched_setrt (uint32_t period_ms, uint32_t budget_ms);
+extern int32_t ece391_sched_getrt (ece391_rt_stats_t* stats);
+extern int32_t ece391_sched_gettrace (ece391_sched_trace_t* trace, uint32_t reset);
+extern int32_t ece391_ioctl (int32_t fd, uint32_t request, uint32_t arg);
+extern int32_t ece391_clock_gettime (uint32_t clock_id, ece391_timespec_t* ts);
 
 enum signums {
 	DIV_ZERO = 0,
@@ -11,5 +11,12 @@
 #define SYS_VIDMAP  8
 #define SYS_SET_HANDLER  9
 #define SYS_SIGRETURN  10
+#define SYS_SLEEP   11
+#define SYS_NANOSLEEP  12
+#define SYS_SCHED_SETRT  13
+#define SYS_SCHED_GETRT  14
+#define SYS_SCHED_GETTRACE  15
+#define SYS_IOCTL   16
+#define SYS_CLOCK_GETTIME  17
 
 #endif /* ECE391SYSNUM_H */